@@ -0,0 +1,159 @@
+/*
+Throughput benchmarks for libbproto.
+
+  make bench                     run with defaults
+  build/bench/bproto [MB [THREADS]]
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bproto.h"
+#include "bproto_packed.h"
+#include "bproto_par.h"
+
+#define BENCH_DEFAULT_MB 256
+
+static double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+Random valid messages, one per line, filling `len` bytes.
+*/
+static size_t bench_gen(char *buf, size_t len) {
+  size_t n = 0, lines = 0;
+  unsigned int seed = 1;
+  while (n + 32 < len) {
+    bproto_t b;
+    bproto_init(&b);
+    int r = rand_r(&seed);
+    if (r & 1)  b.red   = rand_r(&seed) % 256;
+    if (r & 2)  b.green = rand_r(&seed) % 256;
+    if (r & 4)  b.blue  = rand_r(&seed) % 256;
+    if (r & 8)  b.white = rand_r(&seed) % 256;
+    if (r & 16 || !bproto_is_set(&b)) b.time = rand_r(&seed) % 100000;
+
+    char *ptr = buf + n;
+    n += bproto_snprint(&ptr, len - n, &b);
+    buf[n++] = '\n';
+    lines++;
+  }
+  memset(buf + n, '\n', len - n);
+  return lines;
+}
+
+static void bench_parse(const char *buf, size_t len, const char *label) {
+  bproto_t b;
+  size_t n = 0;
+  double start = bench_now();
+  for (const char *ptr = buf, *end = buf + len; ptr < end;) {
+    const char *nl = memchr(ptr, '\n', end - ptr);
+    if (nl > ptr) {
+      if (label[0] == 'v') {
+	n += bproto_validate_n(ptr, nl - ptr);
+      } else {
+	n += bproto_parse_n(&b, ptr, nl - ptr) != ptr;
+      }
+    }
+    ptr = nl + 1;
+  }
+  double secs = bench_now() - start;
+  printf("%-24s %8.1f MB/s %8.1f M msg/s\n", label, len / secs / 1e6, n / secs / 1e6);
+}
+
+/*
+Merge and compare `n` messages as bproto_t arrays and as a bproto_batch_t.
+*/
+static void bench_batch(bproto_t *msgs, size_t n) {
+  bproto_t *dst = malloc(n * sizeof(bproto_t));
+  uint8_t *eq = malloc(n);
+  bproto_batch_t x, y;
+  if (dst == NULL || eq == NULL || bproto_batch_init(&x, n) < 0 || bproto_batch_init(&y, n) < 0) {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(dst, msgs + 1, (n - 1) * sizeof(bproto_t));
+  dst[n - 1] = msgs[0];
+  bproto_batch_load(&x, msgs, n);
+  bproto_batch_load(&y, dst, n);
+
+  size_t equal = 0, batch_equal;
+  double start = bench_now();
+  for (size_t i = 0; i < n; i++) {
+    bproto_copy(&msgs[i], &dst[i]);
+    equal += bproto_eq(&msgs[i], &dst[i]);
+  }
+  double secs = bench_now() - start;
+  printf("%-24s %8.1f M msg/s\n", "bproto_copy+eq", n / secs / 1e6);
+
+  start = bench_now();
+  bproto_batch_copy(&x, &y);
+  batch_equal = bproto_batch_eq(&x, &y, eq);
+  secs = bench_now() - start;
+  printf("%-24s %8.1f M msg/s\n", "bproto_batch_copy+eq", n / secs / 1e6);
+
+  if (equal != batch_equal) {
+    fprintf(stderr, "batch mismatch\n");
+    exit(1);
+  }
+  bproto_batch_free(&x);
+  bproto_batch_free(&y);
+  free(eq);
+  free(dst);
+}
+
+int main(int argc, char **argv) {
+  size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_DEFAULT_MB;
+  int max_threads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+  size_t len = mb * 1024 * 1024;
+
+  char *buf = malloc(len);
+  if (buf == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  size_t lines = bench_gen(buf, len);
+  bproto_t *out = malloc(lines * sizeof(bproto_t));
+  if (out == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  printf("%zu MB, %zu messages\n\n", mb, lines);
+
+  bench_parse(buf, len, "parse_n");
+  bench_parse(buf, len, "validate_n");
+  printf("\n");
+
+  double base = 0;
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    bproto_par_result_t res;
+    double start = bench_now();
+    bproto_par_status_t status = bproto_parse_lines_parallel(out, lines, buf, len, threads, &res);
+    double secs = bench_now() - start;
+    if (status != BPROTO_PAR_OK || res.count != lines) {
+      fprintf(stderr, "parse_lines failed: status=%d count=%zu\n", status, res.count);
+      return 1;
+    }
+    if (threads == 1) {
+      base = secs;
+    }
+    printf("parse_lines threads=%-4d %8.1f MB/s  speedup %.2fx\n",
+	   threads, len / secs / 1e6, base / secs);
+    if (threads < max_threads && threads * 2 > max_threads) {
+      threads = max_threads / 2;
+    }
+  }
+
+  printf("\n");
+  bench_batch(out, lines);
+
+  free(out);
+  free(buf);
+  return 0;
+}
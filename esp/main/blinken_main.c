@@ -1,6 +1,9 @@
 #include "esp_err.h"
 #include "esp_event_loop.h"
 #include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_vfs_dev.h"
 #include "esp_wifi.h"
 
 #include "freertos/FreeRTOS.h"
@@ -8,15 +11,35 @@
 #include "freertos/task.h"
 
 #include "driver/ledc.h"
+#include "driver/uart.h"
+#include "soc/ledc_reg.h"
+#include "soc/ledc_struct.h"
+#include "xtensa/hal.h"
 
 #include "coap.h"
+#include "lwip/sockets.h"
 #include "mdns.h"
+#include "nvs.h"
 #include "nvs_flash.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include <unistd.h>
 
 #include "blinken_main.h"
 #include "bproto.h"
+#include "bproto_dmx.h"
+#include "bproto_ease.h"
+#include "bproto_fade.h"
+#include "bproto_ledc.h"
+#include "bproto_loop.h"
+#include "bproto_packed.h"
+#include "bproto_pool.h"
+#include "bproto_rate.h"
+#include "bproto_stream.h"
 
 static const char *TAG = "blinken";
 
@@ -61,6 +84,25 @@ static esp_err_t wifi_event_handler(void *ctx, system_event_t *event) {
   return ESP_OK;
 }
 
+/*******************************************************************************
+ * Event loop
+ *
+ * Every input (COAP, DMX, UART) and every timer runs on one task, multiplexed
+ * with select() over non-blocking descriptors by bproto_loop, instead of a
+ * task and a stack each. Callbacks run to completion on the loop task, so
+ * they must never block.
+ ******************************************************************************/
+static bproto_loop_t loop;
+
+static uint32_t loop_clock() {
+  return esp_timer_get_time() / 1000;
+}
+
+static int loop_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
 /*******************************************************************************
  * WiFi
  ******************************************************************************/
@@ -92,17 +134,62 @@ static void wifi_conn_init() {
  * LED control
  ******************************************************************************/
 static bproto_t b;
+static portMUX_TYPE led_mux = portMUX_INITIALIZER_UNLOCKED;
+static intr_handle_t led_isr_handle;
+
+/*
+A fade, run as a chain of short linear hardware fades (one for linear
+fades). The fade-end interrupt of each segment programs and starts the next,
+so the curve plays out without the CPU or the network stepping it. The
+segments and their ramps come from bproto_fade, so host previews match.
+*/
+typedef struct {
+  bproto_fade_t fade; // no segments if none is running
+  uint8_t seg;        // segments started
+} led_chain_t;
+
+static const bproto_fade_cfg_t led_fade_cfg = {
+  .pwm_hz = BLINKEN_PWM_HZ,
+  .max_duty = BLINKEN_MAX_DUTY,
+  .num_max = BLINKEN_FADE_NUM_MAX,
+  .segments = BLINKEN_EASE_SEGMENTS,
+  .segment_min_ms = BLINKEN_EASE_SEGMENT_MIN_MS,
+};
+
+static led_chain_t led_chains[BLINKEN_CH_NUM];
+static bproto_timer_t led_done[BLINKEN_CH_NUM]; // due when each channel's fade should be over
+static unsigned led_stalls = 0;
+
+/*
+The state as served by GET /led, serialized on the first read after each
+change. `led_etag` changes whenever led_set() commits a different state and
+starts from a random value, so tags handed out before a reboot don't match.
+*/
+static uint32_t led_etag;
+static uint32_t led_repr_etag;
+static char led_repr_data[BLINKEN_REPR_LEN];
+static int led_repr_len = -1;
+
+static void led_fade_isr(void*);
+static void led_fade_done(bproto_timer_t*, void*);
+
+// LEDC channels in bproto field order
+#define LED_CHANNEL(m, NAME, l) BLINKEN_CH_##NAME##_CHANNEL,
+static const ledc_channel_t led_channels[BLINKEN_CH_NUM] = {
+  BPROTO_CHANNEL_TABLE(LED_CHANNEL)
+};
+#undef LED_CHANNEL
 
 static void led_init() {
   ESP_LOGI(TAG, "Initialising LED PWM");
 
   // Clear current configuration, ready for future updates via COAP
+  bproto_value_t off[BLINKEN_CH_NUM] = { 0 };
   bproto_init(&b);
-  b.red = 0;
-  b.green = 0;
-  b.blue = 0;
-  b.white = 0;
+  bproto_set_channels(&b, off);
   b.time = 0;
+  b.ease = BPROTO_EASE_LINEAR;
+  led_etag = esp_random();
 
   ESP_LOGD(TAG, "Configuring PWM timer");
   ledc_timer_config_t ledc_timer = {
@@ -113,97 +200,494 @@ static void led_init() {
   };
   ledc_timer_config(&ledc_timer);
 
-  struct {
-    int gpio_num;
-    ledc_channel_t channel;
-  } channels[BLINKEN_CH_NUM] = {
-    {.channel  = BLINKEN_CHR_CHANNEL,
-     .gpio_num = BLINKEN_CHR_GPIO
-    },
-    {.channel  = BLINKEN_CHG_CHANNEL,
-     .gpio_num = BLINKEN_CHG_GPIO
-    },
-    {.channel  = BLINKEN_CHB_CHANNEL,
-     .gpio_num = BLINKEN_CHB_GPIO
-    },
-    {.channel  = BLINKEN_CHW_CHANNEL,
-     .gpio_num = BLINKEN_CHW_GPIO
-    },
+#define LED_GPIO(m, NAME, l) BLINKEN_CH_##NAME##_GPIO,
+  int gpios[BLINKEN_CH_NUM] = {
+    BPROTO_CHANNEL_TABLE(LED_GPIO)
   };
+#undef LED_GPIO
 
   ledc_channel_config_t ch = {
     .duty = 0,
     .speed_mode = BLINKEN_MODE,
+    .intr_type = LEDC_INTR_FADE_END, // Advances eased fade chains
     .timer_sel = BLINKEN_TIMER
   };
   
   for (int i = 0; i < BLINKEN_CH_NUM; i++) {
-    ch.channel = channels[i].channel;
-    ch.gpio_num = channels[i].gpio_num;
+    ch.channel = led_channels[i];
+    ch.gpio_num = gpios[i];
     ESP_LOGD(TAG,
 	     "Init LED channel. channel=%d, gpio_num=%d, duty=%d, speed_mode=%d, timer_sel=%d",
 	     ch.channel, ch.gpio_num, ch.duty, ch.speed_mode, ch.timer_sel);
     ledc_channel_config(&ch);
+    bproto_timer_init(&led_done[i], led_fade_done, (void*)(intptr_t)i);
   }
 
-  ESP_LOGD(TAG, "Init hardware PWM fading.");
-  ledc_fade_func_install(0);
+  // Fades are programmed directly with ledc_set_fade() and started with
+  // ledc_update_duty(), so the driver's fade service is not installed. Its
+  // interrupt handler is replaced by ours, which only chains eased fades.
+  ESP_ERROR_CHECK( ledc_isr_register(led_fade_isr, NULL, 0, &led_isr_handle) );
 }
 
-static inline esp_err_t led_set_duty(ledc_channel_t channel, bproto_value_t val, bproto_time_t time) {
-  if (time == BPROTO_TIME_UNSET) {
-    time = 0;
+static inline void led_values(bproto_t *x, bproto_value_t vals[BLINKEN_CH_NUM]) {
+  bproto_channels(x, vals);
+}
+
+/*
+Program (but don't start) segment `seg` (1-based) of a fade. Doesn't log,
+so it can be used from the fade-end interrupt.
+*/
+static esp_err_t led_chain_fade(ledc_channel_t channel, const led_chain_t *c, int seg) {
+  bproto_ramp_t r;
+  bproto_fade_seg_ramp(&r, &led_fade_cfg, &c->fade, seg);
+  return ledc_set_fade(BLINKEN_MODE, channel, r.start,
+		       r.dir > 0 ? LEDC_DUTY_DIR_INCREASE : LEDC_DUTY_DIR_DECREASE,
+		       r.steps, r.cycles, r.scale);
+}
+
+/*
+Start the next segment of every chain whose current segment just finished.
+*/
+static void led_fade_isr(void *arg) {
+  uint32_t status = LEDC.int_st.val;
+
+  portENTER_CRITICAL_ISR(&led_mux);
+  for (int i = 0; i < BLINKEN_CH_NUM; i++) {
+    led_chain_t *c = &led_chains[i];
+    ledc_channel_t channel = led_channels[i];
+    if (!(status & (LEDC_DUTY_CHNG_END_HSCH0_INT_ST << channel)) || c->seg >= c->fade.segs) {
+      continue;
+    }
+    c->seg++;
+    if (led_chain_fade(channel, c, c->seg) != ESP_OK ||
+	ledc_update_duty(BLINKEN_MODE, channel) != ESP_OK) {
+      c->fade.segs = 0;
+    }
   }
-  uint32_t duty = val * BLINKEN_MAX_DUTY / BPROTO_VALUE_T_MAX;
-  ESP_LOGD(TAG, "Setting LED channel. channel=%d, val=%d, time=%d, duty=%d",
-	   channel, val, time, duty);
+  LEDC.int_clr.val = status;
+  portEXIT_CRITICAL_ISR(&led_mux);
+}
+
+/*
+Fade-complete event, from the event loop once a channel's fade should have
+finished. A chain the interrupt failed to advance is cut short at its target,
+so a lost segment can't leave a channel stuck partway.
+*/
+static void led_fade_done(bproto_timer_t *timer, void *ctx) {
+  int i = (intptr_t)ctx;
+  led_chain_t *c = &led_chains[i];
+
+  portENTER_CRITICAL(&led_mux);
+  bool stalled = c->seg < c->fade.segs || c->fade.segs == 0;
+  if (stalled) {
+    c->fade.segs = 0;
+    ledc_set_duty(BLINKEN_MODE, led_channels[i], c->fade.to);
+    ledc_update_duty(BLINKEN_MODE, led_channels[i]);
+  }
+  portEXIT_CRITICAL(&led_mux);
+
+  if (stalled) {
+    led_stalls++;
+    ESP_LOGW(TAG, "LED fade stalled, jumped to target. channel=%d, stalls=%u", i, led_stalls);
+  } else {
+    ESP_LOGD(TAG, "LED fade done. channel=%d", i);
+  }
+}
+
+/*
+Program (but don't start) a fade from the current duty to `val`: its first
+segment, with the rest of the chain described in `chain`.
+*/
+static esp_err_t led_set_duty(ledc_channel_t channel, bproto_value_t val, bproto_time_t time,
+			      bproto_value_t ease, led_chain_t *chain) {
+  uint32_t cur = ledc_get_duty(BLINKEN_MODE, channel);
+  bproto_fade_plan(&chain->fade, &led_fade_cfg, cur, val, time, ease);
+  chain->seg = 1;
+
+  ESP_LOGD(TAG, "Setting LED channel. channel=%d, val=%d, time=%d, ease=%d, duty=%u, cur=%u, segments=%d",
+	   channel, val, chain->fade.time, chain->fade.ease, chain->fade.to, cur, chain->fade.segs);
+
+  return led_chain_fade(channel, chain, 1);
+}
+
+/*
+An update in progress: the message being applied and the fades programmed
+for it, which replace the running chains as each channel starts.
+*/
+typedef struct {
+  const bproto_t *msg;
+  bproto_value_t vals[BLINKEN_CH_NUM];
+  led_chain_t chains[BLINKEN_CH_NUM];
+} led_batch_t;
+
+static int led_batch_program(int i, void *ctx) {
+  led_batch_t *batch = ctx;
+  return led_set_duty(led_channels[i], batch->vals[i], batch->msg->time, batch->msg->ease,
+		      &batch->chains[i]);
+}
+
+static int led_batch_start(int i, void *ctx) {
+  led_batch_t *batch = ctx;
+  // Drop fade-end interrupts from the fade being replaced
+  LEDC.int_clr.val = LEDC_DUTY_CHNG_END_HSCH0_INT_ST << led_channels[i];
+  led_chains[i] = batch->chains[i];
+  return ledc_update_duty(BLINKEN_MODE, led_channels[i]);
+}
+
+static void led_batch_lock(void *ctx) {
+  portENTER_CRITICAL(&led_mux);
+}
 
-  return ledc_set_fade_with_time(BLINKEN_MODE, channel, duty, time);
+static void led_batch_unlock(void *ctx) {
+  portEXIT_CRITICAL(&led_mux);
 }
 
-static inline esp_err_t led_update_duty(ledc_channel_t channel) {
-  ESP_LOGD(TAG, "Updating LED channel. channel=%d", channel);
-  return ledc_fade_start(BLINKEN_MODE, channel, LEDC_FADE_NO_WAIT);
+static uint32_t led_batch_clock(void *ctx) {
+  return xthal_get_ccount();
 }
 
-esp_err_t led_set_channel(ledc_channel_t channel, bproto_value_t val, bproto_time_t time) {
-  if (val == BPROTO_VALUE_UNSET) {
-    return ESP_OK;
+static const bproto_ledc_ops_t led_ledc_ops = {
+  .program = led_batch_program,
+  .start = led_batch_start,
+  .lock = led_batch_lock,
+  .unlock = led_batch_unlock,
+  .clock = led_batch_clock,
+};
+
+static bproto_ledc_t led_ledc = { .ops = &led_ledc_ops };
+
+/*
+Program every channel in `mask`, then start them all in one critical section
+so long fades on different channels stay in step.
+*/
+static esp_err_t led_update(bproto_t *new, bproto_ledc_mask_t mask) {
+  led_batch_t batch = { .msg = new };
+  led_values(new, batch.vals);
+
+  // Stop running chains first, so the interrupt can't reprogram a channel
+  // between here and the start below
+  portENTER_CRITICAL(&led_mux);
+  for (int i = 0; i < BLINKEN_CH_NUM; i++) {
+    if (mask & BIT(i)) {
+      led_chains[i].fade.segs = 0;
+    }
   }
-  esp_err_t res = led_set_duty(channel, val, time);
-  if (res != ESP_OK) {
+  portEXIT_CRITICAL(&led_mux);
+
+  uint32_t skew_max = led_ledc.skew_max;
+  esp_err_t res = bproto_ledc_update(&led_ledc, mask, &batch);
+  if (res != ESP_OK || mask == 0) {
     return res;
   }
-  return led_update_duty(channel);
+
+  for (int i = 0; i < BLINKEN_CH_NUM; i++) {
+    if (mask & BIT(i)) {
+      bproto_timer_start(&loop, &led_done[i],
+			 bproto_fade_length(&batch.chains[i].fade, &led_fade_cfg) + BLINKEN_FADE_SLACK_MS);
+    }
+  }
+
+  ESP_LOGD(TAG, "Started LED channels. mask=0x%x, skew=%u cycles", mask, led_ledc.skew);
+  if (led_ledc.skew_max > skew_max) {
+    ESP_LOGI(TAG, "New maximum LED channel start skew: %u cycles", led_ledc.skew_max);
+  }
+  return res;
 }
 
-esp_err_t led_set(bproto_t *new) {
-  
-  ESP_LOGD(TAG, "Updating all LED channels.");
-  esp_err_t res = ESP_OK;
+/*
+Apply `new` on top of the current state. The ETag of the resulting state goes
+in `etag` unless it is NULL. Only for the event loop, which runs every input
+and the fade timers this arms, so nothing changes the state between a
+caller's checks and this.
+*/
+esp_err_t led_set_etag(bproto_t *new, uint32_t *etag) {
+  bproto_ledc_mask_t dirty = bproto_ledc_dirty(new, &b);
+  ESP_LOGD(TAG, "Updating LED channels. dirty=0x%x", dirty);
 
-  ESP_HOLD_ERR(res, led_set_channel(BLINKEN_CHR_CHANNEL, new->red,   new->time));
-  ESP_HOLD_ERR(res, led_set_channel(BLINKEN_CHG_CHANNEL, new->green, new->time));
-  ESP_HOLD_ERR(res, led_set_channel(BLINKEN_CHB_CHANNEL, new->blue,  new->time));
-  ESP_HOLD_ERR(res, led_set_channel(BLINKEN_CHW_CHANNEL, new->white, new->time));
+  esp_err_t res = led_update(new, dirty);
 
-  if (res != ESP_OK && new != &b) {
+  if (res != ESP_OK) {
     ESP_LOGE(TAG, "Couldn't set all duties. reverting.");
     b.time = 0;
-    led_set(&b);
+    b.ease = BPROTO_EASE_LINEAR;
+    led_update(&b, BLINKEN_CH_ALL);
+    led_etag++;
+  } else {
+    bproto_t next = b;
+    bproto_copy(new, &next);
+    if (!bproto_eq(&next, &b)) {
+      b = next;
+      led_etag++;
+    }
+  }
+  if (etag != NULL) {
+    *etag = led_etag;
+  }
+  return res;
+}
+
+esp_err_t led_set(bproto_t *new) {
+  return led_set_etag(new, NULL);
+}
+
+/*
+The serialized state and its ETag. Only re-serializes when the state has
+changed since the last call; the data stays valid until the next call, so
+this is only for the event loop.
+*/
+static int led_repr(const char **data, uint32_t *etag) {
+  if (led_repr_len < 0 || led_repr_etag != led_etag) {
+    char *ptr = led_repr_data;
+    led_repr_len = bproto_snprint(&ptr, sizeof(led_repr_data), &b);
+    led_repr_etag = led_etag;
+  }
+  *data = led_repr_data;
+  *etag = led_repr_etag;
+  return led_repr_len;
+}
+
+/*******************************************************************************
+ * Scenes
+ *
+ * Presets stored already parsed, so recalling one is a lookup and led_set().
+ * Each is kept in RAM and, in packed form, in NVS so it survives a reboot.
+ ******************************************************************************/
+static bproto_t scenes[BLINKEN_SCENES];
+
+static void scene_key(char key[8], int id) {
+  snprintf(key, 8, "scene%d", id);
+}
+
+static void scene_init() {
+  nvs_handle nvs;
+  for (int i = 0; i < BLINKEN_SCENES; i++) {
+    bproto_init(&scenes[i]);
+  }
+  if (nvs_open(BLINKEN_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+    ESP_LOGD(TAG, "No stored scenes.");
+    return;
+  }
+
+  int loaded = 0;
+  for (int i = 0; i < BLINKEN_SCENES; i++) {
+    char key[8];
+    bproto_packed_t packed;
+    size_t len = sizeof(packed);
+    scene_key(key, i);
+    if (nvs_get_blob(nvs, key, &packed, &len) == ESP_OK && len == sizeof(packed)) {
+      bproto_unpack(&scenes[i], &packed);
+      loaded++;
+    }
+  }
+  nvs_close(nvs);
+  ESP_LOGI(TAG, "Loaded %d stored scenes.", loaded);
+}
+
+/*
+Store `scene` as preset `id`, in RAM and NVS.
+*/
+static esp_err_t scene_store(int id, bproto_t *scene) {
+  nvs_handle nvs;
+  char key[8];
+  bproto_packed_t packed;
+
+  scene_key(key, id);
+  bproto_pack(&packed, scene);
+  esp_err_t res = nvs_open(BLINKEN_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+  if (res == ESP_OK) {
+    ESP_HOLD_ERR(res, nvs_set_blob(nvs, key, &packed, sizeof(packed)));
+    ESP_HOLD_ERR(res, nvs_commit(nvs));
+    nvs_close(nvs);
+  }
+  if (res != ESP_OK) {
+    ESP_LOGE(TAG, "Couldn't save scene %d: %s", id, esp_err_to_name(res));
     return res;
   }
+  scenes[id] = *scene;
+  return ESP_OK;
+}
 
-  if (new != &b) {
-    bproto_copy(new, &b);
+/*
+Apply preset `id`. Returns ESP_ERR_NOT_FOUND if it was never stored.
+*/
+static esp_err_t scene_recall(int id) {
+  if (!bproto_is_set(&scenes[id])) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  return led_set(&scenes[id]);
+}
+
+/*******************************************************************************
+ * COAP memory pools
+ *
+ * libcoap allocates a PDU, its buffer and a queue node for every request and
+ * response. Once the server is up, those allocations are served from
+ * fixed-size blocks (bproto_pool.h) instead of the heap. The linker redirects
+ * libcoap's allocator here (-Wl,--wrap, see component.mk); requests that don't
+ * fit a block, or arrive while a pool is empty, fall through to the heap.
+ ******************************************************************************/
+#if BLINKEN_COAP_POOL
+#define COAP_POOL_NUM (2)
+#define COAP_POOL_SMALL_SIZE BPROTO_POOL_ALIGN(BLINKEN_COAP_POOL_SMALL_SIZE)
+#define COAP_POOL_LARGE_SIZE BPROTO_POOL_ALIGN(BLINKEN_COAP_POOL_LARGE_SIZE)
+
+static uint8_t coap_pool_small_arena[BLINKEN_COAP_POOL_SMALL_COUNT][COAP_POOL_SMALL_SIZE]
+  __attribute__((aligned(sizeof(void*))));
+static uint8_t coap_pool_large_arena[BLINKEN_COAP_POOL_LARGE_COUNT][COAP_POOL_LARGE_SIZE]
+  __attribute__((aligned(sizeof(void*))));
+
+// Smallest block size first, so allocations take the tightest fit
+static bproto_pool_t coap_pools[COAP_POOL_NUM] = {
+  {
+    .name = "small",
+    .size = COAP_POOL_SMALL_SIZE,
+    .count = BLINKEN_COAP_POOL_SMALL_COUNT,
+    .arena = (uint8_t*)coap_pool_small_arena,
+  },
+  {
+    .name = "large",
+    .size = COAP_POOL_LARGE_SIZE,
+    .count = BLINKEN_COAP_POOL_LARGE_COUNT,
+    .arena = (uint8_t*)coap_pool_large_arena,
+  },
+};
+static portMUX_TYPE coap_pool_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool coap_pool_enabled = false;
+
+void *__real_coap_malloc_type(coap_memory_tag_t, size_t);
+void __real_coap_free_type(coap_memory_tag_t, void*);
+
+static void coap_pool_init() {
+  for (int i = 0; i < COAP_POOL_NUM; i++) {
+    bproto_pool_init(&coap_pools[i]);
+  }
+}
+
+static void coap_pool_log_stats() {
+  for (int i = 0; i < COAP_POOL_NUM; i++) {
+    bproto_pool_t *pool = &coap_pools[i];
+    ESP_LOGI(TAG, "COAP %s pool: %u/%u blocks of %u bytes in use, "
+	     "high water %u, exhausted %u times.", pool->name,
+	     (unsigned)pool->used, (unsigned)pool->count, (unsigned)pool->size,
+	     (unsigned)pool->high_water, (unsigned)pool->exhausted);
+  }
+}
+
+void *__wrap_coap_malloc_type(coap_memory_tag_t type, size_t size) {
+  bproto_pool_t *pool = NULL;
+  void *block = NULL;
+  size_t high_water = 0;
+  bool grew = false;
+  uint32_t exhausted = 0;
+
+  if (coap_pool_enabled) {
+    pool = bproto_pool_fit(coap_pools, COAP_POOL_NUM, size);
+  }
+
+  if (pool) {
+    portENTER_CRITICAL(&coap_pool_mux);
+    high_water = pool->high_water;
+    block = bproto_pool_alloc(pool);
+    grew = pool->high_water != high_water;
+    high_water = pool->high_water;
+    exhausted = pool->exhausted;
+    portEXIT_CRITICAL(&coap_pool_mux);
+
+    if (block) {
+      if (grew) {
+	ESP_LOGD(TAG, "COAP %s pool high water: %u/%u.", pool->name,
+		 (unsigned)high_water, (unsigned)pool->count);
+      }
+      return block;
+    }
+    // Warn on the first miss and then only every so often under load
+    if (exhausted % BLINKEN_COAP_POOL_LOG_EVERY == 1) {
+      ESP_LOGW(TAG, "COAP %s pool exhausted (%u times), using heap for %u bytes.",
+	       pool->name, (unsigned)exhausted, (unsigned)size);
+    }
+  }
+
+  return __real_coap_malloc_type(type, size);
+}
+
+void __wrap_coap_free_type(coap_memory_tag_t type, void *ptr) {
+  bproto_pool_t *pool = bproto_pool_find(coap_pools, COAP_POOL_NUM, ptr);
+
+  if (pool) {
+    portENTER_CRITICAL(&coap_pool_mux);
+    bproto_pool_free(pool, ptr);
+    portEXIT_CRITICAL(&coap_pool_mux);
+  } else {
+    __real_coap_free_type(type, ptr);
   }
-  return res;
 }
+#endif
 
 /*******************************************************************************
  * COAP
  ******************************************************************************/
 #define COAP_BUF_LEN (32)
+#define COAP_ETAG_LEN (4)
+
+#if BLINKEN_RATE
+// Per-peer token buckets (bproto_rate.h), keyed by source address
+static bproto_rate_bucket_t rate_buckets[BLINKEN_RATE_PEERS];
+static bproto_rate_t rate_limit;
+
+static void rate_key(const coap_address_t *peer, uint8_t key[BPROTO_RATE_KEY_LEN]) {
+  memset(key, 0, BPROTO_RATE_KEY_LEN);
+#if BLINKEN_IPV6
+  memcpy(key, &peer->addr.sin6.sin6_addr, 16);
+#else
+  memcpy(key, &peer->addr.sin.sin_addr, 4);
+#endif
+}
+
+// Take a token for peer. Returns false if it's over its limit.
+static bool rate_admit(const coap_address_t *peer) {
+  uint8_t key[BPROTO_RATE_KEY_LEN];
+  rate_key(peer, key);
+  return bproto_rate_admit(&rate_limit, key, loop_clock());
+}
+
+// Answer 4.29 Too Many Requests. Max-Age says when to retry (RFC 8516).
+static void rate_reject(coap_pdu_t *response) {
+  unsigned char buf[4];
+  response->hdr->code = COAP_RESPONSE_CODE(429);
+  coap_add_option(response, COAP_OPTION_MAXAGE,
+		  coap_encode_var_bytes(buf, 1), buf);
+}
+#endif
+
+static void coap_etag(uint32_t etag, unsigned char tag[COAP_ETAG_LEN]) {
+  tag[0] = etag >> 24;
+  tag[1] = etag >> 16;
+  tag[2] = etag >> 8;
+  tag[3] = etag;
+}
+
+/*
+Whether any `type` option (ETag or If-Match) of `request` carries `tag`. An
+empty If-Match matches any current state (RFC 7252 5.10.8.1).
+*/
+static bool coap_etag_match(coap_pdu_t *request, unsigned short type,
+			    const unsigned char tag[COAP_ETAG_LEN]) {
+  coap_opt_iterator_t it;
+  coap_opt_filter_t filter;
+  coap_opt_t *opt;
+
+  coap_option_filter_clear(filter);
+  coap_option_setb(filter, type);
+  coap_option_iterator_init(request, &it, filter);
+  while ((opt = coap_option_next(&it)) != NULL) {
+    unsigned short len = coap_opt_length(opt);
+    if ((len == 0 && type == COAP_OPTION_IF_MATCH) ||
+	(len == COAP_ETAG_LEN && memcmp(coap_opt_value(opt), tag, COAP_ETAG_LEN) == 0)) {
+      return true;
+    }
+  }
+  return false;
+}
 
 static void
 led_handler_put(coap_context_t *ctx, struct coap_resource_t *resource,
@@ -213,39 +697,56 @@ led_handler_put(coap_context_t *ctx, struct coap_resource_t *resource,
   unsigned char* data;
   ESP_LOGI(TAG, "PUT /led");
 
-  // Copy and null-terminate the data.
-  coap_get_data(request, &size, &data);
-  char raw[COAP_BUF_LEN];
-  int len;
-  if (size < COAP_BUF_LEN-2) {
-    len = size;
-  } else {
-    len = COAP_BUF_LEN-2;
+#if BLINKEN_RATE
+  if (!rate_admit(peer)) {
+    ESP_LOGD(TAG, "Peer over rate limit.");
+    rate_reject(response);
+    return;
+  }
+#endif
+
+  // Conditional PUT (RFC 7252 5.10.8). /led always has a state, so
+  // If-None-Match always fails; If-Match holds while a listed ETag is current.
+  // Handlers run on the event loop, so the state can't change before it's set.
+  coap_opt_iterator_t it;
+  unsigned char tag[COAP_ETAG_LEN];
+  uint32_t etag = led_etag;
+  if (coap_check_option(request, COAP_OPTION_IF_NONE_MATCH, &it) != NULL) {
+    response->hdr->code = COAP_RESPONSE_CODE(412);
+    return;
+  }
+  if (coap_check_option(request, COAP_OPTION_IF_MATCH, &it) != NULL) {
+    coap_etag(etag, tag);
+    if (!coap_etag_match(request, COAP_OPTION_IF_MATCH, tag)) {
+      response->hdr->code = COAP_RESPONSE_CODE(412);
+      return;
+    }
   }
-  strncpy(raw, (char*)data, len);
-  // If the copied data is of length `len`, it is not null-terminated, so
-  // we must do it ourselves.
-  raw[len] = '\0';
+
+  coap_get_data(request, &size, &data);
+  char *raw = (char*)data;
 
   bproto_t res;
-  bproto_init(&res);
 
-  // Parse the payload
-  char *ptr = bproto_parse(&res, raw);
+  // Parse the payload in place. It isn't NUL-terminated, so its length bounds
+  // the parse; malformed input is rejected without touching the LEDs.
+  char *ptr = bproto_parse_n(&res, raw, size);
   
   if (ptr != raw) {
-    ESP_LOGD(TAG, "Setting LEDs: %s", raw);
+    ESP_LOGD(TAG, "Setting LEDs: %.*s", (int)size, raw);
     // Update global config and set LEDs
-    if (led_set(&res) == ESP_OK) {
+    if (led_set_etag(&res, &etag) == ESP_OK) {
       ESP_LOGD(TAG, "LED update successful.");
       resource->dirty = 1;
       response->hdr->code = COAP_RESPONSE_CODE(204);
+      coap_etag(etag, tag);
+      coap_add_option(response, COAP_OPTION_ETAG, COAP_ETAG_LEN, tag);
     } else {
       ESP_LOGE(TAG, "Couldn't set LEDs using provided values.");
       response->hdr->code = COAP_RESPONSE_CODE(400);
     }
   } else {
-    ESP_LOGE(TAG, "Invalid payload: %s", raw);
+    ESP_LOGE(TAG, "Invalid payload: %.*s", (int)size, raw);
     response->hdr->code = COAP_RESPONSE_CODE(400);
   }
 }
@@ -259,27 +760,233 @@ led_handler_get(coap_context_t *ctx, struct coap_resource_t *resource,
   ESP_LOGI(TAG, "GET /led");
   unsigned char buf[3];
 
-  // Serialize current config
+#if BLINKEN_RATE
+  if (!rate_admit(peer)) {
+    ESP_LOGD(TAG, "Peer over rate limit.");
+    rate_reject(response);
+    return;
+  }
+#endif
+
+  // Current config, serialized only if it changed since the last GET
+  const char *data;
+  uint32_t etag;
+  unsigned char tag[COAP_ETAG_LEN];
+  int len = led_repr(&data, &etag);
+  coap_etag(etag, tag);
+
+  // A poll that already has the current state gets 2.03 Valid and no payload
+  if (coap_etag_match(request, COAP_OPTION_ETAG, tag)) {
+    response->hdr->code = COAP_RESPONSE_CODE(203);
+    coap_add_option(response, COAP_OPTION_ETAG, COAP_ETAG_LEN, tag);
+    return;
+  }
+
+  // Set response code and send payload. Options go in ascending order.
+  response->hdr->code = COAP_RESPONSE_CODE(205);
+  coap_add_option(response, COAP_OPTION_ETAG, COAP_ETAG_LEN, tag);
+  coap_add_option(response, COAP_OPTION_CONTENT_TYPE, coap_encode_var_bytes(buf, COAP_MEDIATYPE_TEXT_PLAIN), buf);
+  coap_add_data(response, len, (unsigned char*)data);
+}
+
+/*
+Scene id of a /scene/<id> resource.
+*/
+static int scene_id(struct coap_resource_t *resource) {
+  size_t prefix = strlen(BLINKEN_SCENE_RESOURCE "/");
+  int id = 0;
+  for (size_t i = prefix; i < resource->uri.length; i++) {
+    id = id * 10 + (resource->uri.s[i] - '0');
+  }
+  return id;
+}
+
+static void
+scene_handler_put(coap_context_t *ctx, struct coap_resource_t *resource,
+		  const coap_endpoint_t *local_interface, coap_address_t *peer,
+		  coap_pdu_t *request, str *token, coap_pdu_t *response) {
+  size_t size;
+  unsigned char* data;
+  int id = scene_id(resource);
+  ESP_LOGI(TAG, "PUT /%s/%d", BLINKEN_SCENE_RESOURCE, id);
+
+#if BLINKEN_RATE
+  if (!rate_admit(peer)) {
+    rate_reject(response);
+    return;
+  }
+#endif
+
+  coap_get_data(request, &size, &data);
+  char *raw = (char*)data;
+  bproto_t scene;
+
+  if (bproto_parse_n(&scene, raw, size) == raw) {
+    ESP_LOGE(TAG, "Invalid scene: %.*s", (int)size, raw);
+    response->hdr->code = COAP_RESPONSE_CODE(400);
+  } else if (scene_store(id, &scene) != ESP_OK) {
+    response->hdr->code = COAP_RESPONSE_CODE(500);
+  } else {
+    resource->dirty = 1;
+    response->hdr->code = COAP_RESPONSE_CODE(204);
+  }
+}
+
+/*
+Recall a scene. The request needs no payload, so a whole room can be switched
+with one small multicast datagram.
+*/
+static void
+scene_handler_post(coap_context_t *ctx, struct coap_resource_t *resource,
+		   const coap_endpoint_t *local_interface, coap_address_t *peer,
+		   coap_pdu_t *request, str *token, coap_pdu_t *response) {
+  int id = scene_id(resource);
+  ESP_LOGI(TAG, "POST /%s/%d", BLINKEN_SCENE_RESOURCE, id);
+
+#if BLINKEN_RATE
+  if (!rate_admit(peer)) {
+    rate_reject(response);
+    return;
+  }
+#endif
+
+  switch (scene_recall(id)) {
+  case ESP_OK:
+    response->hdr->code = COAP_RESPONSE_CODE(204);
+    break;
+  case ESP_ERR_NOT_FOUND:
+    response->hdr->code = COAP_RESPONSE_CODE(404);
+    break;
+  default:
+    response->hdr->code = COAP_RESPONSE_CODE(500);
+    break;
+  }
+}
+
+static void
+scene_handler_get(coap_context_t *ctx, struct coap_resource_t *resource,
+		  const coap_endpoint_t *local_interface, coap_address_t *peer,
+		  coap_pdu_t *request, str *token, coap_pdu_t *response) {
+  int id = scene_id(resource);
+  unsigned char buf[3];
+  ESP_LOGI(TAG, "GET /%s/%d", BLINKEN_SCENE_RESOURCE, id);
+
+#if BLINKEN_RATE
+  if (!rate_admit(peer)) {
+    rate_reject(response);
+    return;
+  }
+#endif
+
+  if (!bproto_is_set(&scenes[id])) {
+    response->hdr->code = COAP_RESPONSE_CODE(404);
+    return;
+  }
+
   char data[COAP_BUF_LEN];
   char *ptr = data;
-  int len = bproto_snprint(&ptr, COAP_BUF_LEN, &b);
+  int len = bproto_snprint(&ptr, COAP_BUF_LEN, &scenes[id]);
 
-  // Set response code and send payload
   response->hdr->code = COAP_RESPONSE_CODE(205);
   coap_add_option(response, COAP_OPTION_CONTENT_TYPE, coap_encode_var_bytes(buf, COAP_MEDIATYPE_TEXT_PLAIN), buf);
   coap_add_data(response, len, (unsigned char*)data);
 }
 
-static void coap_task(void *p) {
-  coap_context_t *ctx;
+/*
+Realtime frames for live effects: PUT /stream?s=<seq> with a bproto payload,
+normally non-confirmable. There is one stream at a time; a frame that isn't
+newer than the last one applied is dropped before led_set(), so a late frame
+never overwrites a newer one (bproto_stream.h).
+*/
+static bproto_stream_t stream;
+
+/*
+Sequence number from the "s=<seq>" Uri-Query option of `request`.
+*/
+static bool stream_seq(coap_pdu_t *request, uint32_t *seq) {
+  coap_opt_iterator_t it;
+  coap_opt_filter_t filter;
+  coap_opt_t *opt;
+
+  coap_option_filter_clear(filter);
+  coap_option_setb(filter, COAP_OPTION_URI_QUERY);
+  coap_option_iterator_init(request, &it, filter);
+  while ((opt = coap_option_next(&it)) != NULL) {
+    const unsigned char *val = coap_opt_value(opt);
+    unsigned short len = coap_opt_length(opt);
+    if (len < 3 || len > 12 || val[0] != 's' || val[1] != '=') {
+      continue;
+    }
+    uint64_t acc = 0;
+    for (unsigned short i = 2; i < len; i++) {
+      if (val[i] < '0' || val[i] > '9') {
+	return false;
+      }
+      acc = acc * 10 + (val[i] - '0');
+    }
+    if (acc > UINT32_MAX) {
+      return false;
+    }
+    *seq = acc;
+    return true;
+  }
+  return false;
+}
+
+/*
+A non-confirmable request whose response code is left unset gets no response
+from libcoap, which is what a streaming sender wants for frames that were
+applied or dropped. Confirmable frames still have to be acknowledged.
+*/
+static void
+stream_handler_put(coap_context_t *ctx, struct coap_resource_t *resource,
+		   const coap_endpoint_t *local_interface, coap_address_t *peer,
+		   coap_pdu_t *request, str *token, coap_pdu_t *response) {
+  bool con = request->hdr->type == COAP_MESSAGE_CON;
+  size_t size;
+  unsigned char *data;
+  uint32_t seq;
+  bproto_t frame;
+
+#if BLINKEN_RATE
+  if (!rate_admit(peer)) {
+    if (con) {
+      rate_reject(response);
+    }
+    return;
+  }
+#endif
+
+  coap_get_data(request, &size, &data);
+  char *raw = (char*)data;
+  if (!stream_seq(request, &seq) || bproto_parse_n(&frame, raw, size) == raw) {
+    ESP_LOGD(TAG, "Invalid stream frame: %.*s", (int)size, raw);
+    response->hdr->code = COAP_RESPONSE_CODE(400);
+    return;
+  }
+
+  if (!bproto_stream_accept(&stream, seq, loop_clock())) {
+    ESP_LOGD(TAG, "Dropped stale stream frame. seq=%u, last=%u, dropped=%u",
+	     seq, stream.seq, stream.dropped);
+  } else if (led_set(&frame) != ESP_OK) {
+    response->hdr->code = COAP_RESPONSE_CODE(400);
+    return;
+  }
+  if (con) {
+    response->hdr->code = COAP_RESPONSE_CODE(204);
+  }
+}
+
+static coap_context_t *coap_ctx;
+
+static void coap_readable(int fd, void *ctx) {
+  ESP_LOGD(TAG, "Handling incoming COAP request.");
+  coap_read(ctx);
+}
+
+static void coap_start() {
   coap_address_t serv_addr;
   coap_resource_t *led_resource;
-  fd_set readfds;
-  
-  ESP_LOGD(TAG, "Starting COAP server. Waiting for WiFi...");
-  xEventGroupWaitBits(wifi_event_group, IPV4_CONNECTED_BIT,
-		      false, true, portMAX_DELAY);
-  ESP_LOGD(TAG, "WiFi connected. Continuing with COAP server startup.");
 
   coap_address_init(&serv_addr);
 #if BLINKEN_IPV6
@@ -293,41 +1000,256 @@ static void coap_task(void *p) {
   serv_addr.addr.sin.sin_port = htons(COAP_DEFAULT_PORT);
 #endif
 
-  ctx = coap_new_context(&serv_addr);
-
-  if (ctx) {
-    ESP_LOGD(TAG, "Creating COAP resource for GET \"/%s\".", BLINKEN_RESOURCE);
-    led_resource = coap_resource_init((unsigned char *)BLINKEN_RESOURCE,
-				      strlen(BLINKEN_RESOURCE), 0);
-    
-    coap_register_handler(led_resource, COAP_REQUEST_GET, led_handler_get);
-    coap_register_handler(led_resource, COAP_REQUEST_PUT, led_handler_put);
-    coap_add_resource(ctx, led_resource);
-
-    ESP_LOGI(TAG, "COAP server started.");
-
-    while(1) {
-      FD_ZERO(&readfds);
-      FD_CLR(ctx->sockfd, &readfds);
-      FD_SET(ctx->sockfd, &readfds);
-      int result = select(ctx->sockfd+1, &readfds, 0, 0, NULL);
-      if (result > 0 && FD_ISSET(ctx->sockfd, &readfds)) {
-	ESP_LOGD(TAG, "Handling incoming COAP request.");
-	coap_read(ctx);
-      } else if (result < 0) {
-	ESP_LOGE(TAG, "COAP socket error.");
-	break;
+  coap_context_t *ctx = coap_new_context(&serv_addr);
+  if (!ctx) {
+    ESP_LOGE(TAG, "Couldn't create COAP context.");
+    return;
+  }
+
+  ESP_LOGD(TAG, "Creating COAP resource for GET \"/%s\".", BLINKEN_RESOURCE);
+  led_resource = coap_resource_init((unsigned char *)BLINKEN_RESOURCE,
+				    strlen(BLINKEN_RESOURCE), 0);
+
+  coap_register_handler(led_resource, COAP_REQUEST_GET, led_handler_get);
+  coap_register_handler(led_resource, COAP_REQUEST_PUT, led_handler_put);
+  coap_add_resource(ctx, led_resource);
+
+  coap_resource_t *stream_resource =
+    coap_resource_init((unsigned char *)BLINKEN_STREAM_RESOURCE,
+		       strlen(BLINKEN_STREAM_RESOURCE), 0);
+  coap_register_handler(stream_resource, COAP_REQUEST_PUT, stream_handler_put);
+  coap_add_resource(ctx, stream_resource);
+
+  // libcoap matches whole paths, so each scene is its own resource. The
+  // paths must outlive the resources.
+  static char scene_uris[BLINKEN_SCENES][sizeof(BLINKEN_SCENE_RESOURCE) + 4];
+  for (int i = 0; i < BLINKEN_SCENES; i++) {
+    int len = snprintf(scene_uris[i], sizeof(scene_uris[i]), "%s/%d",
+		       BLINKEN_SCENE_RESOURCE, i);
+    coap_resource_t *scene = coap_resource_init((unsigned char *)scene_uris[i], len, 0);
+    coap_register_handler(scene, COAP_REQUEST_GET, scene_handler_get);
+    coap_register_handler(scene, COAP_REQUEST_PUT, scene_handler_put);
+    coap_register_handler(scene, COAP_REQUEST_POST, scene_handler_post);
+    coap_add_resource(ctx, scene);
+  }
+
+#if !BLINKEN_IPV6
+  // Listen on "All CoAP Nodes" too, for recalling scenes across a room
+  struct ip_mreq mreq = {
+    .imr_interface.s_addr = htonl(INADDR_ANY),
+  };
+  inet_aton(BLINKEN_COAP_MCAST, &mreq.imr_multiaddr);
+  if (setsockopt(ctx->sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+    ESP_LOGE(TAG, "Couldn't join COAP multicast group. Unicast only.");
+  }
+#endif
+
+  if (loop_nonblock(ctx->sockfd) < 0 ||
+      bproto_loop_watch(&loop, ctx->sockfd, coap_readable, ctx) < 0) {
+    ESP_LOGE(TAG, "Couldn't watch COAP socket.");
+    coap_free_context(ctx);
+    return;
+  }
+  coap_ctx = ctx;
+
+#if BLINKEN_COAP_POOL
+  // Context, endpoint and resources live forever; pool only what's
+  // allocated per request from here on.
+  coap_pool_init();
+  coap_pool_enabled = true;
+#endif
+#if BLINKEN_RATE
+  bproto_rate_init(&rate_limit, rate_buckets, BLINKEN_RATE_PEERS,
+		   BLINKEN_RATE_PER_SEC, BLINKEN_RATE_BURST);
+#endif
+
+  ESP_LOGI(TAG, "COAP server started.");
+}
+
+static void coap_stop() {
+  if (!coap_ctx) {
+    return;
+  }
+#if BLINKEN_COAP_POOL
+  coap_pool_log_stats();
+#endif
+  ESP_LOGD(TAG, "Cleaning up COAP context.");
+  bproto_loop_unwatch(&loop, coap_ctx->sockfd);
+  coap_free_context(coap_ctx);
+  coap_ctx = NULL;
+}
+
+/*******************************************************************************
+ * DMX over IP (Art-Net / E1.31)
+ ******************************************************************************/
+#if BLINKEN_DMX
+// One DMX over IP protocol, on its own socket
+typedef struct {
+  const char *name;
+  uint16_t port;
+  uint16_t universe;
+  uint32_t group;    // multicast group to join, if any
+  bproto_dmx_parse_t parse;
+  bool seq_zero_off; // sequence 0 means sequencing is disabled
+  bproto_dmx_seq_t seq;
+  int fd;
+} dmx_input_t;
+
+static void dmx_apply(const uint8_t *slots, int count) {
+  bproto_t msg;
+  bproto_init(&msg);
+  msg.time = 0;
+
+  bproto_value_t vals[BLINKEN_CH_NUM];
+  bproto_channels(&msg, vals);
+  for (int i = 0; i < BLINKEN_CH_NUM; i++) {
+    int slot = BLINKEN_DMX_ADDRESS - 1 + i;
+    if (slot < count) {
+      vals[i] = slots[slot];
+    }
+  }
+  bproto_set_channels(&msg, vals);
+
+  if (led_set(&msg) != ESP_OK) {
+    ESP_LOGE(TAG, "Couldn't set LEDs from DMX frame.");
+  }
+}
+
+static int dmx_socket(uint16_t port) {
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_ANY),
+    .sin_port = htons(port),
+  };
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static dmx_input_t dmx_inputs[] = {
+  { .name = "Art-Net", .port = BLINKEN_DMX_ARTNET_PORT, .parse = bproto_dmx_artnet_parse,
+    .universe = BLINKEN_DMX_ARTNET_UNIVERSE, .seq_zero_off = true },
+  // E1.31 universes are multicast to 239.255.<universe>
+  { .name = "E1.31", .port = BLINKEN_DMX_E131_PORT, .parse = bproto_dmx_e131_parse,
+    .universe = BLINKEN_DMX_E131_UNIVERSE, .group = 0xefff0000 | BLINKEN_DMX_E131_UNIVERSE },
+};
+
+/*
+Apply every frame waiting on an input's socket, in order.
+*/
+static void dmx_readable(int fd, void *ctx) {
+  static uint8_t buf[BPROTO_DMX_BUF_LEN];
+  dmx_input_t *in = ctx;
+  const uint8_t *slots;
+  uint8_t seq;
+  int count, len;
+
+  while ((len = recv(fd, buf, sizeof(buf), 0)) > 0) {
+    if ((count = in->parse(buf, len, in->universe, &slots, &seq)) < 0) {
+      continue;
+    }
+    if ((in->seq_zero_off && seq == 0) || bproto_dmx_seq_accept(&in->seq, seq, loop_clock())) {
+      dmx_apply(slots, count);
+    } else {
+      ESP_LOGD(TAG, "Dropped stale %s frame. seq=%d", in->name, seq);
+    }
+  }
+}
+
+static void dmx_start() {
+  for (size_t i = 0; i < sizeof(dmx_inputs) / sizeof(dmx_inputs[0]); i++) {
+    dmx_input_t *in = &dmx_inputs[i];
+    if ((in->fd = dmx_socket(in->port)) < 0 ||
+	loop_nonblock(in->fd) < 0 ||
+	bproto_loop_watch(&loop, in->fd, dmx_readable, in) < 0) {
+      ESP_LOGE(TAG, "Couldn't create %s socket.", in->name);
+      if (in->fd >= 0) {
+	close(in->fd);
       }
+      continue;
     }
 
-    ESP_LOGD(TAG, "Cleaning up COAP context.");
-    coap_free_context(ctx);
-  } else {
-    ESP_LOGE(TAG, "Couldn't create COAP context.");
+    struct ip_mreq mreq = {
+      .imr_multiaddr.s_addr = htonl(in->group),
+      .imr_interface.s_addr = htonl(INADDR_ANY),
+    };
+    if (in->group && setsockopt(in->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+      ESP_LOGE(TAG, "Couldn't join %s multicast group. Unicast only.", in->name);
+    }
   }
-  
-  vTaskDelete(NULL);
+
+  ESP_LOGI(TAG, "DMX input started. artnet=%d, e131=%d, address=%d",
+	   BLINKEN_DMX_ARTNET_UNIVERSE, BLINKEN_DMX_E131_UNIVERSE, BLINKEN_DMX_ADDRESS);
 }
+#endif
+
+/*******************************************************************************
+ * UART
+ ******************************************************************************/
+#if BLINKEN_UART
+static bproto_parser_t uart_parser;
+static unsigned long uart_errors = 0;
+
+static void uart_handle_msg(bproto_t *msg, void *ctx) {
+  if (led_set(msg) != ESP_OK) {
+    ESP_LOGE(TAG, "Couldn't set LEDs from UART message.");
+  }
+}
+
+/*
+Newline-delimited bproto over UART. The driver buffers received bytes in a
+ring buffer from the RX interrupt, and its VFS device makes that a
+descriptor the event loop can select() on; each wakeup feeds whatever has
+arrived into the streaming parser. Bytes lost to an overflow garble one line,
+which the parser counts as an error and resynchronises after.
+*/
+static void uart_readable(int fd, void *ctx) {
+  if (bproto_loop_feed(fd, &uart_parser) < 0) {
+    ESP_LOGE(TAG, "Couldn't read UART. errno=%d", errno);
+  }
+  if (uart_parser.errors != uart_errors) {
+    ESP_LOGE(TAG, "Invalid UART messages. total=%lu", uart_parser.errors);
+    uart_errors = uart_parser.errors;
+  }
+}
+
+static void uart_start() {
+  char path[16];
+
+  uart_config_t cfg = {
+    .baud_rate = BLINKEN_UART_BAUD,
+    .data_bits = UART_DATA_8_BITS,
+    .parity = UART_PARITY_DISABLE,
+    .stop_bits = UART_STOP_BITS_1,
+    .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+  };
+  ESP_ERROR_CHECK( uart_param_config(BLINKEN_UART_NUM, &cfg) );
+  ESP_ERROR_CHECK( uart_set_pin(BLINKEN_UART_NUM, BLINKEN_UART_TX_GPIO, BLINKEN_UART_RX_GPIO,
+				UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE) );
+  ESP_ERROR_CHECK( uart_driver_install(BLINKEN_UART_NUM, BLINKEN_UART_RX_BUF, 0, 0, NULL, 0) );
+  esp_vfs_dev_uart_use_driver(BLINKEN_UART_NUM);
+
+  snprintf(path, sizeof(path), "/dev/uart/%d", BLINKEN_UART_NUM);
+  int fd = open(path, O_RDONLY | O_NONBLOCK);
+  if (fd < 0 || bproto_loop_watch(&loop, fd, uart_readable, NULL) < 0) {
+    ESP_LOGE(TAG, "Couldn't watch UART. uart=%d", BLINKEN_UART_NUM);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+
+  bproto_parser_init(&uart_parser, uart_handle_msg, NULL);
+  ESP_LOGI(TAG, "UART input started. uart=%d, baud=%d", BLINKEN_UART_NUM, BLINKEN_UART_BAUD);
+}
+#endif
 
 /*******************************************************************************
  * MDNS
@@ -351,11 +1273,46 @@ static void app_mdns_init() {
 /*******************************************************************************
  * Main
  ******************************************************************************/
+static bproto_timer_t net_timer;
+
+/*
+Start the network inputs once WiFi is up, checking every
+BLINKEN_NET_POLL_MS until it is.
+*/
+static void net_poll(bproto_timer_t *timer, void *ctx) {
+  if (!(xEventGroupGetBits(wifi_event_group) & IPV4_CONNECTED_BIT)) {
+    bproto_timer_start(&loop, timer, BLINKEN_NET_POLL_MS);
+    return;
+  }
+  ESP_LOGD(TAG, "WiFi connected. Starting network inputs.");
+  coap_start();
+#if BLINKEN_DMX
+  dmx_start();
+#endif
+}
+
+static void loop_task(void *p) {
+#if BLINKEN_UART
+  uart_start();
+#endif
+  bproto_timer_init(&net_timer, net_poll, NULL);
+  bproto_timer_start(&loop, &net_timer, 0);
+
+  ESP_LOGI(TAG, "Event loop started.");
+  if (bproto_loop_run(&loop) < 0) {
+    ESP_LOGE(TAG, "Event loop failed. errno=%d", errno);
+  }
+  coap_stop();
+  vTaskDelete(NULL);
+}
+
 void app_main() {
   ESP_ERROR_CHECK( nvs_flash_init() );
+  bproto_loop_init(&loop, loop_clock);
   led_init();
+  scene_init();
   wifi_conn_init();
   app_mdns_init();
 
-  xTaskCreate(coap_task, "coap", 4096, NULL, 5, NULL);
+  xTaskCreate(loop_task, "loop", BLINKEN_LOOP_STACK, NULL, 5, NULL);
 }
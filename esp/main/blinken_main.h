@@ -4,12 +4,47 @@
 #define BLINKEN_INSTANCE CONFIG_INSTANCE
 
 #define BLINKEN_RESOURCE "led"
+#define BLINKEN_REPR_LEN (32) // Serialized LED state, as served by GET /led
+#define BLINKEN_SCENE_RESOURCE "scene"   // Presets are /scene/0 to /scene/<BLINKEN_SCENES - 1>
+#define BLINKEN_SCENES CONFIG_SCENES
+#define BLINKEN_STREAM_RESOURCE "stream" // Realtime frames, PUT /stream?s=<seq>
+#define BLINKEN_COAP_MCAST "224.0.1.187" // "All CoAP Nodes" (RFC 7252)
+#define BLINKEN_NVS_NAMESPACE "blinken"
+
+#define BLINKEN_LOOP_STACK (6144)  // Stack of the event loop task, which runs every input
+#define BLINKEN_NET_POLL_MS (250)  // How often the event loop checks for WiFi before starting COAP
 
 #define BLINKEN_WIFI_SSID CONFIG_WIFI_SSID
 #define BLINKEN_WIFI_PASSWORD CONFIG_WIFI_PASSWORD
 
 #define BLINKEN_IPV6 CONFIG_BLINKEN_KIPV6
 
+#define BLINKEN_COAP_POOL CONFIG_COAP_POOL
+#define BLINKEN_COAP_POOL_SMALL_SIZE CONFIG_COAP_POOL_SMALL_SIZE   // PDU structs, queue nodes
+#define BLINKEN_COAP_POOL_SMALL_COUNT CONFIG_COAP_POOL_SMALL_COUNT
+#define BLINKEN_COAP_POOL_LARGE_SIZE CONFIG_COAP_POOL_LARGE_SIZE   // PDU buffers
+#define BLINKEN_COAP_POOL_LARGE_COUNT CONFIG_COAP_POOL_LARGE_COUNT
+#define BLINKEN_COAP_POOL_LOG_EVERY (100) // Exhaustion warnings are logged once per this many
+
+#define BLINKEN_RATE CONFIG_COAP_RATE_LIMIT
+#define BLINKEN_RATE_PER_SEC CONFIG_COAP_RATE    // Sustained requests per second per peer
+#define BLINKEN_RATE_BURST CONFIG_COAP_BURST     // Requests a peer may send back to back
+#define BLINKEN_RATE_PEERS CONFIG_COAP_RATE_PEERS // Peers tracked at once
+
+#define BLINKEN_UART CONFIG_BLINKEN_UART
+#define BLINKEN_UART_NUM CONFIG_UART_NUM
+#define BLINKEN_UART_BAUD CONFIG_UART_BAUD
+#define BLINKEN_UART_RX_GPIO CONFIG_UART_RX_GPIO
+#define BLINKEN_UART_TX_GPIO CONFIG_UART_TX_GPIO
+#define BLINKEN_UART_RX_BUF CONFIG_UART_RX_BUF // Driver RX ring buffer size (bytes)
+
+#define BLINKEN_DMX CONFIG_BLINKEN_DMX
+#define BLINKEN_DMX_ARTNET_UNIVERSE CONFIG_DMX_ARTNET_UNIVERSE // 0-based
+#define BLINKEN_DMX_E131_UNIVERSE CONFIG_DMX_E131_UNIVERSE     // 1-based
+#define BLINKEN_DMX_ADDRESS CONFIG_DMX_ADDRESS // First DMX slot (1-based), mapped to R,G,B,W
+#define BLINKEN_DMX_ARTNET_PORT BPROTO_DMX_ARTNET_PORT
+#define BLINKEN_DMX_E131_PORT BPROTO_DMX_E131_PORT
+
 #define BLINKEN_TIMER LEDC_TIMER_0 // Use first hardware timer
 #define BLINKEN_MODE LEDC_HIGH_SPEED_MODE // Just use high speed (higher resolution)
 #define BLINKEN_PWM_HZ CONFIG_PWM_HZ // PWM frequency
@@ -18,15 +53,24 @@
 #define BLINKEN_MULTIPLIER (BLINKEN_MAX_DUTY / CHAR_MAX) // For adjusting value range from 0-255
 #define BLINKEN_MAP(x) (x * BLINKEN_MAX_DUTY / CHAR_MAX)
 
-#define BLINKEN_CH_NUM (4)                 // Number of LED channels (R,G,B,W)
-#define BLINKEN_CHR_GPIO CONFIG_R_GPIO     // GPIO output for red strip
-#define BLINKEN_CHR_CHANNEL LEDC_CHANNEL_0 // LEDC channel for red strip
-#define BLINKEN_CHG_GPIO CONFIG_G_GPIO     // GPIO output for green strip
-#define BLINKEN_CHG_CHANNEL LEDC_CHANNEL_1 // LEDC channel for green strip
-#define BLINKEN_CHB_GPIO CONFIG_B_GPIO     // GPIO output for blue strip
-#define BLINKEN_CHB_CHANNEL LEDC_CHANNEL_2 // LEDC channel for blue strip
-#define BLINKEN_CHW_GPIO CONFIG_W_GPIO     // GPIO output for white strip
-#define BLINKEN_CHW_CHANNEL LEDC_CHANNEL_3 // LEDC channel for white strip
+#define BLINKEN_FADE_NUM_MAX (1023) // Largest LEDC fade step count, cycle count or scale
+#define BLINKEN_EASE_SEGMENTS CONFIG_EASE_SEGMENTS // Linear segments per eased fade
+#define BLINKEN_EASE_SEGMENT_MIN_MS (20)          // Shortest segment of an eased fade
+#define BLINKEN_FADE_SLACK_MS (50)                // Grace after a fade's end before it counts as stalled
+
+// LED channels are those of BPROTO_CHANNEL_TABLE (R,G,B and, unless
+// CONFIG_BLINKEN_RGB, W); each needs a GPIO and LEDC channel below
+#define BLINKEN_CH_NUM BPROTO_CHANNEL_COUNT // Number of LED channels
+#define BLINKEN_CH_ALL ((1 << BLINKEN_CH_NUM) - 1) // Mask of all LED channels
+#define BLINKEN_CH_RED_GPIO CONFIG_R_GPIO       // GPIO output for red strip
+#define BLINKEN_CH_RED_CHANNEL LEDC_CHANNEL_0   // LEDC channel for red strip
+#define BLINKEN_CH_GREEN_GPIO CONFIG_G_GPIO     // GPIO output for green strip
+#define BLINKEN_CH_GREEN_CHANNEL LEDC_CHANNEL_1 // LEDC channel for green strip
+#define BLINKEN_CH_BLUE_GPIO CONFIG_B_GPIO      // GPIO output for blue strip
+#define BLINKEN_CH_BLUE_CHANNEL LEDC_CHANNEL_2  // LEDC channel for blue strip
+#define BLINKEN_CH_WHITE_GPIO CONFIG_W_GPIO     // GPIO output for white strip
+#define BLINKEN_CH_WHITE_CHANNEL LEDC_CHANNEL_3 // LEDC channel for white strip
+
 
     
 #define ESP_HOLD_ERR(err, x)			\
@@ -3,3 +3,16 @@
 #
 COMPONENT_ADD_INCLUDEDIRS = ../../lib/include
 COMPONENT_SRCDIRS += ../../lib
+
+# Recordings (mmap, stdio files) and bulk parallel parsing are host-only
+COMPONENT_OBJEXCLUDE := ../../lib/bproto_rec.o ../../lib/bproto_par.o
+
+# Channels are compiled from the schema in bproto.h, for the library too
+ifdef CONFIG_BLINKEN_RGB
+CFLAGS += -DBPROTO_RGB=1
+endif
+
+# Route libcoap's allocator through the COAP memory pools (blinken_main.c)
+ifdef CONFIG_COAP_POOL
+COMPONENT_ADD_LDFLAGS += -Wl,--wrap=coap_malloc_type -Wl,--wrap=coap_free_type
+endif
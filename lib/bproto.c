@@ -2,46 +2,45 @@
 #include "bproto.h"
 #include "bproto_internal.h"
 
+/*
+Per-channel steps are expanded from BPROTO_CHANNEL_TABLE, one copy per
+channel, so each build gets straight-line code for exactly its channels.
+*/
 void bproto_init(bproto_t *b) {
-  b->red = BPROTO_VALUE_UNSET;
-  b->green = BPROTO_VALUE_UNSET;
-  b->blue = BPROTO_VALUE_UNSET;
-  b->white = BPROTO_VALUE_UNSET;
+#define BPROTO_INIT_CHANNEL(m, NAME, l) b->m = BPROTO_VALUE_UNSET;
+  BPROTO_CHANNEL_TABLE(BPROTO_INIT_CHANNEL)
+#undef BPROTO_INIT_CHANNEL
   b->time = BPROTO_TIME_UNSET;
+  b->ease = BPROTO_EASE_UNSET;
 }
 
 /*
 y is target
 */
 void bproto_copy(bproto_t *x, bproto_t *y) {
-  if (x->red != BPROTO_VALUE_UNSET) {
-    y->red = x->red;
-  }
-
-  if (x->green != BPROTO_VALUE_UNSET) {
-    y->green = x->green;
+#define BPROTO_COPY_CHANNEL(m, NAME, l)		\
+  if (x->m != BPROTO_VALUE_UNSET) {		\
+    y->m = x->m;				\
   }
+  BPROTO_CHANNEL_TABLE(BPROTO_COPY_CHANNEL)
+#undef BPROTO_COPY_CHANNEL
 
-  if (x->blue != BPROTO_VALUE_UNSET) {
-    y->blue = x->blue;
-  }
-  
-  if (x->white != BPROTO_VALUE_UNSET) {
-    y->white = x->white;
-  }
-  
   if (x->time != BPROTO_TIME_UNSET) {
     y->time = x->time;
   }
+
+  if (x->ease != BPROTO_EASE_UNSET) {
+    y->ease = x->ease;
+  }
 }
 
 int bproto_eq(bproto_t *x, bproto_t *y) {
+#define BPROTO_EQ_CHANNEL(m, NAME, l) x->m == y->m &&
   return
-    x->red   == y->red   &&
-    x->green == y->green &&
-    x->blue  == y->blue  &&
-    x->white == y->white &&
-    x->time  == y->time;
+    BPROTO_CHANNEL_TABLE(BPROTO_EQ_CHANNEL)
+    x->time  == y->time  &&
+    x->ease  == y->ease;
+#undef BPROTO_EQ_CHANNEL
 }
 
 int bproto_is_set(bproto_t *b) {
@@ -50,45 +49,213 @@ int bproto_is_set(bproto_t *b) {
   return !bproto_eq(b, &init);
 }
 
-char *bproto_parse(bproto_t *cfg, const char *ptr) {
-  char *res;
-  char *orig = (char *)ptr;
-  bproto_init(cfg);
+/*
+The channels of `b` as an array, in BPROTO_CHANNEL_TABLE order, for code
+which handles channels by index (hardware channels, DMX slots, packed forms).
+*/
+void bproto_channels(const bproto_t *b, bproto_value_t *vals) {
+  int i = 0;
+#define BPROTO_GET_CHANNEL(m, NAME, l) vals[i++] = b->m;
+  BPROTO_CHANNEL_TABLE(BPROTO_GET_CHANNEL)
+#undef BPROTO_GET_CHANNEL
+}
 
-  while (*ptr != '\0') {
-    bproto_field_t field;
+void bproto_set_channels(bproto_t *b, const bproto_value_t *vals) {
+  int i = 0;
+#define BPROTO_SET_CHANNEL(m, NAME, l) b->m = vals[i++];
+  BPROTO_CHANNEL_TABLE(BPROTO_SET_CHANNEL)
+#undef BPROTO_SET_CHANNEL
+}
 
-    res = bproto_field_parse(&field, ptr);
-    if (res == ptr) {
-      return orig;
-    }
-    ptr = res;
+/*
+The smallest message taking a device from `old` to `new`, in `out`: the
+channels set in `new` which differ from `old`. Time and ease say how to
+reach those channels, so `new`'s are kept when any channel is sent and
+dropped otherwise. Returns 0 if there is nothing to send.
+*/
+int bproto_diff(const bproto_t *old, const bproto_t *new, bproto_t *out) {
+  int changed = 0;
+  bproto_init(out);
+
+#define BPROTO_DIFF_CHANNEL(f, NAME, l)				\
+  if (new->f != BPROTO_VALUE_UNSET && new->f != old->f) {	\
+    out->f = new->f;						\
+    changed = 1;						\
+  }
+  BPROTO_CHANNEL_TABLE(BPROTO_DIFF_CHANNEL)
+#undef BPROTO_DIFF_CHANNEL
 
-    switch (field) {
-    case BPROTO_FIELD_RED:
-      res = bproto_value_parse(&(cfg->red), ptr);
-      break;
-    case BPROTO_FIELD_GREEN:
-      res = bproto_value_parse(&(cfg->green), ptr);
-      break;
-    case BPROTO_FIELD_BLUE:
-      res = bproto_value_parse(&(cfg->blue), ptr);
-      break;
-    case BPROTO_FIELD_WHITE:
-      res = bproto_value_parse(&(cfg->white), ptr);
+  if (changed) {
+    out->time = new->time;
+    out->ease = new->ease;
+  }
+  return changed;
+}
+
+/*
+bproto_diff of `n` pairs. Returns the number of diffs with something to send.
+*/
+size_t bproto_diff_batch(const bproto_t *old, const bproto_t *new, bproto_t *out, size_t n) {
+  size_t changed = 0;
+  for (size_t i = 0; i < n; i++) {
+    changed += bproto_diff(&old[i], &new[i], &out[i]);
+  }
+  return changed;
+}
+
+/*
+Character class of every byte. Anything not listed is BPROTO_CC_OTHER.
+*/
+#define BPROTO_CCLASS_CHANNEL(m, NAME, l) [l] = BPROTO_CC_CHANNEL,
+const uint8_t bproto_cclass[256] = {
+  ['\0'] = BPROTO_CC_END,
+  ['0'] = BPROTO_CC_DIGIT,
+  ['1'] = BPROTO_CC_DIGIT,
+  ['2'] = BPROTO_CC_DIGIT,
+  ['3'] = BPROTO_CC_DIGIT,
+  ['4'] = BPROTO_CC_DIGIT,
+  ['5'] = BPROTO_CC_DIGIT,
+  ['6'] = BPROTO_CC_DIGIT,
+  ['7'] = BPROTO_CC_DIGIT,
+  ['8'] = BPROTO_CC_DIGIT,
+  ['9'] = BPROTO_CC_DIGIT,
+  BPROTO_CHANNEL_TABLE(BPROTO_CCLASS_CHANNEL)
+  [BPROTO_FIELD_TIME] = BPROTO_CC_TIME,
+  [BPROTO_FIELD_EASE] = BPROTO_CC_EASE,
+};
+#undef BPROTO_CCLASS_CHANNEL
+
+/*
+MESSAGE = SETTING+ as a DFA. Malformed input goes to BPROTO_PARSER_DISCARD,
+a complete message to BPROTO_PARSER_END.
+*/
+const uint8_t bproto_dfa[BPROTO_PARSER_STATES][BPROTO_CC_CLASSES] = {
+  [BPROTO_PARSER_START] = {
+    [BPROTO_CC_OTHER]   = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_DIGIT]   = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_CHANNEL] = BPROTO_PARSER_VALUE,
+    [BPROTO_CC_TIME]    = BPROTO_PARSER_VALUE,
+    [BPROTO_CC_EASE]    = BPROTO_PARSER_VALUE,
+    [BPROTO_CC_END]     = BPROTO_PARSER_DISCARD,
+  },
+  [BPROTO_PARSER_VALUE] = {
+    [BPROTO_CC_OTHER]   = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_DIGIT]   = BPROTO_PARSER_DIGITS,
+    [BPROTO_CC_CHANNEL] = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_TIME]    = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_EASE]    = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_END]     = BPROTO_PARSER_DISCARD,
+  },
+  [BPROTO_PARSER_DIGITS] = {
+    [BPROTO_CC_OTHER]   = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_DIGIT]   = BPROTO_PARSER_DIGITS,
+    [BPROTO_CC_CHANNEL] = BPROTO_PARSER_VALUE,
+    [BPROTO_CC_TIME]    = BPROTO_PARSER_VALUE,
+    [BPROTO_CC_EASE]    = BPROTO_PARSER_VALUE,
+    [BPROTO_CC_END]     = BPROTO_PARSER_END,
+  },
+  [BPROTO_PARSER_DISCARD] = {
+    [BPROTO_CC_OTHER]   = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_DIGIT]   = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_CHANNEL] = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_TIME]    = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_EASE]    = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_END]     = BPROTO_PARSER_DISCARD,
+  },
+  [BPROTO_PARSER_END] = {
+    [BPROTO_CC_OTHER]   = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_DIGIT]   = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_CHANNEL] = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_TIME]    = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_EASE]    = BPROTO_PARSER_DISCARD,
+    [BPROTO_CC_END]     = BPROTO_PARSER_DISCARD,
+  },
+};
+
+static inline bproto_time_t bproto_field_max(char field) {
+  switch (field) {
+  case BPROTO_FIELD_TIME:
+    return BPROTO_TIME_T_MAX;
+  case BPROTO_FIELD_EASE:
+    return BPROTO_EASE_T_MAX;
+  default:
+    return BPROTO_VALUE_T_MAX;
+  }
+}
+
+/*
+Whether appending digit `d` to `acc` would exceed `max`.
+*/
+static inline int bproto_digit_overflows(bproto_time_t acc, bproto_time_t max, int d) {
+  return d > max || acc > (max - d) / 10;
+}
+
+/*
+Run the DFA over `ptr` up to a NUL or, if `end` isn't NULL, up to `end`.
+Values are stored in `cfg` unless it is NULL. Returns a pointer to the
+terminating position, or NULL if the input is malformed.
+*/
+static inline const char *bproto_dfa_run(bproto_t *cfg, const char *ptr, const char *end) {
+  bproto_parser_state_t state = BPROTO_PARSER_START;
+  bproto_field_t field = BPROTO_FIELD_RED;
+  bproto_time_t acc = 0, max = 0;
+
+  for (;; ptr++) {
+    char c = (end == NULL || ptr < end) ? *ptr : '\0';
+    bproto_parser_state_t next = bproto_dfa[state][bproto_cclass[(unsigned char)c]];
+
+    switch (next) {
+    case BPROTO_PARSER_DIGITS:
+      if (bproto_digit_overflows(acc, max, c - '0')) {
+	return NULL;
+      }
+      acc = acc * 10 + (c - '0');
       break;
-    case BPROTO_FIELD_TIME:
-      res = bproto_time_parse(&(cfg->time), ptr);
+    case BPROTO_PARSER_VALUE:
+      if (cfg != NULL && state == BPROTO_PARSER_DIGITS) {
+	bproto_field_set(cfg, field, acc);
+      }
+      field = c;
+      max = bproto_field_max(c);
+      acc = 0;
       break;
+    case BPROTO_PARSER_END:
+      if (cfg != NULL) {
+	bproto_field_set(cfg, field, acc);
+      }
+      return ptr;
+    default:
+      return NULL;
     }
-
-    if (res == ptr) {
-      return orig;
-    }
-    ptr = res;
+    state = next;
   }
+}
 
-  return (char *)ptr;
+char *bproto_parse(bproto_t *cfg, const char *ptr) {
+  bproto_init(cfg);
+  const char *res = bproto_dfa_run(cfg, ptr, NULL);
+  return (char *)(res != NULL ? res : ptr);
+}
+
+/*
+Parse exactly `len` bytes, which need not be NUL-terminated. Returns
+`ptr + len` on success and `ptr` on failure.
+*/
+char *bproto_parse_n(bproto_t *cfg, const char *ptr, size_t len) {
+  bproto_init(cfg);
+  const char *res = bproto_dfa_run(cfg, ptr, ptr + len);
+  return (char *)(res == ptr + len ? res : ptr);
+}
+
+/*
+Check a message without storing any values. Returns 1 if it is valid.
+*/
+int bproto_validate(const char *ptr) {
+  return bproto_dfa_run(NULL, ptr, NULL) != NULL;
+}
+
+int bproto_validate_n(const char *ptr, size_t len) {
+  return bproto_dfa_run(NULL, ptr, ptr + len) == ptr + len;
 }
 
 #define ADD_OR_RETURN(res) \
@@ -104,31 +271,24 @@ char *bproto_parse(bproto_t *cfg, const char *ptr) {
 int bproto_snprint(char **str, size_t size, bproto_t *b) {
   int i = 0;
 
-  if (b->red != BPROTO_VALUE_UNSET) {
-    ADD_OR_RETURN(bproto_field_snprint(str, size-i, BPROTO_FIELD_RED));
-    ADD_OR_RETURN(bproto_value_snprint(str, size-i, b->red));
-  }
-
-  if (b->green != BPROTO_VALUE_UNSET) {
-    ADD_OR_RETURN(bproto_field_snprint(str, size-i, BPROTO_FIELD_GREEN));
-    ADD_OR_RETURN(bproto_value_snprint(str, size-i, b->green));
-  }
-
-  if (b->blue != BPROTO_VALUE_UNSET) {
-    ADD_OR_RETURN(bproto_field_snprint(str, size-i, BPROTO_FIELD_BLUE));
-    ADD_OR_RETURN(bproto_value_snprint(str, size-i, b->blue));
-  }
-
-  if (b->white != BPROTO_VALUE_UNSET) {
-    ADD_OR_RETURN(bproto_field_snprint(str, size-i, BPROTO_FIELD_WHITE));
-    ADD_OR_RETURN(bproto_value_snprint(str, size-i, b->white));
+#define BPROTO_SNPRINT_CHANNEL(m, NAME, l)				\
+  if (b->m != BPROTO_VALUE_UNSET) {					\
+    ADD_OR_RETURN(bproto_field_snprint(str, size-i, BPROTO_FIELD_##NAME)); \
+    ADD_OR_RETURN(bproto_value_snprint(str, size-i, b->m));		\
   }
+  BPROTO_CHANNEL_TABLE(BPROTO_SNPRINT_CHANNEL)
+#undef BPROTO_SNPRINT_CHANNEL
 
   if (b->time != BPROTO_TIME_UNSET) {
     ADD_OR_RETURN(bproto_field_snprint(str, size-i, BPROTO_FIELD_TIME));
     ADD_OR_RETURN(bproto_time_snprint(str, size-i, b->time));
   }
 
+  if (b->ease != BPROTO_EASE_UNSET) {
+    ADD_OR_RETURN(bproto_field_snprint(str, size-i, BPROTO_FIELD_EASE));
+    ADD_OR_RETURN(bproto_ease_snprint(str, size-i, b->ease));
+  }
+
   return i;
   /*
   if (i < size) {
@@ -141,13 +301,13 @@ int bproto_snprint(char **str, size_t size, bproto_t *b) {
   */
 }
 
+#define BPROTO_CASE_CHANNEL(m, NAME, l) case BPROTO_FIELD_##NAME:
+
 char *bproto_field_parse(bproto_field_t *cmd, const char *ptr) {
   switch (*ptr) {
-  case BPROTO_FIELD_RED:
-  case BPROTO_FIELD_GREEN:
-  case BPROTO_FIELD_BLUE:
-  case BPROTO_FIELD_WHITE:
+  BPROTO_CHANNEL_TABLE(BPROTO_CASE_CHANNEL)
   case BPROTO_FIELD_TIME:
+  case BPROTO_FIELD_EASE:
     *cmd = *(ptr++);
     return (char *) ptr;
   default:
@@ -224,6 +384,13 @@ int bproto_time_snprint(char **str, size_t size, bproto_time_t time) {
   return bproto_int_snprint(str, size, time);
 }
 
+int bproto_ease_snprint(char **str, size_t size, bproto_value_t ease) {
+  if (ease < BPROTO_EASE_T_MIN || ease > BPROTO_EASE_T_MAX) {
+    return 0;
+  }
+  return bproto_int_snprint(str, size, ease);
+}
+
 int bproto_int_snprint(char **ptr, size_t size, int val) {
   char *str = *ptr;
   char buf[BPROTO_BUF_LEN_INT];
@@ -250,3 +417,103 @@ int bproto_int_snprint(char **ptr, size_t size, int val) {
   *ptr = str;
   return new_size;
 }
+
+int bproto_field_set(bproto_t *b, bproto_field_t field, bproto_time_t val) {
+#define BPROTO_SET_FIELD(m, NAME, l)		\
+  case BPROTO_FIELD_##NAME:			\
+    b->m = val;					\
+    return 1;
+
+  switch (field) {
+  BPROTO_CHANNEL_TABLE(BPROTO_SET_FIELD)
+#undef BPROTO_SET_FIELD
+  case BPROTO_FIELD_TIME:
+    b->time = val;
+    return 1;
+  case BPROTO_FIELD_EASE:
+    b->ease = val;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+int bproto_is_delim(char c) {
+  return c == '\n' || c == '\r' || c == '\0';
+}
+
+void bproto_parser_init(bproto_parser_t *p, bproto_parser_cb_t cb, void *ctx) {
+  p->cb = cb;
+  p->ctx = ctx;
+  p->errors = 0;
+  bproto_parser_reset(p);
+}
+
+void bproto_parser_reset(bproto_parser_t *p) {
+  p->state = BPROTO_PARSER_START;
+  p->acc = 0;
+  bproto_init(&(p->msg));
+}
+
+/*
+Returns the number of messages passed to the callback.
+*/
+size_t bproto_parser_feed(bproto_parser_t *p, const char *buf, size_t len) {
+  size_t emitted = 0;
+
+  for (const char *end = buf + len; buf < end; buf++) {
+    char c = *buf;
+    int cls = bproto_is_delim(c) ? BPROTO_CC_END : bproto_cclass[(unsigned char)c];
+    bproto_parser_state_t next = bproto_dfa[p->state][cls];
+
+    switch (next) {
+    case BPROTO_PARSER_DIGITS:
+      if (bproto_digit_overflows(p->acc, bproto_field_max(p->field), c - '0')) {
+	p->errors++;
+	next = BPROTO_PARSER_DISCARD;
+      } else {
+	p->acc = p->acc * 10 + (c - '0');
+      }
+      break;
+    case BPROTO_PARSER_VALUE:
+      if (p->state == BPROTO_PARSER_DIGITS) {
+	bproto_field_set(&(p->msg), p->field, p->acc);
+      }
+      p->field = c;
+      p->acc = 0;
+      break;
+    case BPROTO_PARSER_END:
+      bproto_field_set(&(p->msg), p->field, p->acc);
+      if (p->cb != NULL) {
+	p->cb(&(p->msg), p->ctx);
+      }
+      emitted++;
+      next = BPROTO_PARSER_START;
+      bproto_parser_reset(p);
+      break;
+    default:
+      if (cls == BPROTO_CC_END) {
+	// Empty lines are skipped, anything else malformed is counted
+	if (p->state != BPROTO_PARSER_START && p->state != BPROTO_PARSER_DISCARD) {
+	  p->errors++;
+	}
+	next = BPROTO_PARSER_START;
+	bproto_parser_reset(p);
+      } else if (p->state != BPROTO_PARSER_DISCARD) {
+	p->errors++;
+      }
+      break;
+    }
+    p->state = next;
+  }
+
+  return emitted;
+}
+
+/*
+Signal the end of the stream, completing any unterminated message.
+Returns 1 if a message was passed to the callback.
+*/
+int bproto_parser_finish(bproto_parser_t *p) {
+  return bproto_parser_feed(p, "", 1);
+}
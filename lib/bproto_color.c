@@ -0,0 +1,132 @@
+#include "bproto.h"
+#include "bproto_color.h"
+
+#define BPROTO_KELVIN_STEP (200)
+#define BPROTO_KELVIN_LEN ((BPROTO_KELVIN_MAX - BPROTO_KELVIN_MIN) / BPROTO_KELVIN_STEP + 1)
+
+/*
+Blackbody RGB every 200K from 1000K to 12000K, after Tanner Helland's fit.
+*/
+static const uint8_t bproto_kelvin_table[BPROTO_KELVIN_LEN][3] = {
+  {255,  68,   0}, {255,  86,   0}, {255, 101,   0}, {255, 115,   0},
+  {255, 126,   0}, {255, 137,  14}, {255, 146,  39}, {255, 155,  61},
+  {255, 163,  79}, {255, 170,  95}, {255, 177, 110}, {255, 184, 123},
+  {255, 190, 135}, {255, 195, 146}, {255, 201, 157}, {255, 206, 166},
+  {255, 211, 175}, {255, 215, 183}, {255, 220, 191}, {255, 224, 199},
+  {255, 228, 206}, {255, 232, 213}, {255, 236, 219}, {255, 239, 225},
+  {255, 243, 231}, {255, 246, 237}, {255, 249, 242}, {255, 253, 248},
+  {255, 255, 255}, {250, 246, 255}, {243, 242, 255}, {237, 239, 255},
+  {232, 236, 255}, {228, 234, 255}, {224, 232, 255}, {221, 230, 255},
+  {218, 228, 255}, {216, 227, 255}, {214, 225, 255}, {212, 224, 255},
+  {210, 223, 255}, {208, 222, 255}, {206, 221, 255}, {205, 220, 255},
+  {203, 219, 255}, {202, 218, 255}, {200, 217, 255}, {199, 217, 255},
+  {198, 216, 255}, {197, 215, 255}, {196, 214, 255}, {195, 214, 255},
+  {194, 213, 255}, {193, 213, 255}, {192, 212, 255}, {191, 211, 255},
+};
+
+static inline int32_t bproto_min(int32_t x, int32_t y) {
+  return x < y ? x : y;
+}
+
+static inline int32_t bproto_max(int32_t x, int32_t y) {
+  return x > y ? x : y;
+}
+
+/*
+Builds without a white channel (BPROTO_RGB) ignore the white mode.
+*/
+static inline void bproto_white(bproto_t *b, bproto_white_t mode) {
+#if BPROTO_RGB
+  (void)b;
+  (void)mode;
+#else
+  if (mode == BPROTO_WHITE_EXTRACT) {
+    bproto_rgb_to_rgbw(b);
+  } else {
+    b->white = 0;
+  }
+#endif
+}
+
+/*
+Move min(R, G, B) into the white channel. R, G and B must be set.
+*/
+void bproto_rgb_to_rgbw(bproto_t *b) {
+#if BPROTO_RGB
+  (void)b;
+#else
+  bproto_value_t w = bproto_min(b->red, bproto_min(b->green, b->blue));
+  b->red -= w;
+  b->green -= w;
+  b->blue -= w;
+  b->white = w;
+#endif
+}
+
+/*
+One channel of HSV to RGB. `n` is the channel's offset around the hue
+circle in 1/256ths of a sector: 5 sectors for red, 3 for green, 1 for blue.
+*/
+static inline bproto_value_t bproto_hsv_channel(int32_t n, int32_t h, int32_t s, int32_t v) {
+  int32_t k = (n + h) % 1536;
+  int32_t ramp = bproto_max(0, bproto_min(256, bproto_min(k, 1024 - k)));
+  return v - (v * s * ramp + 32640) / 65280;
+}
+
+static inline void bproto_hsv_one(bproto_t *b, bproto_hue_t hue, uint8_t sat, uint8_t val) {
+  // Hue in 1/256ths of a 60 degree sector
+  int32_t h = ((int32_t)hue * 1536) >> 16;
+  b->red = bproto_hsv_channel(5 * 256, h, sat, val);
+  b->green = bproto_hsv_channel(3 * 256, h, sat, val);
+  b->blue = bproto_hsv_channel(1 * 256, h, sat, val);
+  b->time = BPROTO_TIME_UNSET;
+  b->ease = BPROTO_EASE_UNSET;
+}
+
+void bproto_hsv(bproto_t *b, bproto_hue_t hue, uint8_t sat, uint8_t val, bproto_white_t mode) {
+  bproto_hsv_one(b, hue, sat, val);
+  bproto_white(b, mode);
+}
+
+void bproto_hsv_batch(bproto_t *b, const bproto_hue_t *hue, const uint8_t *sat,
+		      const uint8_t *val, size_t n, bproto_white_t mode) {
+  for (size_t i = 0; i < n; i++) {
+    bproto_hsv_one(&b[i], hue[i], sat[i], val[i]);
+  }
+  for (size_t i = 0; i < n; i++) {
+    bproto_white(&b[i], mode);
+  }
+}
+
+static inline void bproto_kelvin_one(bproto_t *b, bproto_kelvin_t kelvin, uint8_t level) {
+  int32_t k = bproto_max(BPROTO_KELVIN_MIN, bproto_min(BPROTO_KELVIN_MAX, kelvin)) - BPROTO_KELVIN_MIN;
+  int32_t i = bproto_min(k / BPROTO_KELVIN_STEP, BPROTO_KELVIN_LEN - 2);
+  int32_t f = k - i * BPROTO_KELVIN_STEP;
+  const uint8_t *lo = bproto_kelvin_table[i], *hi = bproto_kelvin_table[i + 1];
+
+  bproto_value_t rgb[3];
+  for (int c = 0; c < 3; c++) {
+    int32_t x = (lo[c] * (BPROTO_KELVIN_STEP - f) + hi[c] * f + BPROTO_KELVIN_STEP / 2) / BPROTO_KELVIN_STEP;
+    rgb[c] = (x * level + 127) / 255;
+  }
+  b->red = rgb[0];
+  b->green = rgb[1];
+  b->blue = rgb[2];
+  b->time = BPROTO_TIME_UNSET;
+  b->ease = BPROTO_EASE_UNSET;
+}
+
+void bproto_kelvin(bproto_t *b, bproto_kelvin_t kelvin, uint8_t level, bproto_white_t mode) {
+  bproto_kelvin_one(b, kelvin, level);
+  bproto_white(b, mode);
+}
+
+void bproto_kelvin_batch(bproto_t *b, const bproto_kelvin_t *kelvin, const uint8_t *level,
+			 size_t n, bproto_white_t mode) {
+  for (size_t i = 0; i < n; i++) {
+    bproto_kelvin_one(&b[i], kelvin[i], level[i]);
+  }
+  for (size_t i = 0; i < n; i++) {
+    bproto_white(&b[i], mode);
+  }
+}
@@ -0,0 +1,91 @@
+#include <string.h>
+#include "bproto_dmx.h"
+
+#define BPROTO_DMX_ARTNET_ID "Art-Net"
+#define BPROTO_DMX_ARTNET_OP_DMX (0x5000)
+#define BPROTO_DMX_ARTNET_HDR_LEN (18)
+
+#define BPROTO_DMX_E131_ID "ASC-E1.17\0\0\0"
+#define BPROTO_DMX_E131_VECTOR_ROOT_DATA (0x00000004)
+#define BPROTO_DMX_E131_VECTOR_FRAME_DATA (0x00000002)
+#define BPROTO_DMX_E131_OPT_PREVIEW (0x80)
+#define BPROTO_DMX_E131_OPT_TERMINATED (0x40)
+#define BPROTO_DMX_E131_HDR_LEN (126)
+
+#define BPROTO_DMX_MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static inline uint16_t bproto_dmx_be16(const uint8_t *p) {
+  return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t bproto_dmx_be32(const uint8_t *p) {
+  return ((uint32_t)bproto_dmx_be16(p) << 16) | bproto_dmx_be16(p + 2);
+}
+
+/*
+Returns the number of DMX slots in an ArtDmx packet for `universe` (15-bit
+port address), pointing `slots` at them, or -1. A packet shorter than its
+length field gives the slots it has.
+*/
+int bproto_dmx_artnet_parse(const uint8_t *pkt, int len, uint16_t universe,
+			    const uint8_t **slots, uint8_t *seq) {
+  if (len < BPROTO_DMX_ARTNET_HDR_LEN ||
+      memcmp(pkt, BPROTO_DMX_ARTNET_ID, sizeof(BPROTO_DMX_ARTNET_ID)) != 0) {
+    return -1;
+  }
+  if ((pkt[8] | (pkt[9] << 8)) != BPROTO_DMX_ARTNET_OP_DMX) {
+    return -1;
+  }
+  if ((pkt[14] | ((pkt[15] & 0x7f) << 8)) != universe) {
+    return -1;
+  }
+  *seq = pkt[12];
+  *slots = pkt + BPROTO_DMX_ARTNET_HDR_LEN;
+  return BPROTO_DMX_MIN(bproto_dmx_be16(pkt + 16), len - BPROTO_DMX_ARTNET_HDR_LEN);
+}
+
+/*
+Returns the number of DMX slots in an E1.31 data packet for `universe`,
+pointing `slots` at them, or -1. Preview and stream-terminated packets are
+ignored, as are packets whose start code isn't zero.
+*/
+int bproto_dmx_e131_parse(const uint8_t *pkt, int len, uint16_t universe,
+			  const uint8_t **slots, uint8_t *seq) {
+  if (len < BPROTO_DMX_E131_HDR_LEN ||
+      memcmp(pkt + 4, BPROTO_DMX_E131_ID, sizeof(BPROTO_DMX_E131_ID) - 1) != 0) {
+    return -1;
+  }
+  if (bproto_dmx_be32(pkt + 18) != BPROTO_DMX_E131_VECTOR_ROOT_DATA ||
+      bproto_dmx_be32(pkt + 40) != BPROTO_DMX_E131_VECTOR_FRAME_DATA) {
+    return -1;
+  }
+  if (bproto_dmx_be16(pkt + 113) != universe ||
+      pkt[112] & (BPROTO_DMX_E131_OPT_PREVIEW | BPROTO_DMX_E131_OPT_TERMINATED)) {
+    return -1;
+  }
+  // Property values start with the DMX start code, which must be zero
+  if (pkt[125] != 0 || bproto_dmx_be16(pkt + 123) < 1) {
+    return -1;
+  }
+  *seq = pkt[111];
+  *slots = pkt + BPROTO_DMX_E131_HDR_LEN;
+  return BPROTO_DMX_MIN(bproto_dmx_be16(pkt + 123) - 1, len - BPROTO_DMX_E131_HDR_LEN);
+}
+
+/*
+Whether to apply a frame with sequence number `seq` received at `now` ms:
+frames older than the last one seen are dropped (E1.31 section 6.7.2),
+unless the source has been silent long enough to have restarted.
+*/
+int bproto_dmx_seq_accept(bproto_dmx_seq_t *s, uint8_t seq, uint32_t now) {
+  if (s->seen && now - s->last < BPROTO_DMX_TIMEOUT) {
+    int8_t diff = (int8_t)(seq - s->seq);
+    if (diff <= 0 && diff > -20) {
+      return 0;
+    }
+  }
+  s->seq = seq;
+  s->last = now;
+  s->seen = 1;
+  return 1;
+}
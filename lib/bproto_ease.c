@@ -0,0 +1,42 @@
+#include "bproto.h"
+#include "bproto_ease.h"
+
+/*
+sin(k * pi / 32) * BPROTO_EASE_ONE for k = 0..16, a quarter wave.
+*/
+static const uint16_t bproto_ease_sin_table[17] = {
+  0, 6424, 12785, 19024, 25079, 30893, 36409, 41575,
+  46340, 50659, 54490, 57797, 60546, 62713, 64276, 65219,
+  65535,
+};
+
+/*
+sin(t * pi / 2), interpolated from the table.
+*/
+static uint32_t bproto_ease_sin(uint32_t t) {
+  uint32_t idx = t >> 12, frac = t & 0xfff;
+  uint32_t lo = bproto_ease_sin_table[idx], hi = bproto_ease_sin_table[idx + 1];
+  return lo + (((hi - lo) * frac) >> 12);
+}
+
+bproto_progress_t bproto_ease(bproto_ease_t ease, bproto_progress_t t) {
+  uint32_t x = t, s;
+
+  if (t >= BPROTO_EASE_ONE) {
+    return BPROTO_EASE_ONE;
+  }
+
+  switch (ease) {
+  case BPROTO_EASE_IN:
+    return x * x / BPROTO_EASE_ONE;
+  case BPROTO_EASE_OUT:
+    x = BPROTO_EASE_ONE - x;
+    return BPROTO_EASE_ONE - x * x / BPROTO_EASE_ONE;
+  case BPROTO_EASE_SINE:
+    // (1 - cos(pi t)) / 2 = sin^2(pi t / 2)
+    s = bproto_ease_sin(x);
+    return s * s / BPROTO_EASE_ONE;
+  default:
+    return t;
+  }
+}
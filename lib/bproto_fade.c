@@ -0,0 +1,225 @@
+#include "bproto.h"
+#include "bproto_ease.h"
+#include "bproto_fade.h"
+
+#define BPROTO_FADE_MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/*
+Duty of a channel at `val`.
+*/
+uint32_t bproto_fade_duty(const bproto_fade_cfg_t *cfg, bproto_value_t val) {
+  return (uint32_t)val * cfg->max_duty / BPROTO_VALUE_T_MAX;
+}
+
+/*
+A linear ramp from duty `cur` to `duty` over `time` ms.
+
+Mirrors the step calculation of the ESP-IDF ledc_set_fade_with_time(), but
+moves the rounding error to the start of the ramp so it ends exactly on
+target. When it can't ramp (no change, or no time) it jumps to `duty`.
+*/
+void bproto_ramp_plan(bproto_ramp_t *r, const bproto_fade_cfg_t *cfg, uint32_t cur, uint32_t duty,
+		      bproto_time_t time) {
+  uint64_t cycles = (uint64_t)(time > 0 ? time : 0) * cfg->pwm_hz / 1000;
+  uint32_t delta = duty >= cur ? duty - cur : cur - duty;
+
+  r->dir = duty >= cur ? 1 : -1;
+  r->start = duty;
+  r->steps = 1;
+  r->cycles = 1;
+  r->scale = 0;
+
+  if (delta > 0 && cycles > 0) {
+    if (cycles > delta) {
+      r->scale = 1;
+      r->cycles = BPROTO_FADE_MIN(cycles / delta, cfg->num_max);
+    } else {
+      r->scale = BPROTO_FADE_MIN(delta / cycles, cfg->num_max);
+    }
+    r->steps = BPROTO_FADE_MIN(delta / r->scale, cfg->num_max);
+    r->start = r->dir > 0 ? duty - r->steps * r->scale : duty + r->steps * r->scale;
+  }
+}
+
+/*
+Duty `cycle` PWM cycles into a ramp. It holds its final duty once done.
+*/
+uint32_t bproto_ramp_sample(const bproto_ramp_t *r, uint64_t cycle) {
+  uint64_t step = cycle / r->cycles;
+  uint32_t moved = (step < r->steps ? step : r->steps) * r->scale;
+  return r->dir > 0 ? r->start + moved : r->start - moved;
+}
+
+/*
+A fade from duty `cur` to `val` as the firmware runs it: linear in one ramp,
+or eased in up to cfg->segments ramps of at least cfg->segment_min_ms. An
+unset time is instant and an unset ease linear.
+*/
+void bproto_fade_plan(bproto_fade_t *f, const bproto_fade_cfg_t *cfg, uint32_t cur,
+		      bproto_value_t val, bproto_time_t time, bproto_value_t ease) {
+  if (time == BPROTO_TIME_UNSET) {
+    time = 0;
+  }
+  if (ease == BPROTO_EASE_UNSET) {
+    ease = BPROTO_EASE_LINEAR;
+  }
+  uint32_t segs = BPROTO_FADE_MIN(cfg->segments, (uint32_t)time / cfg->segment_min_ms);
+
+  f->from = cur;
+  f->to = bproto_fade_duty(cfg, val);
+  f->time = time;
+  f->ease = ease;
+  f->segs = segs;
+
+  if (ease == BPROTO_EASE_LINEAR || segs < 2 || f->to == cur) {
+    f->ease = BPROTO_EASE_LINEAR;
+    f->segs = 1;
+  }
+}
+
+/*
+Duty at the end of segment `seg` of a fade; segment 0 ends at the start.
+*/
+uint32_t bproto_fade_seg_duty(const bproto_fade_t *f, int seg) {
+  bproto_progress_t t = (uint32_t)seg * BPROTO_EASE_ONE / f->segs;
+  return f->from + (int64_t)((int64_t)f->to - f->from) * bproto_ease(f->ease, t) / BPROTO_EASE_ONE;
+}
+
+/*
+The ramp of segment `seg` (1-based) of a fade. Segment lengths are taken as
+differences of cumulative times, so rounding never adds up over the fade.
+*/
+void bproto_fade_seg_ramp(bproto_ramp_t *r, const bproto_fade_cfg_t *cfg, const bproto_fade_t *f,
+			  int seg) {
+  bproto_time_t start = (int64_t)f->time * (seg - 1) / f->segs;
+  bproto_time_t end = (int64_t)f->time * seg / f->segs;
+  bproto_ramp_plan(r, cfg, bproto_fade_seg_duty(f, seg - 1), bproto_fade_seg_duty(f, seg),
+		   end - start);
+}
+
+/*
+Position in a fade. Each segment starts when the previous ramp ends, as the
+fade-end interrupt starts it, which may be before or after the nominal
+segment time since ramps round their step timing.
+*/
+typedef struct {
+  int seg;            // segment of `ramp`
+  uint64_t start;     // cycle `ramp` starts at
+  bproto_ramp_t ramp;
+} bproto_fade_cursor_t;
+
+static void bproto_fade_cursor_init(bproto_fade_cursor_t *c, const bproto_fade_cfg_t *cfg,
+				    const bproto_fade_t *f) {
+  c->seg = 1;
+  c->start = 0;
+  bproto_fade_seg_ramp(&c->ramp, cfg, f, 1);
+}
+
+/*
+Duty `cycle` cycles into the fade. Cheapest when successive calls move
+forward; moving back starts again from the first segment.
+*/
+static uint32_t bproto_fade_cursor_sample(bproto_fade_cursor_t *c, const bproto_fade_cfg_t *cfg,
+					  const bproto_fade_t *f, uint64_t cycle) {
+  if (cycle < c->start) {
+    bproto_fade_cursor_init(c, cfg, f);
+  }
+  while (c->seg < f->segs && cycle - c->start >= (uint64_t)c->ramp.steps * c->ramp.cycles) {
+    c->start += (uint64_t)c->ramp.steps * c->ramp.cycles;
+    c->seg++;
+    bproto_fade_seg_ramp(&c->ramp, cfg, f, c->seg);
+  }
+  return bproto_ramp_sample(&c->ramp, cycle - c->start);
+}
+
+static uint64_t bproto_fade_cycles(const bproto_fade_cfg_t *cfg, uint32_t ms) {
+  return (uint64_t)ms * cfg->pwm_hz / 1000;
+}
+
+/*
+Duty `ms` after a fade started.
+*/
+uint32_t bproto_fade_sample(const bproto_fade_t *f, const bproto_fade_cfg_t *cfg, uint32_t ms) {
+  bproto_fade_cursor_t c;
+  bproto_fade_cursor_init(&c, cfg, f);
+  return bproto_fade_cursor_sample(&c, cfg, f, bproto_fade_cycles(cfg, ms));
+}
+
+/*
+ms from the start of a fade until it reaches its target, rounded up.
+*/
+uint32_t bproto_fade_length(const bproto_fade_t *f, const bproto_fade_cfg_t *cfg) {
+  uint64_t cycles = 0;
+  for (int seg = 1; seg <= f->segs; seg++) {
+    bproto_ramp_t r;
+    bproto_fade_seg_ramp(&r, cfg, f, seg);
+    cycles += (uint64_t)r.steps * r.cycles;
+  }
+  return (cycles * 1000 + cfg->pwm_hz - 1) / cfg->pwm_hz;
+}
+
+/*
+Sample each of `nf` fades at each of the `n` times in `ms` (since the fades
+started), into out[fade * n + i]. Times in increasing order are fastest.
+*/
+void bproto_fade_sample_batch(const bproto_fade_t *f, size_t nf, const uint32_t *ms, size_t n,
+			      const bproto_fade_cfg_t *cfg, uint32_t *out) {
+  for (size_t j = 0; j < nf; j++) {
+    bproto_fade_cursor_t c;
+    bproto_fade_cursor_init(&c, cfg, &f[j]);
+    for (size_t i = 0; i < n; i++) {
+      out[j * n + i] = bproto_fade_cursor_sample(&c, cfg, &f[j], bproto_fade_cycles(cfg, ms[i]));
+    }
+  }
+}
+
+/*
+Render a strip driven by `keys` (in time order, from all channels at 0) at
+each of the `n` times in `ms`, into out[i] as the duty of each channel. Like the
+firmware, a message only restarts the fades of channels it changes, from
+wherever they are at the time. Times must not decrease; returns how many
+were rendered.
+*/
+size_t bproto_fade_render(const bproto_keyframe_t *keys, size_t nkeys, const uint32_t *ms, size_t n,
+			  const bproto_fade_cfg_t *cfg, uint32_t (*out)[BPROTO_FADE_CHANNELS]) {
+  bproto_fade_t fades[BPROTO_FADE_CHANNELS];
+  bproto_fade_cursor_t cursors[BPROTO_FADE_CHANNELS];
+  uint32_t started[BPROTO_FADE_CHANNELS] = { 0 };
+  bproto_value_t vals[BPROTO_FADE_CHANNELS] = { 0 };
+
+  for (int ch = 0; ch < BPROTO_FADE_CHANNELS; ch++) {
+    bproto_fade_plan(&fades[ch], cfg, 0, 0, 0, BPROTO_EASE_LINEAR);
+    bproto_fade_cursor_init(&cursors[ch], cfg, &fades[ch]);
+  }
+
+  size_t k = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (i > 0 && ms[i] < ms[i - 1]) {
+      return i;
+    }
+
+    for (; k < nkeys && keys[k].at <= ms[i]; k++) {
+      const bproto_t *msg = &keys[k].msg;
+      bproto_value_t set[BPROTO_FADE_CHANNELS];
+      bproto_channels(msg, set);
+      for (int ch = 0; ch < BPROTO_FADE_CHANNELS; ch++) {
+	if (set[ch] == BPROTO_VALUE_UNSET || set[ch] == vals[ch]) {
+	  continue;
+	}
+	uint32_t at = keys[k].at > started[ch] ? keys[k].at - started[ch] : 0;
+	uint32_t cur = bproto_fade_cursor_sample(&cursors[ch], cfg, &fades[ch],
+						 bproto_fade_cycles(cfg, at));
+	bproto_fade_plan(&fades[ch], cfg, cur, set[ch], msg->time, msg->ease);
+	bproto_fade_cursor_init(&cursors[ch], cfg, &fades[ch]);
+	started[ch] = keys[k].at;
+	vals[ch] = set[ch];
+      }
+    }
+
+    for (int ch = 0; ch < BPROTO_FADE_CHANNELS; ch++) {
+      out[i][ch] = bproto_fade_cursor_sample(&cursors[ch], cfg, &fades[ch],
+					     bproto_fade_cycles(cfg, ms[i] - started[ch]));
+    }
+  }
+  return n;
+}
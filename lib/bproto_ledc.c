@@ -0,0 +1,62 @@
+#include <string.h>
+#include "bproto_ledc.h"
+
+/*
+Drive channels through `ops`.
+*/
+void bproto_ledc_init(bproto_ledc_t *ledc, const bproto_ledc_ops_t *ops) {
+  memset(ledc, 0, sizeof(*ledc));
+  ledc->ops = ops;
+}
+
+/*
+Channels of `new` which are set and differ from `cur`.
+*/
+bproto_ledc_mask_t bproto_ledc_dirty(const bproto_t *new, const bproto_t *cur) {
+  bproto_value_t new_vals[BPROTO_CHANNEL_COUNT], cur_vals[BPROTO_CHANNEL_COUNT];
+  bproto_channels(new, new_vals);
+  bproto_channels(cur, cur_vals);
+
+  bproto_ledc_mask_t dirty = 0;
+  for (int i = 0; i < BPROTO_CHANNEL_COUNT; i++) {
+    if (new_vals[i] != BPROTO_VALUE_UNSET && new_vals[i] != cur_vals[i]) {
+      dirty |= 1u << i;
+    }
+  }
+  return dirty;
+}
+
+/*
+Program every channel in `mask`, then start them all under one lock and
+record how far apart the first and last starts were. `ctx` goes to every
+hook. Nothing is started if any channel fails to program. Returns 0, or the
+first nonzero hook result.
+*/
+int bproto_ledc_update(bproto_ledc_t *ledc, bproto_ledc_mask_t mask, void *ctx) {
+  const bproto_ledc_ops_t *ops = ledc->ops;
+  int res = 0, err;
+
+  for (int i = 0; i < BPROTO_CHANNEL_COUNT; i++) {
+    if ((mask & (1u << i)) && (err = ops->program(i, ctx)) != 0 && res == 0) {
+      res = err;
+    }
+  }
+  if (res != 0 || mask == 0) {
+    return res;
+  }
+
+  ops->lock(ctx);
+  uint32_t start = ops->clock(ctx);
+  for (int i = 0; i < BPROTO_CHANNEL_COUNT; i++) {
+    if ((mask & (1u << i)) && (err = ops->start(i, ctx)) != 0 && res == 0) {
+      res = err;
+    }
+  }
+  ledc->skew = ops->clock(ctx) - start;
+  ops->unlock(ctx);
+
+  if (ledc->skew > ledc->skew_max) {
+    ledc->skew_max = ledc->skew;
+  }
+  return res;
+}
@@ -0,0 +1,253 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <string.h>
+#include <sys/select.h>
+#include <time.h>
+#include <unistd.h>
+#include "bproto_loop.h"
+
+/*
+All functions returning int give 0 (or a count) on success and -1 with errno
+set on error.
+*/
+
+/*
+Default clock: ms since an arbitrary point, never going back.
+*/
+uint32_t bproto_loop_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void bproto_loop_init(bproto_loop_t *loop, bproto_loop_clock_t clock) {
+  memset(loop, 0, sizeof(*loop));
+  loop->clock = clock != NULL ? clock : bproto_loop_clock;
+  loop->now = loop->clock();
+}
+
+static int bproto_loop_find(const bproto_loop_t *loop, int fd) {
+  for (size_t i = 0; i < loop->nio; i++) {
+    if (loop->io[i].fd == fd) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+Call `cb(fd, ctx)` from the loop whenever `fd` is readable. Watching a
+descriptor again replaces its callback. The descriptor should be
+non-blocking, as the callback may find nothing left to read.
+*/
+int bproto_loop_watch(bproto_loop_t *loop, int fd, bproto_loop_io_cb_t cb, void *ctx) {
+  if (fd < 0 || fd >= FD_SETSIZE) {
+    errno = EBADF;
+    return -1;
+  }
+  int i = bproto_loop_find(loop, fd);
+  if (i < 0) {
+    if (loop->nio == BPROTO_LOOP_FDS) {
+      errno = ENOSPC;
+      return -1;
+    }
+    i = loop->nio++;
+  }
+  loop->io[i] = (bproto_loop_io_t) { .fd = fd, .cb = cb, .ctx = ctx };
+  return 0;
+}
+
+int bproto_loop_unwatch(bproto_loop_t *loop, int fd) {
+  int i = bproto_loop_find(loop, fd);
+  if (i < 0) {
+    errno = ENOENT;
+    return -1;
+  }
+  loop->io[i] = loop->io[--loop->nio];
+  return 0;
+}
+
+static void bproto_timer_link(bproto_timer_t **head, bproto_timer_t *t) {
+  t->next = *head;
+  if (t->next != NULL) {
+    t->next->pprev = &t->next;
+  }
+  t->pprev = head;
+  *head = t;
+}
+
+void bproto_timer_init(bproto_timer_t *t, bproto_timer_cb_t cb, void *ctx) {
+  memset(t, 0, sizeof(*t));
+  t->cb = cb;
+  t->ctx = ctx;
+}
+
+int bproto_timer_armed(const bproto_timer_t *t) {
+  return t->pprev != NULL;
+}
+
+void bproto_timer_stop(bproto_timer_t *t) {
+  if (t->pprev == NULL) {
+    return;
+  }
+  *t->pprev = t->next;
+  if (t->next != NULL) {
+    t->next->pprev = t->pprev;
+  }
+  t->next = NULL;
+  t->pprev = NULL;
+}
+
+/*
+(Re)arm a timer to fire once, `ms` from now.
+*/
+void bproto_timer_start(bproto_loop_t *loop, bproto_timer_t *t, uint32_t ms) {
+  bproto_timer_stop(t);
+  t->due = loop->clock() + ms;
+  bproto_timer_link(&loop->wheel[t->due / BPROTO_LOOP_TICK % BPROTO_LOOP_SLOTS], t);
+}
+
+/*
+Fire every timer which is due, slot by slot from where the wheel last
+stopped. Due timers are moved off the wheel first, so callbacks can start
+and stop any timer, including their own.
+*/
+static int bproto_loop_expire(bproto_loop_t *loop) {
+  uint32_t now = loop->clock();
+  uint32_t tick = loop->now / BPROTO_LOOP_TICK;
+  uint32_t ticks = (now - loop->now) / BPROTO_LOOP_TICK + 2;
+  if (ticks > BPROTO_LOOP_SLOTS) {
+    ticks = BPROTO_LOOP_SLOTS;
+  }
+
+  bproto_timer_t *expired = NULL, **tail = &expired;
+  for (uint32_t i = 0; i < ticks; i++) {
+    bproto_timer_t *t = loop->wheel[(tick + i) % BPROTO_LOOP_SLOTS], *next;
+    for (; t != NULL; t = next) {
+      next = t->next;
+      if ((int32_t)(t->due - now) <= 0) {
+	bproto_timer_stop(t);
+	bproto_timer_link(tail, t);
+	tail = &t->next;
+      }
+    }
+  }
+  loop->now = now;
+
+  int fired = 0;
+  while (expired != NULL) {
+    bproto_timer_t *t = expired;
+    bproto_timer_stop(t);
+    t->cb(t, t->ctx);
+    fired++;
+  }
+  return fired;
+}
+
+/*
+ms until the next timer is due, or -1 if none is armed. Only valid straight
+after bproto_loop_expire(), when every armed timer is in the future: then a
+timer `k` slots ahead is due more than `k - 1` ticks from now, and the scan
+can stop as soon as nothing further on can be sooner.
+*/
+static int32_t bproto_loop_next(const bproto_loop_t *loop) {
+  uint32_t tick = loop->now / BPROTO_LOOP_TICK;
+  int32_t best = INT32_MAX;
+  for (uint32_t k = 0; k < BPROTO_LOOP_SLOTS; k++) {
+    for (bproto_timer_t *t = loop->wheel[(tick + k) % BPROTO_LOOP_SLOTS]; t != NULL; t = t->next) {
+      int32_t left = t->due - loop->now;
+      if (left < best) {
+	best = left;
+      }
+    }
+    if (best <= (int32_t)(k * BPROTO_LOOP_TICK)) {
+      break;
+    }
+  }
+  return best == INT32_MAX ? -1 : best < 0 ? 0 : best;
+}
+
+/*
+Run due timers, wait up to `timeout` ms (forever if negative) for a watched
+descriptor to become readable or the next timer, then dispatch what is ready.
+Returns the number of callbacks made.
+*/
+int bproto_loop_run_once(bproto_loop_t *loop, int timeout) {
+  int events = bproto_loop_expire(loop);
+  int32_t next = bproto_loop_next(loop);
+  if (events > 0) {
+    timeout = 0;
+  } else if (next >= 0 && (timeout < 0 || next < timeout)) {
+    timeout = next;
+  }
+
+  fd_set readfds;
+  int maxfd = -1;
+  FD_ZERO(&readfds);
+  for (size_t i = 0; i < loop->nio; i++) {
+    FD_SET(loop->io[i].fd, &readfds);
+    if (loop->io[i].fd > maxfd) {
+      maxfd = loop->io[i].fd;
+    }
+  }
+  struct timeval tv = {
+    .tv_sec = timeout / 1000,
+    .tv_usec = timeout % 1000 * 1000,
+  };
+  int ready = select(maxfd + 1, &readfds, NULL, NULL, timeout < 0 ? NULL : &tv);
+  if (ready < 0 && errno != EINTR) {
+    return -1;
+  }
+
+  // Callbacks may (un)watch descriptors, so dispatch from a copy and skip
+  // any that have gone meanwhile
+  bproto_loop_io_t io[BPROTO_LOOP_FDS];
+  size_t nio = loop->nio;
+  memcpy(io, loop->io, nio * sizeof(*io));
+  for (size_t i = 0; ready > 0 && i < nio; i++) {
+    int j = bproto_loop_find(loop, io[i].fd);
+    if (FD_ISSET(io[i].fd, &readfds) && j >= 0 && loop->io[j].cb == io[i].cb) {
+      loop->io[j].cb(io[i].fd, loop->io[j].ctx);
+      events++;
+    }
+  }
+
+  return events + bproto_loop_expire(loop);
+}
+
+/*
+Run until bproto_loop_stop() is called from a callback, or select() fails.
+*/
+int bproto_loop_run(bproto_loop_t *loop) {
+  loop->stopped = 0;
+  while (!loop->stopped) {
+    if (bproto_loop_run_once(loop, -1) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void bproto_loop_stop(bproto_loop_t *loop) {
+  loop->stopped = 1;
+}
+
+/*
+Feed everything waiting on non-blocking `fd` into `parser`, for line inputs
+read from a watch callback. Lines split across reads and several lines in
+one read both come out as whole messages. Returns the number of messages
+passed to the parser's callback.
+*/
+int bproto_loop_feed(int fd, bproto_parser_t *parser) {
+  char buf[BPROTO_LOOP_CHUNK];
+  ssize_t len;
+  int emitted = 0;
+
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    emitted += bproto_parser_feed(parser, buf, len);
+  }
+  if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    return -1;
+  }
+  return emitted;
+}
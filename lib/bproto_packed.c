@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+#include "bproto.h"
+#include "bproto_packed.h"
+
+/*
+Channel mask to the bytes of `channels` it covers.
+*/
+static const uint32_t bproto_packed_lanes[16] = {
+  0x00000000, 0x000000ff, 0x0000ff00, 0x0000ffff,
+  0x00ff0000, 0x00ff00ff, 0x00ffff00, 0x00ffffff,
+  0xff000000, 0xff0000ff, 0xff00ff00, 0xff00ffff,
+  0xffff0000, 0xffff00ff, 0xffffff00, 0xffffffff,
+};
+
+static inline uint32_t bproto_packed_time_lane(uint8_t mask) {
+  return -(uint32_t)((mask & BPROTO_MASK_TIME) != 0);
+}
+
+static inline uint8_t bproto_packed_ease_lane(uint8_t mask) {
+  return -(uint8_t)((mask & BPROTO_MASK_EASE) != 0);
+}
+
+void bproto_pack(bproto_packed_t *p, const bproto_t *b) {
+  bproto_value_t vals[BPROTO_CHANNELS];
+  bproto_channels(b, vals);
+  p->channels = 0;
+  p->time = 0;
+  p->mask = 0;
+  p->ease = 0;
+
+  for (int i = 0; i < BPROTO_CHANNELS; i++) {
+    if (vals[i] != BPROTO_VALUE_UNSET) {
+      p->channels |= (uint32_t)vals[i] << (8 * i);
+      p->mask |= 1 << i;
+    }
+  }
+
+  if (b->time != BPROTO_TIME_UNSET) {
+    p->time = b->time;
+    p->mask |= BPROTO_MASK_TIME;
+  }
+
+  if (b->ease != BPROTO_EASE_UNSET) {
+    p->ease = b->ease;
+    p->mask |= BPROTO_MASK_EASE;
+  }
+}
+
+void bproto_unpack(bproto_t *b, const bproto_packed_t *p) {
+  bproto_value_t vals[BPROTO_CHANNELS];
+  for (int i = 0; i < BPROTO_CHANNELS; i++) {
+    vals[i] = p->mask & (1 << i) ? (p->channels >> (8 * i)) & 0xff : BPROTO_VALUE_UNSET;
+  }
+  bproto_set_channels(b, vals);
+  b->time = p->mask & BPROTO_MASK_TIME ? (bproto_time_t)p->time : BPROTO_TIME_UNSET;
+  b->ease = p->mask & BPROTO_MASK_EASE ? p->ease : BPROTO_EASE_UNSET;
+}
+
+/*
+y is target, as bproto_copy.
+*/
+void bproto_packed_copy(const bproto_packed_t *x, bproto_packed_t *y) {
+  uint32_t lanes = bproto_packed_lanes[x->mask & BPROTO_MASK_CHANNELS];
+  uint32_t time = bproto_packed_time_lane(x->mask);
+  uint8_t ease = bproto_packed_ease_lane(x->mask);
+  y->channels = (y->channels & ~lanes) | (x->channels & lanes);
+  y->time = (y->time & ~time) | (x->time & time);
+  y->ease = (y->ease & ~ease) | (x->ease & ease);
+  y->mask |= x->mask;
+}
+
+int bproto_packed_eq(const bproto_packed_t *x, const bproto_packed_t *y) {
+  uint32_t lanes = bproto_packed_lanes[x->mask & BPROTO_MASK_CHANNELS];
+  uint32_t time = bproto_packed_time_lane(x->mask);
+  uint8_t ease = bproto_packed_ease_lane(x->mask);
+  return (x->mask == y->mask) &
+    (((x->channels ^ y->channels) & lanes) == 0) &
+    (((x->time ^ y->time) & time) == 0) &
+    (((x->ease ^ y->ease) & ease) == 0);
+}
+
+int bproto_packed_is_set(const bproto_packed_t *p) {
+  return p->mask != 0;
+}
+
+/*
+Returns 0 on success and -1 if allocation fails.
+*/
+int bproto_batch_init(bproto_batch_t *batch, size_t cap) {
+  memset(batch, 0, sizeof(*batch));
+  batch->cap = cap;
+  for (int i = 0; i < BPROTO_CHANNELS; i++) {
+    batch->channel[i] = calloc(cap ? cap : 1, sizeof(uint8_t));
+  }
+  batch->time = calloc(cap ? cap : 1, sizeof(uint32_t));
+  batch->ease = calloc(cap ? cap : 1, sizeof(uint8_t));
+  batch->mask = calloc(cap ? cap : 1, sizeof(uint8_t));
+
+  int ok = batch->time != NULL && batch->ease != NULL && batch->mask != NULL;
+  for (int i = 0; i < BPROTO_CHANNELS; i++) {
+    ok = ok && batch->channel[i] != NULL;
+  }
+  if (!ok) {
+    bproto_batch_free(batch);
+    return -1;
+  }
+  return 0;
+}
+
+void bproto_batch_free(bproto_batch_t *batch) {
+  for (int i = 0; i < BPROTO_CHANNELS; i++) {
+    free(batch->channel[i]);
+  }
+  free(batch->time);
+  free(batch->ease);
+  free(batch->mask);
+  memset(batch, 0, sizeof(*batch));
+}
+
+/*
+Replace the batch's contents with up to `cap` messages. Returns how many
+were loaded.
+*/
+size_t bproto_batch_load(bproto_batch_t *batch, const bproto_t *b, size_t n) {
+  if (n > batch->cap) {
+    n = batch->cap;
+  }
+  for (size_t i = 0; i < n; i++) {
+    bproto_packed_t p;
+    bproto_pack(&p, &b[i]);
+    for (int c = 0; c < BPROTO_CHANNELS; c++) {
+      batch->channel[c][i] = p.channels >> (8 * c);
+    }
+    batch->time[i] = p.time;
+    batch->ease[i] = p.ease;
+    batch->mask[i] = p.mask;
+  }
+  batch->len = n;
+  return n;
+}
+
+void bproto_batch_store(const bproto_batch_t *batch, bproto_t *b) {
+  for (size_t i = 0; i < batch->len; i++) {
+    bproto_packed_t p = {
+      .channels = 0,
+      .time = batch->time[i],
+      .mask = batch->mask[i],
+      .ease = batch->ease[i],
+    };
+    for (int c = 0; c < BPROTO_CHANNELS; c++) {
+      p.channels |= (uint32_t)batch->channel[c][i] << (8 * c);
+    }
+    bproto_unpack(&b[i], &p);
+  }
+}
+
+/*
+bproto_packed_copy of each message of x onto the same message of y.
+*/
+void bproto_batch_copy(const bproto_batch_t *x, bproto_batch_t *y) {
+  size_t n = x->len < y->len ? x->len : y->len;
+
+  for (int c = 0; c < BPROTO_CHANNELS; c++) {
+    const uint8_t *src = x->channel[c];
+    uint8_t *dst = y->channel[c];
+    for (size_t i = 0; i < n; i++) {
+      uint8_t lane = -((x->mask[i] >> c) & 1);
+      dst[i] = (dst[i] & ~lane) | (src[i] & lane);
+    }
+  }
+  for (size_t i = 0; i < n; i++) {
+    uint32_t lane = bproto_packed_time_lane(x->mask[i]);
+    y->time[i] = (y->time[i] & ~lane) | (x->time[i] & lane);
+  }
+  for (size_t i = 0; i < n; i++) {
+    uint8_t lane = bproto_packed_ease_lane(x->mask[i]);
+    y->ease[i] = (y->ease[i] & ~lane) | (x->ease[i] & lane);
+  }
+  for (size_t i = 0; i < n; i++) {
+    y->mask[i] |= x->mask[i];
+  }
+}
+
+/*
+Compare messages pairwise, writing 1 or 0 per message to `out`. Returns the
+number of equal messages.
+*/
+size_t bproto_batch_eq(const bproto_batch_t *x, const bproto_batch_t *y, uint8_t *out) {
+  size_t n = x->len < y->len ? x->len : y->len;
+
+  for (size_t i = 0; i < n; i++) {
+    out[i] = x->mask[i] == y->mask[i];
+  }
+  for (int c = 0; c < BPROTO_CHANNELS; c++) {
+    const uint8_t *a = x->channel[c], *b = y->channel[c];
+    for (size_t i = 0; i < n; i++) {
+      uint8_t lane = -((x->mask[i] >> c) & 1);
+      out[i] &= ((a[i] ^ b[i]) & lane) == 0;
+    }
+  }
+  size_t equal = 0;
+  for (size_t i = 0; i < n; i++) {
+    uint32_t lane = bproto_packed_time_lane(x->mask[i]);
+    out[i] &= ((x->time[i] ^ y->time[i]) & lane) == 0;
+    out[i] &= ((x->ease[i] ^ y->ease[i]) & bproto_packed_ease_lane(x->mask[i])) == 0;
+    equal += out[i];
+  }
+  return equal;
+}
@@ -0,0 +1,188 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bproto.h"
+#include "bproto_par.h"
+
+// Chunks per thread. Workers take the next chunk when they finish one, so
+// chunks with many short or many long lines even out.
+#define BPROTO_PAR_CHUNKS_PER_THREAD (8)
+// Below this many bytes per chunk, threads cost more than they save.
+#define BPROTO_PAR_MIN_CHUNK (64 * 1024)
+
+typedef struct {
+  const char *start, *end;
+  size_t lines, messages; // counted in the first pass
+  size_t out;             // index of the chunk's first message in `out`
+  size_t line;            // number of the chunk's first line
+  size_t error;           // first malformed line in the chunk, or SIZE_MAX
+  size_t parsed;          // messages parsed before `error`
+} bproto_par_chunk_t;
+
+typedef struct {
+  bproto_par_chunk_t *chunks;
+  size_t nchunks;
+  size_t next;
+  int pass;
+  bproto_t *out;
+} bproto_par_job_t;
+
+static inline const char *bproto_par_eol(const char *ptr, const char *end) {
+  const char *nl = memchr(ptr, '\n', end - ptr);
+  return nl != NULL ? nl : end;
+}
+
+static inline size_t bproto_par_line_len(const char *ptr, const char *eol) {
+  size_t len = eol - ptr;
+  if (len > 0 && ptr[len - 1] == '\r') {
+    len--;
+  }
+  return len;
+}
+
+static void bproto_par_count(bproto_par_chunk_t *c) {
+  c->lines = 0;
+  c->messages = 0;
+  for (const char *ptr = c->start; ptr < c->end; c->lines++) {
+    const char *eol = bproto_par_eol(ptr, c->end);
+    if (bproto_par_line_len(ptr, eol) > 0) {
+      c->messages++;
+    }
+    ptr = eol + 1;
+  }
+}
+
+static void bproto_par_parse(bproto_par_chunk_t *c, bproto_t *out) {
+  size_t line = c->line;
+  out += c->out;
+  c->error = SIZE_MAX;
+  c->parsed = 0;
+
+  for (const char *ptr = c->start; ptr < c->end; line++) {
+    const char *eol = bproto_par_eol(ptr, c->end);
+    size_t len = bproto_par_line_len(ptr, eol);
+    if (len > 0) {
+      if (bproto_parse_n(out, ptr, len) == ptr) {
+	c->error = line;
+	return;
+      }
+      out++;
+      c->parsed++;
+    }
+    ptr = eol + 1;
+  }
+}
+
+static void *bproto_par_worker(void *arg) {
+  bproto_par_job_t *job = arg;
+  size_t i;
+  while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nchunks) {
+    if (job->pass == 0) {
+      bproto_par_count(&job->chunks[i]);
+    } else {
+      bproto_par_parse(&job->chunks[i], job->out);
+    }
+  }
+  return NULL;
+}
+
+/*
+Run one pass over all chunks on up to `threads` threads, including this one.
+If threads can't be started, the remaining ones pick up their chunks.
+*/
+static void bproto_par_run(bproto_par_job_t *job, pthread_t *tids, int threads) {
+  int started = 0;
+  job->next = 0;
+  for (; started < threads - 1; started++) {
+    if (pthread_create(&tids[started], NULL, bproto_par_worker, job) != 0) {
+      break;
+    }
+  }
+  bproto_par_worker(job);
+  for (int i = 0; i < started; i++) {
+    pthread_join(tids[i], NULL);
+  }
+}
+
+bproto_par_status_t bproto_parse_lines(bproto_t *out, size_t cap, const char *buf, size_t len,
+				       bproto_par_result_t *res) {
+  return bproto_parse_lines_parallel(out, cap, buf, len, 1, res);
+}
+
+bproto_par_status_t bproto_parse_lines_parallel(bproto_t *out, size_t cap, const char *buf, size_t len,
+						int threads, bproto_par_result_t *res) {
+  res->count = 0;
+  res->error = 0;
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  size_t nchunks = threads * BPROTO_PAR_CHUNKS_PER_THREAD;
+  if (nchunks > len / BPROTO_PAR_MIN_CHUNK) {
+    nchunks = len / BPROTO_PAR_MIN_CHUNK;
+  }
+  if (nchunks < 1) {
+    nchunks = 1;
+  }
+  if ((size_t)threads > nchunks) {
+    threads = nchunks;
+  }
+
+  bproto_par_chunk_t *chunks = calloc(nchunks, sizeof(*chunks));
+  pthread_t *tids = calloc(threads, sizeof(*tids));
+  if (chunks == NULL || tids == NULL) {
+    free(chunks);
+    free(tids);
+    return BPROTO_PAR_ENOMEM;
+  }
+
+  // Split on line boundaries: each chunk ends just after a newline
+  const char *ptr = buf, *end = buf + len;
+  size_t n = 0;
+  for (; n < nchunks && ptr < end; n++) {
+    const char *split = n == nchunks - 1 ? end : buf + len / nchunks * (n + 1);
+    if (split < ptr) {
+      split = ptr;
+    }
+    split = split < end ? bproto_par_eol(split, end) : end;
+    chunks[n].start = ptr;
+    chunks[n].end = split < end ? split + 1 : end;
+    ptr = chunks[n].end;
+  }
+
+  bproto_par_job_t job = { .chunks = chunks, .nchunks = n, .pass = 0, .out = out };
+  bproto_par_status_t status = BPROTO_PAR_OK;
+
+  bproto_par_run(&job, tids, threads);
+
+  size_t messages = 0, lines = 0;
+  for (size_t i = 0; i < n; i++) {
+    chunks[i].out = messages;
+    chunks[i].line = lines;
+    messages += chunks[i].messages;
+    lines += chunks[i].lines;
+  }
+  if (messages > cap) {
+    status = BPROTO_PAR_ENOSPC;
+    goto done;
+  }
+
+  job.pass = 1;
+  bproto_par_run(&job, tids, threads);
+
+  res->count = messages;
+  for (size_t i = 0; i < n; i++) {
+    if (chunks[i].error != SIZE_MAX) {
+      res->count = chunks[i].out + chunks[i].parsed;
+      res->error = chunks[i].error;
+      status = BPROTO_PAR_EPARSE;
+      break;
+    }
+  }
+
+ done:
+  free(chunks);
+  free(tids);
+  return status;
+}
@@ -0,0 +1,70 @@
+#include "bproto_pool.h"
+
+/*
+Set up the free list and clear the counters of a pool whose name, size,
+count and arena are filled in.
+*/
+void bproto_pool_init(bproto_pool_t *pool) {
+  pool->free = NULL;
+  for (size_t i = pool->count; i-- > 0; ) {
+    bproto_pool_block_t *block = (bproto_pool_block_t*)(pool->arena + i * pool->size);
+    block->next = pool->free;
+    pool->free = block;
+  }
+  pool->used = pool->high_water = 0;
+  pool->exhausted = 0;
+}
+
+/*
+A free block, or NULL if the pool is empty.
+*/
+void *bproto_pool_alloc(bproto_pool_t *pool) {
+  bproto_pool_block_t *block = pool->free;
+  if (block == NULL) {
+    pool->exhausted++;
+    return NULL;
+  }
+  pool->free = block->next;
+  pool->used++;
+  if (pool->used > pool->high_water) {
+    pool->high_water = pool->used;
+  }
+  return block;
+}
+
+/*
+Return a block from bproto_pool_alloc() to `pool`.
+*/
+void bproto_pool_free(bproto_pool_t *pool, void *ptr) {
+  bproto_pool_block_t *block = ptr;
+  block->next = pool->free;
+  pool->free = block;
+  pool->used--;
+}
+
+/*
+The first of `n` pools, ordered by block size, whose blocks hold `size`
+bytes, or NULL if none do.
+*/
+bproto_pool_t *bproto_pool_fit(bproto_pool_t *pools, size_t n, size_t size) {
+  for (size_t i = 0; i < n; i++) {
+    if (size <= pools[i].size) {
+      return &pools[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+The one of `n` pools whose arena holds `ptr`, or NULL if it came from
+elsewhere.
+*/
+bproto_pool_t *bproto_pool_find(bproto_pool_t *pools, size_t n, const void *ptr) {
+  const uint8_t *p = ptr;
+  for (size_t i = 0; i < n; i++) {
+    if (p >= pools[i].arena && p < pools[i].arena + pools[i].count * pools[i].size) {
+      return &pools[i];
+    }
+  }
+  return NULL;
+}
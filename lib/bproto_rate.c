@@ -0,0 +1,71 @@
+#include <string.h>
+#include "bproto_rate.h"
+
+#define BPROTO_RATE_MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/*
+Limit peers to `per_sec` requests a second with bursts of `burst`, tracking
+up to `len` of them in `buckets`.
+*/
+void bproto_rate_init(bproto_rate_t *rate, bproto_rate_bucket_t *buckets, size_t len,
+		      uint32_t per_sec, uint32_t burst) {
+  memset(buckets, 0, len * sizeof(*buckets));
+  rate->buckets = buckets;
+  rate->len = len;
+  rate->per_sec = per_sec;
+  rate->burst = burst;
+}
+
+/*
+The bucket of peer `key`, starting a full one if the peer is new.
+*/
+bproto_rate_bucket_t *bproto_rate_lookup(bproto_rate_t *rate, const uint8_t *key,
+					 uint32_t now) {
+  // FNV-1a over the address
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < BPROTO_RATE_KEY_LEN; i++) {
+    hash = (hash ^ key[i]) * 16777619u;
+  }
+
+  bproto_rate_bucket_t *victim = NULL;
+  for (int i = 0; i < BPROTO_RATE_PROBE; i++) {
+    bproto_rate_bucket_t *bucket = &rate->buckets[(hash + i) % rate->len];
+    if (bucket->used && memcmp(bucket->key, key, BPROTO_RATE_KEY_LEN) == 0) {
+      return bucket;
+    }
+    if (!bucket->used) {
+      if (!victim || victim->used) {
+	victim = bucket;
+      }
+    } else if (!victim ||
+	       (victim->used && now - bucket->last > now - victim->last)) {
+      victim = bucket;
+    }
+  }
+
+  memcpy(victim->key, key, BPROTO_RATE_KEY_LEN);
+  victim->used = 1;
+  victim->tokens = rate->burst * BPROTO_RATE_SCALE;
+  victim->last = now;
+  return victim;
+}
+
+/*
+Take a token for peer `key` at time `now`. Returns 0 if it's over its limit.
+*/
+int bproto_rate_admit(bproto_rate_t *rate, const uint8_t *key, uint32_t now) {
+  bproto_rate_bucket_t *bucket = bproto_rate_lookup(rate, key, now);
+  uint32_t full = rate->burst * BPROTO_RATE_SCALE;
+
+  // Refill for the time since the last request, capping elapsed time so the
+  // product can't overflow once the bucket would be full anyway
+  uint32_t elapsed = BPROTO_RATE_MIN(now - bucket->last, full / rate->per_sec + 1);
+  bucket->tokens = BPROTO_RATE_MIN(bucket->tokens + elapsed * rate->per_sec, full);
+  bucket->last = now;
+
+  if (bucket->tokens < BPROTO_RATE_SCALE) {
+    return 0;
+  }
+  bucket->tokens -= BPROTO_RATE_SCALE;
+  return 1;
+}
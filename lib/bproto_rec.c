@@ -0,0 +1,212 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bproto.h"
+#include "bproto_rec.h"
+
+#if BPROTO_CHANNEL_COUNT > 4
+#error "recordings hold at most four channels"
+#endif
+
+void bproto_rec_frame_pack(bproto_rec_frame_t *f, uint32_t at, bproto_t *b) {
+  bproto_value_t vals[4] = {
+    BPROTO_VALUE_UNSET, BPROTO_VALUE_UNSET, BPROTO_VALUE_UNSET, BPROTO_VALUE_UNSET,
+  };
+  bproto_channels(b, vals);
+  memset(f, 0, sizeof(*f));
+  f->at = at;
+
+  for (int i = 0; i < 4; i++) {
+    if (vals[i] != BPROTO_VALUE_UNSET) {
+      f->value[i] = vals[i];
+      f->mask |= 1 << i;
+    }
+  }
+
+  if (b->time != BPROTO_TIME_UNSET) {
+    f->time = b->time;
+    f->mask |= BPROTO_REC_TIME;
+  }
+
+  if (b->ease != BPROTO_EASE_UNSET) {
+    f->ease = b->ease;
+    f->mask |= BPROTO_REC_EASE;
+  }
+}
+
+void bproto_rec_frame_unpack(const bproto_rec_frame_t *f, bproto_t *b) {
+  bproto_value_t vals[4];
+  for (int i = 0; i < 4; i++) {
+    vals[i] = f->mask & (1 << i) ? f->value[i] : BPROTO_VALUE_UNSET;
+  }
+  bproto_set_channels(b, vals);
+  b->time  = f->mask & BPROTO_REC_TIME  ? (bproto_time_t)f->time : BPROTO_TIME_UNSET;
+  b->ease  = f->mask & BPROTO_REC_EASE  ? f->ease : BPROTO_EASE_UNSET;
+}
+
+/*
+All functions returning int give 0 on success and -1 with errno set on error.
+*/
+int bproto_rec_writer_open(bproto_rec_writer_t *w, const char *path) {
+  memset(w, 0, sizeof(*w));
+  w->file = fopen(path, "wb");
+  if (w->file == NULL) {
+    return -1;
+  }
+
+  // Reserve space for the header, written on close
+  bproto_rec_header_t header;
+  memset(&header, 0, sizeof(header));
+  if (fwrite(&header, sizeof(header), 1, w->file) != 1) {
+    fclose(w->file);
+    return -1;
+  }
+  return 0;
+}
+
+static int bproto_rec_writer_index(bproto_rec_writer_t *w, uint64_t frame) {
+  if (w->index_len == w->index_cap) {
+    uint32_t cap = w->index_cap ? w->index_cap * 2 : 64;
+    uint64_t *index = realloc(w->index, cap * sizeof(uint64_t));
+    if (index == NULL) {
+      return -1;
+    }
+    w->index = index;
+    w->index_cap = cap;
+  }
+  w->index[w->index_len++] = frame;
+  return 0;
+}
+
+/*
+Frames must be added in time order.
+*/
+int bproto_rec_writer_add(bproto_rec_writer_t *w, uint32_t at, bproto_t *b) {
+  if (at < w->last_at) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // Index entry i is the first frame at or after i * interval
+  while ((uint64_t)w->index_len * BPROTO_REC_INTERVAL <= at) {
+    if (bproto_rec_writer_index(w, w->frame_count) < 0) {
+      return -1;
+    }
+  }
+
+  bproto_rec_frame_t f;
+  bproto_rec_frame_pack(&f, at, b);
+  if (fwrite(&f, sizeof(f), 1, w->file) != 1) {
+    return -1;
+  }
+  w->frame_count++;
+  w->last_at = at;
+  return 0;
+}
+
+int bproto_rec_writer_close(bproto_rec_writer_t *w) {
+  bproto_rec_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BPROTO_REC_MAGIC, sizeof(header.magic));
+  header.version = BPROTO_REC_VERSION;
+  header.frame_size = sizeof(bproto_rec_frame_t);
+  header.interval = BPROTO_REC_INTERVAL;
+  header.byte_order = BPROTO_REC_BYTE_ORDER;
+  header.index_len = w->index_len;
+  header.frame_count = w->frame_count;
+  header.index_offset = sizeof(header) + w->frame_count * sizeof(bproto_rec_frame_t);
+
+  int res = 0;
+  if (w->index_len > 0 &&
+      fwrite(w->index, sizeof(uint64_t), w->index_len, w->file) != w->index_len) {
+    res = -1;
+  }
+  if (res == 0 && (fseek(w->file, 0, SEEK_SET) != 0 ||
+		   fwrite(&header, sizeof(header), 1, w->file) != 1)) {
+    res = -1;
+  }
+  if (fclose(w->file) != 0) {
+    res = -1;
+  }
+  free(w->index);
+  w->index = NULL;
+  return res;
+}
+
+int bproto_rec_open(bproto_rec_t *rec, const char *path) {
+  memset(rec, 0, sizeof(*rec));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+  if ((size_t)st.st_size < sizeof(bproto_rec_header_t)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  rec->map_len = st.st_size;
+  rec->map = mmap(NULL, rec->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (rec->map == MAP_FAILED) {
+    rec->map = NULL;
+    return -1;
+  }
+
+  // Bound the counts by the file size before multiplying, so that a
+  // crafted header cannot wrap the offsets back into range
+  const bproto_rec_header_t *h = rec->map;
+  if (memcmp(h->magic, BPROTO_REC_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != BPROTO_REC_VERSION ||
+      h->byte_order != BPROTO_REC_BYTE_ORDER ||
+      h->frame_size != sizeof(bproto_rec_frame_t) ||
+      h->interval == 0 ||
+      h->frame_count > (rec->map_len - sizeof(*h)) / sizeof(bproto_rec_frame_t) ||
+      h->index_offset != sizeof(*h) + h->frame_count * sizeof(bproto_rec_frame_t) ||
+      h->index_len > (rec->map_len - h->index_offset) / sizeof(uint64_t)) {
+    bproto_rec_close(rec);
+    errno = EINVAL;
+    return -1;
+  }
+
+  rec->header = h;
+  rec->frames = (const bproto_rec_frame_t *)((const char *)rec->map + sizeof(*h));
+  rec->index = (const uint64_t *)((const char *)rec->map + h->index_offset);
+  rec->frame_count = h->frame_count;
+  return 0;
+}
+
+void bproto_rec_close(bproto_rec_t *rec) {
+  if (rec->map != NULL) {
+    munmap(rec->map, rec->map_len);
+  }
+  memset(rec, 0, sizeof(*rec));
+}
+
+/*
+The number of frames at or before `at`: frames[n-1] is the latest frame at
+that time, and replay from `at` continues with frames[n].
+*/
+size_t bproto_rec_seek(const bproto_rec_t *rec, uint32_t at) {
+  uint64_t i = at / rec->header->interval;
+  if (i >= rec->header->index_len) {
+    return rec->frame_count;
+  }
+
+  size_t n = MIN(rec->index[i], rec->frame_count);
+  while (n < rec->frame_count && rec->frames[n].at <= at) {
+    n++;
+  }
+  return n;
+}
@@ -0,0 +1,16 @@
+#include "bproto_stream.h"
+
+/*
+Whether frame `seq`, arriving at `now` (ms, may wrap), is newer than the
+last one accepted.
+*/
+int bproto_stream_accept(bproto_stream_t *s, uint32_t seq, uint32_t now) {
+  if (s->seen && now - s->last < BPROTO_STREAM_TIMEOUT && (int32_t)(seq - s->seq) <= 0) {
+    s->dropped++;
+    return 0;
+  }
+  s->seq = seq;
+  s->last = now;
+  s->seen = 1;
+  return 1;
+}
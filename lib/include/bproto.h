@@ -13,21 +13,61 @@ typedef int32_t bproto_time_t;
 #define BPROTO_TIME_T_MAX (2147483647)
 #define BPROTO_TIME_UNSET (-1)
 
+/*
+Easing curve of a fade. Fades are linear unless a curve is given.
+*/
+typedef enum {
+  BPROTO_EASE_LINEAR,
+  BPROTO_EASE_IN,     // quadratic, slow start
+  BPROTO_EASE_OUT,    // quadratic, slow end
+  BPROTO_EASE_SINE,   // sinusoidal, slow start and end
+  BPROTO_EASES,
+} bproto_ease_t;
+#define BPROTO_EASE_T_MIN (BPROTO_EASE_LINEAR)
+#define BPROTO_EASE_T_MAX (BPROTO_EASES - 1)
+#define BPROTO_EASE_UNSET (-1)
+
 typedef uint8_t bproto_digit_t;
 
 #define BPROTO_BUF_LEN_INT 16
 
+/*
+The channels of a message, in wire and struct order, as X(member, NAME,
+letter). bproto_t, the field letters and every per-channel step of parse,
+print, copy, compare and diff are expanded from this list, as are the python
+keys and the firmware's channel table, so adding a channel (amber, UV) is
+one line here. Builds for RGB strips define BPROTO_RGB to leave white out
+altogether; their parser rejects 'W'.
+*/
+#if BPROTO_RGB
+#define BPROTO_CHANNEL_TABLE_WHITE(X)
+#else
+#define BPROTO_CHANNEL_TABLE_WHITE(X) X(white, WHITE, 'W')
+#endif
+
+#define BPROTO_CHANNEL_TABLE(X)			\
+  X(red,   RED,   'R')				\
+  X(green, GREEN, 'G')				\
+  X(blue,  BLUE,  'B')				\
+  BPROTO_CHANNEL_TABLE_WHITE(X)
+
+// Number of channels, usable in #if
+#define BPROTO_CHANNEL_ONE(m, NAME, l) + 1
+#define BPROTO_CHANNEL_COUNT (0 BPROTO_CHANNEL_TABLE(BPROTO_CHANNEL_ONE))
+
+#define BPROTO_CHANNEL_MEMBER(m, NAME, l) bproto_value_t m;
+#define BPROTO_CHANNEL_FIELD(m, NAME, l) BPROTO_FIELD_##NAME = l,
+
 typedef struct {
-  bproto_value_t red, green, blue, white;
+  BPROTO_CHANNEL_TABLE(BPROTO_CHANNEL_MEMBER)
   bproto_time_t time;
+  bproto_value_t ease;
 } bproto_t;
 
 typedef enum {
-  BPROTO_FIELD_RED = 'R',
-  BPROTO_FIELD_GREEN = 'G',
-  BPROTO_FIELD_BLUE = 'B',
-  BPROTO_FIELD_WHITE = 'W',
+  BPROTO_CHANNEL_TABLE(BPROTO_CHANNEL_FIELD)
   BPROTO_FIELD_TIME = 'T',
+  BPROTO_FIELD_EASE = 'E',
 } bproto_field_t;
 
 void bproto_init(bproto_t*);
@@ -38,8 +78,58 @@ int bproto_eq(bproto_t*, bproto_t*);
 
 int bproto_is_set(bproto_t*);
 
+void bproto_channels(const bproto_t*, bproto_value_t*);
+
+void bproto_set_channels(bproto_t*, const bproto_value_t*);
+
+int bproto_diff(const bproto_t*, const bproto_t*, bproto_t*);
+
+size_t bproto_diff_batch(const bproto_t*, const bproto_t*, bproto_t*, size_t);
+
 char *bproto_parse(bproto_t*, const char*);
 
+char *bproto_parse_n(bproto_t*, const char*, size_t);
+
+int bproto_validate(const char*);
+
+int bproto_validate_n(const char*, size_t);
+
 int bproto_snprint(char**, size_t, bproto_t*);
 
+/*
+Incremental parser for a stream of messages separated by newlines.
+
+Bytes may be fed in chunks of any size. Each completed message is passed to
+the callback; malformed messages are counted and skipped up to the next
+delimiter. Memory use is constant: no part of the input is buffered.
+*/
+typedef void (*bproto_parser_cb_t)(bproto_t*, void*);
+
+typedef enum {
+  BPROTO_PARSER_START,   // at the start of a message
+  BPROTO_PARSER_VALUE,   // after a field, expecting its first digit
+  BPROTO_PARSER_DIGITS,  // inside a value
+  BPROTO_PARSER_DISCARD, // skipping a malformed message
+  BPROTO_PARSER_END,     // message complete
+  BPROTO_PARSER_STATES,
+} bproto_parser_state_t;
+
+typedef struct {
+  bproto_parser_state_t state;
+  bproto_field_t field;
+  bproto_time_t acc;
+  bproto_t msg;
+  bproto_parser_cb_t cb;
+  void *ctx;
+  unsigned long errors;
+} bproto_parser_t;
+
+void bproto_parser_init(bproto_parser_t*, bproto_parser_cb_t, void*);
+
+void bproto_parser_reset(bproto_parser_t*);
+
+size_t bproto_parser_feed(bproto_parser_t*, const char*, size_t);
+
+int bproto_parser_finish(bproto_parser_t*);
+
 
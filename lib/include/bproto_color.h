@@ -0,0 +1,33 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "bproto.h"
+
+// Hue as a fraction of a full turn: 0 is red, 21845 green, 43690 blue.
+typedef uint16_t bproto_hue_t;
+#define BPROTO_HUE_TURN (65536)
+
+// Colour temperature in kelvin.
+typedef uint16_t bproto_kelvin_t;
+#define BPROTO_KELVIN_MIN (1000)
+#define BPROTO_KELVIN_MAX (12000)
+
+// How to drive the white channel when converting a colour.
+typedef enum {
+  BPROTO_WHITE_NONE,    // RGB only, white is 0
+  BPROTO_WHITE_EXTRACT, // move the common part of R, G and B to white
+} bproto_white_t;
+
+void bproto_rgb_to_rgbw(bproto_t*);
+
+void bproto_hsv(bproto_t*, bproto_hue_t, uint8_t, uint8_t, bproto_white_t);
+
+void bproto_kelvin(bproto_t*, bproto_kelvin_t, uint8_t, bproto_white_t);
+
+/*
+Batch forms write one message per input. The loops are branch-free integer
+arithmetic so the compiler can vectorize them.
+*/
+void bproto_hsv_batch(bproto_t*, const bproto_hue_t*, const uint8_t*, const uint8_t*, size_t, bproto_white_t);
+
+void bproto_kelvin_batch(bproto_t*, const bproto_kelvin_t*, const uint8_t*, size_t, bproto_white_t);
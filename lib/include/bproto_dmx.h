@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+
+/*
+DMX over IP receivers: Art-Net (ArtDmx) and E1.31 (sACN) data packets, and
+the E1.31 rule for dropping out of order frames. Packets come straight off
+the network, so every length and offset is checked against the packet.
+*/
+#define BPROTO_DMX_ARTNET_PORT (6454)
+#define BPROTO_DMX_E131_PORT (5568)
+#define BPROTO_DMX_BUF_LEN (640) // Largest E1.31 data packet is 638 bytes
+#define BPROTO_DMX_TIMEOUT (2500) // ms, E1.31 data loss timeout
+
+// Sequence numbers seen from one source
+typedef struct {
+  uint8_t seq;
+  uint32_t last; // ms
+  int seen;
+} bproto_dmx_seq_t;
+
+typedef int (*bproto_dmx_parse_t)(const uint8_t*, int, uint16_t, const uint8_t**, uint8_t*);
+
+int bproto_dmx_artnet_parse(const uint8_t*, int, uint16_t, const uint8_t**, uint8_t*);
+
+int bproto_dmx_e131_parse(const uint8_t*, int, uint16_t, const uint8_t**, uint8_t*);
+
+int bproto_dmx_seq_accept(bproto_dmx_seq_t*, uint8_t, uint32_t);
@@ -0,0 +1,13 @@
+#pragma once
+#include <stdint.h>
+#include "bproto.h"
+
+// Fade progress as a fraction of the whole: 0 is the start, BPROTO_EASE_ONE the end.
+typedef uint16_t bproto_progress_t;
+#define BPROTO_EASE_ONE (65535)
+
+/*
+Eased progress at linear progress `t`. Integer only, so it is safe in
+interrupt handlers on targets where the FPU isn't.
+*/
+bproto_progress_t bproto_ease(bproto_ease_t, bproto_progress_t);
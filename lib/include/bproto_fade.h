@@ -0,0 +1,77 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "bproto.h"
+#include "bproto_ease.h"
+
+/*
+Fixed-point model of how a device fades its channels, shared by the
+firmware, which programs the LEDC hardware from it, and host previews, which
+sample it. Durations are in milliseconds, positions in PWM cycles.
+*/
+
+#define BPROTO_FADE_CHANNELS BPROTO_CHANNEL_COUNT // in bproto field order
+
+// What a device fades with. Must match the firmware's configuration.
+typedef struct {
+  uint32_t pwm_hz;         // PWM frequency
+  uint32_t max_duty;       // duty of a channel at 255
+  uint16_t num_max;        // largest LEDC step count, cycle count or scale
+  uint8_t segments;        // linear segments per eased fade
+  uint16_t segment_min_ms; // shortest segment of an eased fade
+} bproto_fade_cfg_t;
+
+// Defaults of the firmware: 5kHz, 10-bit duty, 16 segments of 20ms or more.
+#define BPROTO_FADE_CFG_DEFAULT ((bproto_fade_cfg_t) {	\
+      .pwm_hz = 5000,					\
+      .max_duty = 1023,					\
+      .num_max = 1023,					\
+      .segments = 16,					\
+      .segment_min_ms = 20,				\
+    })
+
+// A linear hardware fade: from `start`, `scale` is added (or taken) every
+// `cycles` PWM cycles, `steps` times.
+typedef struct {
+  uint32_t start;
+  int8_t dir;     // +1 or -1
+  uint16_t steps, cycles, scale;
+} bproto_ramp_t;
+
+// One channel's transition to a new value, as a chain of `segs` ramps
+// (one for linear fades) along the `ease` curve.
+typedef struct {
+  uint32_t from, to;  // duty at the start and end of the whole fade
+  bproto_time_t time; // length of the whole fade (ms)
+  bproto_ease_t ease;
+  uint8_t segs;
+} bproto_fade_t;
+
+// A message applied at `at` ms.
+typedef struct {
+  uint32_t at;
+  bproto_t msg;
+} bproto_keyframe_t;
+
+uint32_t bproto_fade_duty(const bproto_fade_cfg_t*, bproto_value_t);
+
+void bproto_ramp_plan(bproto_ramp_t*, const bproto_fade_cfg_t*, uint32_t, uint32_t, bproto_time_t);
+
+uint32_t bproto_ramp_sample(const bproto_ramp_t*, uint64_t);
+
+void bproto_fade_plan(bproto_fade_t*, const bproto_fade_cfg_t*, uint32_t, bproto_value_t,
+		      bproto_time_t, bproto_value_t);
+
+uint32_t bproto_fade_seg_duty(const bproto_fade_t*, int);
+
+void bproto_fade_seg_ramp(bproto_ramp_t*, const bproto_fade_cfg_t*, const bproto_fade_t*, int);
+
+uint32_t bproto_fade_sample(const bproto_fade_t*, const bproto_fade_cfg_t*, uint32_t);
+
+uint32_t bproto_fade_length(const bproto_fade_t*, const bproto_fade_cfg_t*);
+
+void bproto_fade_sample_batch(const bproto_fade_t*, size_t, const uint32_t*, size_t,
+			      const bproto_fade_cfg_t*, uint32_t*);
+
+size_t bproto_fade_render(const bproto_keyframe_t*, size_t, const uint32_t*, size_t,
+			  const bproto_fade_cfg_t*, uint32_t (*)[BPROTO_FADE_CHANNELS]);
@@ -1,5 +1,23 @@
 #include "bproto.h"
 
+/*
+Character classes of the wire format. The grammar is a DFA over these, with
+bproto_parser_state_t as its states.
+*/
+typedef enum {
+  BPROTO_CC_OTHER,
+  BPROTO_CC_DIGIT,
+  BPROTO_CC_CHANNEL,
+  BPROTO_CC_TIME,
+  BPROTO_CC_EASE,
+  BPROTO_CC_END,
+  BPROTO_CC_CLASSES,
+} bproto_cclass_t;
+
+extern const uint8_t bproto_cclass[256];
+
+extern const uint8_t bproto_dfa[BPROTO_PARSER_STATES][BPROTO_CC_CLASSES];
+
 char *bproto_field_parse(bproto_field_t*, const char*);
 
 int bproto_field_snprint(char**, size_t, bproto_field_t);
@@ -12,6 +30,12 @@ char *bproto_time_parse(bproto_time_t*, const char*);
 
 int bproto_time_snprint(char**, size_t, bproto_time_t);
 
+int bproto_ease_snprint(char**, size_t, bproto_value_t);
+
 int bproto_int_snprint(char**, size_t, int);
 
 char *bproto_digit_parse(bproto_digit_t*, const char*);
+
+int bproto_field_set(bproto_t*, bproto_field_t, bproto_time_t);
+
+int bproto_is_delim(char);
@@ -0,0 +1,32 @@
+#pragma once
+#include <stdint.h>
+#include "bproto.h"
+
+/*
+Applying a message to a set of PWM channels: every changed channel is
+programmed first, then all of them are started back to back, so fades on
+different channels stay in step. The hardware is reached through hooks, so
+the same sequence runs on the device and in host tests. Channels are in
+bproto field order and bit n of a mask is channel n.
+*/
+typedef uint32_t bproto_ledc_mask_t;
+
+typedef struct {
+  int (*program)(int, void*); // Load channel n's next fade without starting it
+  int (*start)(int, void*);   // Start channel n's programmed fade
+  void (*lock)(void*);        // Around the starts, e.g. a critical section
+  void (*unlock)(void*);
+  uint32_t (*clock)(void*);   // Free-running cycle counter
+} bproto_ledc_ops_t;
+
+typedef struct {
+  const bproto_ledc_ops_t *ops;
+  uint32_t skew;     // Cycles between the first and last start of the last update
+  uint32_t skew_max;
+} bproto_ledc_t;
+
+void bproto_ledc_init(bproto_ledc_t*, const bproto_ledc_ops_t*);
+
+bproto_ledc_mask_t bproto_ledc_dirty(const bproto_t*, const bproto_t*);
+
+int bproto_ledc_update(bproto_ledc_t*, bproto_ledc_mask_t, void*);
@@ -0,0 +1,68 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "bproto.h"
+
+/*
+A single-threaded event loop: readable descriptors multiplexed with select()
+and timers on a hashed wheel, so one task can serve every input of a device
+without a stack per input. Nothing is allocated; timers are embedded in
+their owners. Times are in ms on the loop's clock and may wrap.
+*/
+#define BPROTO_LOOP_FDS (8)     // descriptors watched at once
+#define BPROTO_LOOP_SLOTS (64)  // timer wheel slots
+#define BPROTO_LOOP_TICK (8)    // ms per timer wheel slot
+// Both powers of two, so the wheel turns evenly through clock wraps
+#define BPROTO_LOOP_CHUNK (128) // bytes read per parser feed
+
+typedef struct bproto_timer bproto_timer_t;
+
+typedef void (*bproto_loop_io_cb_t)(int, void*);
+typedef void (*bproto_timer_cb_t)(bproto_timer_t*, void*);
+typedef uint32_t (*bproto_loop_clock_t)(void);
+
+struct bproto_timer {
+  bproto_timer_t *next, **pprev; // pprev is NULL while not armed
+  uint32_t due;
+  bproto_timer_cb_t cb;
+  void *ctx;
+};
+
+typedef struct {
+  int fd;
+  bproto_loop_io_cb_t cb;
+  void *ctx;
+} bproto_loop_io_t;
+
+typedef struct {
+  bproto_loop_io_t io[BPROTO_LOOP_FDS];
+  size_t nio;
+  bproto_timer_t *wheel[BPROTO_LOOP_SLOTS];
+  uint32_t now;                // time timers have been run up to
+  bproto_loop_clock_t clock;
+  int stopped;
+} bproto_loop_t;
+
+uint32_t bproto_loop_clock(void);
+
+void bproto_loop_init(bproto_loop_t*, bproto_loop_clock_t);
+
+int bproto_loop_watch(bproto_loop_t*, int, bproto_loop_io_cb_t, void*);
+
+int bproto_loop_unwatch(bproto_loop_t*, int);
+
+int bproto_loop_run_once(bproto_loop_t*, int);
+
+int bproto_loop_run(bproto_loop_t*);
+
+void bproto_loop_stop(bproto_loop_t*);
+
+void bproto_timer_init(bproto_timer_t*, bproto_timer_cb_t, void*);
+
+void bproto_timer_start(bproto_loop_t*, bproto_timer_t*, uint32_t);
+
+void bproto_timer_stop(bproto_timer_t*);
+
+int bproto_timer_armed(const bproto_timer_t*);
+
+int bproto_loop_feed(int, bproto_parser_t*);
@@ -0,0 +1,65 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "bproto.h"
+
+/*
+Compact form of bproto_t: 8-bit channels in one word, a 32-bit time and a
+bitmask of which fields are set, so copy, equality and is-set are a few
+mask operations instead of a compare-and-branch per field. Unset fields are
+always zero. The easing curve fits in what would otherwise be padding.
+*/
+#define BPROTO_MASK_RED   (1 << 0)
+#define BPROTO_MASK_GREEN (1 << 1)
+#define BPROTO_MASK_BLUE  (1 << 2)
+#define BPROTO_MASK_WHITE (1 << 3)
+#define BPROTO_MASK_TIME  (1 << 4)
+#define BPROTO_MASK_EASE  (1 << 5)
+#define BPROTO_MASK_CHANNELS (0x0f)
+
+#define BPROTO_CHANNELS BPROTO_CHANNEL_COUNT
+#if BPROTO_CHANNELS > 4
+#error "bproto_packed_t holds at most four channels"
+#endif
+
+typedef struct {
+  uint32_t channels; // byte n is channel n (R,G,B,W)
+  uint32_t time;
+  uint8_t mask;
+  uint8_t ease;
+} bproto_packed_t;
+
+void bproto_pack(bproto_packed_t*, const bproto_t*);
+
+void bproto_unpack(bproto_t*, const bproto_packed_t*);
+
+void bproto_packed_copy(const bproto_packed_t*, bproto_packed_t*);
+
+int bproto_packed_eq(const bproto_packed_t*, const bproto_packed_t*);
+
+int bproto_packed_is_set(const bproto_packed_t*);
+
+/*
+Structure-of-arrays container for many messages, one array per field.
+Bulk operations run over `len` entries as straight-line loops the compiler
+can vectorize.
+*/
+typedef struct {
+  size_t len, cap;
+  uint8_t *channel[BPROTO_CHANNELS];
+  uint32_t *time;
+  uint8_t *ease;
+  uint8_t *mask;
+} bproto_batch_t;
+
+int bproto_batch_init(bproto_batch_t*, size_t);
+
+void bproto_batch_free(bproto_batch_t*);
+
+size_t bproto_batch_load(bproto_batch_t*, const bproto_t*, size_t);
+
+void bproto_batch_store(const bproto_batch_t*, bproto_t*);
+
+void bproto_batch_copy(const bproto_batch_t*, bproto_batch_t*);
+
+size_t bproto_batch_eq(const bproto_batch_t*, const bproto_batch_t*, uint8_t*);
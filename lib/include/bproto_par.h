@@ -0,0 +1,26 @@
+#pragma once
+#include <stddef.h>
+#include "bproto.h"
+
+/*
+Bulk parsing of newline-separated messages (e.g. show logs).
+
+Messages are written to `out` in input order; empty lines are skipped. On a
+parse error, `error` is set to the 0-based number of the first malformed
+line, regardless of how work was split between threads.
+*/
+typedef enum {
+  BPROTO_PAR_OK = 0,
+  BPROTO_PAR_EPARSE,  // a line is malformed
+  BPROTO_PAR_ENOSPC,  // more messages than `out` can hold
+  BPROTO_PAR_ENOMEM,  // couldn't allocate work queue
+} bproto_par_status_t;
+
+typedef struct {
+  size_t count; // messages written to `out` (before the error, if any)
+  size_t error; // first malformed line, if BPROTO_PAR_EPARSE
+} bproto_par_result_t;
+
+bproto_par_status_t bproto_parse_lines(bproto_t*, size_t, const char*, size_t, bproto_par_result_t*);
+
+bproto_par_status_t bproto_parse_lines_parallel(bproto_t*, size_t, const char*, size_t, int, bproto_par_result_t*);
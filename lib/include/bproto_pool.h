@@ -0,0 +1,37 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Fixed-size block pools. Each pool hands out blocks of one size from an
+arena the caller provides, through a free list threaded through the free
+blocks. Allocation never touches the heap: when a pool is empty it returns
+NULL and counts the miss, and the caller falls back to its own allocator.
+Pools do no locking; callers serialise access to a pool themselves.
+*/
+#define BPROTO_POOL_ALIGN(x) (((x) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+typedef struct bproto_pool_block {
+  struct bproto_pool_block *next;
+} bproto_pool_block_t;
+
+typedef struct {
+  const char *name;
+  size_t size;               // Block size (bytes), a multiple of BPROTO_POOL_ALIGN
+  size_t count;              // Number of blocks
+  uint8_t *arena;            // count * size bytes, pointer-aligned
+  bproto_pool_block_t *free; // Free list
+  size_t used;               // Blocks currently allocated
+  size_t high_water;         // Most blocks ever allocated at once
+  uint32_t exhausted;        // Allocations refused while the pool was empty
+} bproto_pool_t;
+
+void bproto_pool_init(bproto_pool_t*);
+
+void *bproto_pool_alloc(bproto_pool_t*);
+
+void bproto_pool_free(bproto_pool_t*, void*);
+
+bproto_pool_t *bproto_pool_fit(bproto_pool_t*, size_t, size_t);
+
+bproto_pool_t *bproto_pool_find(bproto_pool_t*, size_t, const void*);
@@ -0,0 +1,34 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Per-peer token buckets, so one chatty client can't starve the others.
+Buckets live in a small open-addressed table keyed by peer address; when a
+probe finds no free slot the least recently seen peer is evicted. Tokens
+are kept in thousandths so refills don't round away at high rates. Times
+are in ms and may wrap.
+*/
+#define BPROTO_RATE_KEY_LEN (16) // Peer address (IPv4 uses the first 4 bytes)
+#define BPROTO_RATE_PROBE (4)    // Slots probed per lookup
+#define BPROTO_RATE_SCALE (1000) // Token fractions
+
+typedef struct {
+  uint8_t key[BPROTO_RATE_KEY_LEN];
+  int used;
+  uint32_t tokens; // Available tokens * BPROTO_RATE_SCALE
+  uint32_t last;   // Time of the last refill
+} bproto_rate_bucket_t;
+
+typedef struct {
+  bproto_rate_bucket_t *buckets;
+  size_t len;
+  uint32_t per_sec; // Sustained requests per second per peer, at least 1
+  uint32_t burst;   // Requests a peer may send back to back
+} bproto_rate_t;
+
+void bproto_rate_init(bproto_rate_t*, bproto_rate_bucket_t*, size_t, uint32_t, uint32_t);
+
+bproto_rate_bucket_t *bproto_rate_lookup(bproto_rate_t*, const uint8_t*, uint32_t);
+
+int bproto_rate_admit(bproto_rate_t*, const uint8_t*, uint32_t);
@@ -0,0 +1,81 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "bproto.h"
+
+/*
+Recordings of timestamped bproto messages.
+
+A recording is a header, an array of fixed-size frames in time order and a
+sparse index giving the first frame of every BPROTO_REC_INTERVAL ms. Seeking
+reads one index entry and scans at most one interval of frames. Fields are
+in the writer's byte order, so readers can map the file and use the frames
+in place; byte_order tells readers on a host of the other order to refuse it.
+*/
+#define BPROTO_REC_MAGIC "BPREC\0\0"
+#define BPROTO_REC_VERSION (2)
+#define BPROTO_REC_INTERVAL (1000)
+#define BPROTO_REC_BYTE_ORDER (0x01020304)
+
+// bproto_rec_frame_t.mask bits, in field order. Recordings always have room
+// for four channels; builds with fewer leave the rest unset.
+#define BPROTO_REC_RED   (1 << 0)
+#define BPROTO_REC_GREEN (1 << 1)
+#define BPROTO_REC_BLUE  (1 << 2)
+#define BPROTO_REC_WHITE (1 << 3)
+#define BPROTO_REC_TIME  (1 << 4)
+#define BPROTO_REC_EASE  (1 << 5)
+
+typedef struct {
+  char magic[7];
+  uint8_t version;
+  uint32_t frame_size;
+  uint32_t interval;
+  uint32_t index_len;
+  uint32_t byte_order; // BPROTO_REC_BYTE_ORDER as written by the host
+  uint64_t frame_count;
+  uint64_t index_offset;
+} bproto_rec_header_t;
+
+typedef struct {
+  uint32_t at;       // ms since the start of the recording
+  uint32_t time;     // fade time, if BPROTO_REC_TIME is set
+  uint8_t value[4];  // R,G,B,W
+  uint8_t mask;
+  uint8_t ease;      // easing curve, if BPROTO_REC_EASE is set
+  uint8_t reserved[2];
+} bproto_rec_frame_t;
+
+typedef struct {
+  FILE *file;
+  uint64_t frame_count;
+  uint64_t *index;
+  uint32_t index_len, index_cap;
+  uint32_t last_at;
+} bproto_rec_writer_t;
+
+typedef struct {
+  void *map;
+  size_t map_len;
+  const bproto_rec_header_t *header;
+  const bproto_rec_frame_t *frames;
+  const uint64_t *index;
+  size_t frame_count;
+} bproto_rec_t;
+
+void bproto_rec_frame_pack(bproto_rec_frame_t*, uint32_t, bproto_t*);
+
+void bproto_rec_frame_unpack(const bproto_rec_frame_t*, bproto_t*);
+
+int bproto_rec_writer_open(bproto_rec_writer_t*, const char*);
+
+int bproto_rec_writer_add(bproto_rec_writer_t*, uint32_t, bproto_t*);
+
+int bproto_rec_writer_close(bproto_rec_writer_t*);
+
+int bproto_rec_open(bproto_rec_t*, const char*);
+
+void bproto_rec_close(bproto_rec_t*);
+
+size_t bproto_rec_seek(const bproto_rec_t*, uint32_t);
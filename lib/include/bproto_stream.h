@@ -0,0 +1,20 @@
+#pragma once
+#include <stdint.h>
+
+/*
+Sequenced realtime frames, one stream at a time. A frame that isn't newer
+than the last one accepted is dropped, so a late frame never overwrites a
+newer one. Sequence numbers use serial number arithmetic and may wrap. After
+BPROTO_STREAM_TIMEOUT of silence the sequence restarts anywhere, so a
+restarted sender isn't locked out.
+*/
+#define BPROTO_STREAM_TIMEOUT (2500) // ms
+
+typedef struct {
+  uint32_t seq;      // Last accepted
+  uint32_t last;     // ms, when it was accepted
+  int seen;
+  unsigned dropped;  // Frames dropped as stale or duplicate
+} bproto_stream_t;
+
+int bproto_stream_accept(bproto_stream_t*, uint32_t, uint32_t);
@@ -0,0 +1,9 @@
+"""Client for blinken LED strips.
+
+`discover()` finds devices on the local network with mDNS and `Fleet` sends
+them bproto messages over CoAP.
+"""
+from .discovery import Device, discover
+from .fleet import CoapError, Fleet
+
+__all__ = ['CoapError', 'Device', 'Fleet', 'discover']
@@ -0,0 +1,76 @@
+"""Minimal CoAP (RFC 7252) messages for talking to blinken devices.
+
+Framing is done in C by pybproto.
+"""
+from collections import namedtuple
+
+import pybproto
+
+VERSION = 1
+
+CON, NON, ACK, RST = 0, 1, 2, 3
+
+EMPTY = 0
+GET = 1
+POST = 2
+PUT = 3
+
+
+def code(cls, detail):
+    return (cls << 5) | detail
+
+
+VALID = code(2, 3)
+CHANGED = code(2, 4)
+CONTENT = code(2, 5)
+PRECONDITION_FAILED = code(4, 12)
+
+OPTION_IF_MATCH = 1
+OPTION_ETAG = 4
+OPTION_IF_NONE_MATCH = 5
+OPTION_URI_PATH = 11
+OPTION_CONTENT_FORMAT = 12
+OPTION_URI_QUERY = 15
+
+CONTENT_FORMAT_TEXT = 0
+
+DEFAULT_PORT = 5683
+ALL_NODES = '224.0.1.187'
+
+Message = namedtuple('Message', 'type code mid token options payload')
+Message.__new__.__defaults__ = (b'', (), b'')
+
+
+class DecodeError(ValueError):
+    pass
+
+
+def encode(msg):
+    """Serialise a Message. Options are (number, bytes) pairs."""
+    return pybproto.coap_encode(msg.type, msg.code, msg.mid, msg.token,
+                                msg.options, msg.payload)
+
+
+def decode(data):
+    """Parse a datagram into a Message."""
+    try:
+        return Message(*pybproto.coap_decode(data))
+    except pybproto.error as e:
+        raise DecodeError(str(e))
+
+
+def option(msg, number):
+    """Value of the first `number` option of `msg`, or None."""
+    for k, v in msg.options:
+        if k == number:
+            return v
+    return None
+
+
+def path_options(path):
+    """Uri-Path options for `path`, and Uri-Query options for any query."""
+    path, _, query = path.partition('?')
+    return (tuple((OPTION_URI_PATH, seg.encode())
+                  for seg in path.strip('/').split('/') if seg) +
+            tuple((OPTION_URI_QUERY, arg.encode())
+                  for arg in query.split('&') if arg))
@@ -0,0 +1,136 @@
+"""One-shot mDNS (RFC 6762) discovery of `_blinken._udp` devices."""
+import asyncio
+import socket
+import struct
+from collections import namedtuple
+
+from . import coap
+
+SERVICE = '_blinken._udp.local'
+
+MDNS_ADDR = ('224.0.0.251', 5353)
+
+TYPE_A = 1
+TYPE_PTR = 12
+TYPE_TXT = 16
+TYPE_SRV = 33
+CLASS_IN = 1
+
+Device = namedtuple('Device', 'name host port txt')
+
+
+def _encode_name(name):
+    out = b''
+    for label in name.rstrip('.').split('.'):
+        out += bytes([len(label)]) + label.encode()
+    return out + b'\0'
+
+
+def _read_name(data, pos):
+    labels = []
+    end = None
+    for _ in range(128):
+        length = data[pos]
+        if length & 0xc0 == 0xc0:
+            if end is None:
+                end = pos + 2
+            pos = ((length & 0x3f) << 8) | data[pos + 1]
+        elif length == 0:
+            return '.'.join(labels), (end if end is not None else pos + 1)
+        else:
+            labels.append(data[pos + 1:pos + 1 + length].decode(errors='replace'))
+            pos += 1 + length
+    raise ValueError('name compression loop')
+
+
+def query(service=SERVICE):
+    """A PTR question for `service`."""
+    return (struct.pack('>HHHHHH', 0, 0, 1, 0, 0, 0) + _encode_name(service) +
+            struct.pack('>HH', TYPE_PTR, CLASS_IN))
+
+
+def parse_records(data):
+    """All resource records in a response as (name, type, rdata) tuples.
+
+    PTR rdata is the target name, SRV rdata is (port, target), A rdata is
+    the dotted address and TXT rdata is a dict.
+    """
+    _, flags, qd, an, ns, ar = struct.unpack_from('>HHHHHH', data)
+    pos = 12
+    for _ in range(qd):
+        _, pos = _read_name(data, pos)
+        pos += 4
+    records = []
+    for _ in range(an + ns + ar):
+        name, pos = _read_name(data, pos)
+        rtype, _, _, rdlen = struct.unpack_from('>HHIH', data, pos)
+        pos += 10
+        rdata = data[pos:pos + rdlen]
+        if rtype == TYPE_PTR:
+            value = _read_name(data, pos)[0]
+        elif rtype == TYPE_SRV:
+            value = (struct.unpack_from('>H', data, pos + 4)[0],
+                     _read_name(data, pos + 6)[0])
+        elif rtype == TYPE_A and rdlen == 4:
+            value = socket.inet_ntoa(rdata)
+        elif rtype == TYPE_TXT:
+            value = {}
+            i = 0
+            while i < len(rdata):
+                item = rdata[i + 1:i + 1 + rdata[i]].decode(errors='replace')
+                key, _, val = item.partition('=')
+                value[key] = val
+                i += 1 + rdata[i]
+        else:
+            value = rdata
+        records.append((name.lower(), rtype, value))
+        pos += rdlen
+    return records
+
+
+def resolve(records, service=SERVICE):
+    """Devices advertised in `records`."""
+    service = service.lower()
+    ptrs = [v for n, t, v in records if t == TYPE_PTR and n == service]
+    srvs = {n: v for n, t, v in records if t == TYPE_SRV}
+    txts = {n: v for n, t, v in records if t == TYPE_TXT}
+    addrs = {n: v for n, t, v in records if t == TYPE_A}
+    devices = []
+    for instance in ptrs:
+        port, target = srvs.get(instance.lower(), (coap.DEFAULT_PORT, None))
+        host = addrs.get((target or '').lower())
+        if host is not None:
+            devices.append(Device(instance, host, port,
+                                  txts.get(instance.lower(), {})))
+    return devices
+
+
+class _Collector(asyncio.DatagramProtocol):
+    def __init__(self):
+        self.records = []
+
+    def datagram_received(self, data, addr):
+        try:
+            self.records.extend(parse_records(data))
+        except (ValueError, IndexError, struct.error):
+            pass
+
+
+async def discover(timeout=1.0, service=SERVICE):
+    """Multicast one PTR query and collect answers for `timeout` seconds.
+
+    Queries are sent from an ephemeral port, so responders answer with
+    unicast legacy responses (RFC 6762 section 6.7).
+    """
+    loop = asyncio.get_running_loop()
+    transport, proto = await loop.create_datagram_endpoint(
+        _Collector, local_addr=('0.0.0.0', 0))
+    try:
+        transport.sendto(query(service), MDNS_ADDR)
+        await asyncio.sleep(timeout)
+    finally:
+        transport.close()
+    seen = {}
+    for device in resolve(proto.records, service):
+        seen[(device.host, device.port)] = device
+    return list(seen.values())
@@ -0,0 +1,338 @@
+"""asyncio CoAP client for driving many blinken devices from one socket."""
+import asyncio
+import itertools
+import random
+import time
+
+import pybproto
+
+from . import coap
+
+ACK_TIMEOUT = 2.0
+ACK_RANDOM_FACTOR = 1.5
+MAX_RETRANSMIT = 4
+NSTART = 1
+
+RESOURCE = 'led'
+SCENE_RESOURCE = 'scene'
+STREAM_RESOURCE = 'stream'
+
+
+class CoapError(Exception):
+    """A request failed: reset by the peer, timed out or got an error code."""
+
+    def __init__(self, message, response=None):
+        super().__init__(message)
+        self.response = response
+
+
+class _Exchange(object):
+    def __init__(self, addr, msg, future):
+        self.addr = addr
+        self.msg = msg
+        self.data = coap.encode(msg)
+        self.future = future
+        self.acked = msg.type != coap.CON
+        self.timer = None
+        self.retransmits = 0
+
+
+class _Protocol(asyncio.DatagramProtocol):
+    def __init__(self, fleet):
+        self.fleet = fleet
+
+    def datagram_received(self, data, addr):
+        self.fleet._received(data, addr)
+
+    def error_received(self, exc):
+        pass
+
+
+class Fleet(object):
+    """Pipelined CoAP requests to any number of devices over one UDP socket.
+
+    Requests are matched to responses by token (and ACKs by message ID), so
+    any number of devices can have requests outstanding at once. Each device
+    has at most `max_inflight` requests in flight (RFC 7252 NSTART); extra
+    requests wait their turn. Confirmable requests are retransmitted with
+    exponential back-off.
+
+    The fleet keeps a shadow of each device's LED state, from what it has
+    acknowledged, so `update` and `apply(..., diff=True)` can send only the
+    fields that change.
+
+        async with Fleet() as fleet:
+            await fleet.apply({dev: {'red': 255} for dev in devices})
+    """
+
+    def __init__(self, max_inflight=NSTART, ack_timeout=ACK_TIMEOUT,
+                 max_retransmit=MAX_RETRANSMIT, confirmable=True):
+        self.max_inflight = max_inflight
+        self.ack_timeout = ack_timeout
+        self.max_retransmit = max_retransmit
+        self.confirmable = confirmable
+        self.transport = None
+        self._mids = itertools.count(random.randrange(0x10000))
+        self._tokens = itertools.count(random.randrange(1 << 32))
+        self._by_token = {}
+        self._by_mid = {}
+        self._slots = {}
+        self._etags = {}
+        self._shadow = {}
+        self._stream_seq = 0
+
+    async def open(self, local_addr=('0.0.0.0', 0)):
+        loop = asyncio.get_running_loop()
+        self.transport, _ = await loop.create_datagram_endpoint(
+            lambda: _Protocol(self), local_addr=local_addr)
+        return self
+
+    def close(self):
+        for ex in list(self._by_token.values()):
+            self._finish(ex, exc=CoapError('client closed'))
+        if self.transport is not None:
+            self.transport.close()
+            self.transport = None
+
+    async def __aenter__(self):
+        return await self.open()
+
+    async def __aexit__(self, *exc):
+        self.close()
+
+    @staticmethod
+    def _addr(device):
+        if hasattr(device, 'host'):
+            return (device.host, device.port)
+        if isinstance(device, str):
+            return (device, coap.DEFAULT_PORT)
+        return tuple(device)
+
+    async def request(self, device, code, path=RESOURCE, payload=b'',
+                      options=(), confirmable=None):
+        """Send one request and wait for its response Message."""
+        addr = self._addr(device)
+        if confirmable is None:
+            confirmable = self.confirmable
+        slot = self._slots.get(addr)
+        if slot is None:
+            slot = self._slots[addr] = asyncio.Semaphore(self.max_inflight)
+
+        async with slot:
+            msg = coap.Message(coap.CON if confirmable else coap.NON, code,
+                               next(self._mids) & 0xffff,
+                               (next(self._tokens) & 0xffffffff).to_bytes(4, 'big'),
+                               coap.path_options(path) + tuple(options),
+                               payload)
+            future = asyncio.get_running_loop().create_future()
+            ex = _Exchange(addr, msg, future)
+            self._by_token[(addr, msg.token)] = ex
+            self._by_mid[(addr, msg.mid)] = ex
+            self._transmit(ex, self.ack_timeout *
+                           random.uniform(1.0, ACK_RANDOM_FACTOR))
+            return await future
+
+    async def put(self, device, state, confirmable=None, path=RESOURCE):
+        """Set a device's LEDs from a bproto dict or encoded payload."""
+        addr = self._addr(device)
+        fields = state if isinstance(state, dict) else None
+        if isinstance(state, dict):
+            state = pybproto.new(state)
+        if isinstance(state, str):
+            state = state.encode()
+        try:
+            res = await self.request(device, coap.PUT, path, payload=state,
+                                     options=((coap.OPTION_CONTENT_FORMAT, b''),),
+                                     confirmable=confirmable)
+            if res.code >> 5 != 2:
+                raise CoapError('PUT failed with %d.%02d' % (res.code >> 5, res.code & 0x1f), res)
+        except Exception:
+            if path == RESOURCE:
+                self._shadow.pop(addr, None)
+            raise
+        if path == RESOURCE:
+            if fields is None:
+                self._shadow.pop(addr, None)
+            else:
+                self._shadow.setdefault(addr, {}).update(fields)
+        return res
+
+    async def update(self, device, state, confirmable=None):
+        """PUT only the fields of `state` the device doesn't already have.
+
+        Returns None without sending anything if the device's shadow state
+        already matches.
+        """
+        delta = pybproto.diff(self._shadow.get(self._addr(device), {}), state)
+        if not delta:
+            return None
+        return await self.put(device, delta, confirmable)
+
+    async def store_scene(self, device, scene, state):
+        """Save a bproto dict or payload on a device as preset number `scene`."""
+        return await self.put(device, state, True, '%s/%d' % (SCENE_RESOURCE, scene))
+
+    async def recall(self, scene, devices=None):
+        """Switch devices to preset number `scene`.
+
+        With `devices`, POST to each and return {device: response or
+        exception}. Without, send one NON request to the All CoAP Nodes
+        multicast group and return at once; devices don't acknowledge it.
+        """
+        path = '%s/%d' % (SCENE_RESOURCE, scene)
+        if devices is None:
+            self._shadow.clear()
+            msg = coap.Message(coap.NON, coap.POST, next(self._mids) & 0xffff,
+                               b'', coap.path_options(path))
+            self.transport.sendto(coap.encode(msg),
+                                  (coap.ALL_NODES, coap.DEFAULT_PORT))
+            return None
+
+        async def post(device):
+            res = await self.request(device, coap.POST, path)
+            if res.code >> 5 != 2:
+                raise CoapError('POST failed with %d.%02d' % (res.code >> 5, res.code & 0x1f), res)
+            return res
+
+        devices = list(devices)
+        for device in devices:
+            self._shadow.pop(self._addr(device), None)
+        results = await asyncio.gather(*(post(d) for d in devices),
+                                       return_exceptions=True)
+        return dict(zip(devices, results))
+
+    def stream(self, frame):
+        """Send one realtime frame, {device: state}, without waiting.
+
+        Each state goes out as a non-confirmable PUT to /stream, numbered so
+        that devices drop frames which arrive after a newer one. Nothing is
+        acknowledged or retransmitted. Sequence numbers follow the clock in
+        milliseconds, so they keep increasing across restarts.
+        """
+        if self.transport is None:
+            return
+        now = int(time.time() * 1000) & 0xffffffff
+        if (now - self._stream_seq) & 0xffffffff >= 0x80000000 or now == self._stream_seq:
+            now = (self._stream_seq + 1) & 0xffffffff
+        self._stream_seq = now
+        path = '%s?s=%d' % (STREAM_RESOURCE, now)
+        for device, state in frame.items():
+            # Frames may be lost, so the device's state is unknown from here
+            self._shadow.pop(self._addr(device), None)
+            data = pybproto.coap_put(next(self._mids) & 0xffff, b'', state, path, coap.NON)
+            self.transport.sendto(data, self._addr(device))
+
+    async def get(self, device):
+        """A device's current state as a bproto dict of the fields it has set.
+
+        The last state seen from each device is kept with its ETag, so
+        polling an unchanged device costs a 2.03 Valid with no payload.
+        """
+        addr = self._addr(device)
+        cached = self._etags.get(addr)
+        options = ((coap.OPTION_ETAG, cached[0]),) if cached else ()
+        res = await self.request(device, coap.GET, options=options, confirmable=True)
+        if res.code == coap.VALID and cached:
+            self._shadow[addr] = dict(cached[1])
+            return dict(cached[1])
+        if res.code != coap.CONTENT:
+            raise CoapError('GET failed with %d.%02d' % (res.code >> 5, res.code & 0x1f), res)
+        state = pybproto.parse(res.payload.decode())
+        state = {k: v for k, v in state.items() if v >= 0}
+        etag = coap.option(res, coap.OPTION_ETAG)
+        if etag is not None:
+            self._etags[addr] = (etag, dict(state))
+        else:
+            self._etags.pop(addr, None)
+        self._shadow[addr] = dict(state)
+        return state
+
+    async def apply(self, scene, confirmable=None, diff=False):
+        """PUT every {device: state} in `scene` concurrently.
+
+        With `diff`, only the fields which differ from each device's shadow
+        state are sent, and devices already in their state are skipped with
+        a None result. Returns {device: response, exception or None}.
+        """
+        devices = list(scene)
+        states = [scene[d] for d in devices]
+        if diff:
+            states = pybproto.diff_batch(
+                [self._shadow.get(self._addr(d), {}) for d in devices], states)
+
+        async def put(device, state):
+            if diff and not state:
+                return None
+            return await self.put(device, state, confirmable)
+
+        results = await asyncio.gather(
+            *(put(d, s) for d, s in zip(devices, states)),
+            return_exceptions=True)
+        return dict(zip(devices, results))
+
+    def _transmit(self, ex, timeout):
+        if self.transport is None:
+            return
+        self.transport.sendto(ex.data, ex.addr)
+        if ex.msg.type == coap.CON and not ex.acked:
+            ex.timer = asyncio.get_running_loop().call_later(
+                timeout, self._retransmit, ex, timeout)
+        else:
+            self._expire(ex)
+
+    def _expire(self, ex):
+        # Without (further) retransmissions to drive the exchange, give up on
+        # a response after as long as a full confirmable exchange could take.
+        ex.timer = asyncio.get_running_loop().call_later(
+            self.ack_timeout * ACK_RANDOM_FACTOR * (2 ** (self.max_retransmit + 1) - 1),
+            self._finish, ex, None, CoapError('timed out'))
+
+    def _retransmit(self, ex, timeout):
+        if ex.future.done() or ex.acked:
+            return
+        if ex.retransmits >= self.max_retransmit:
+            self._finish(ex, exc=CoapError('timed out'))
+            return
+        ex.retransmits += 1
+        self._transmit(ex, timeout * 2)
+
+    def _finish(self, ex, res=None, exc=None):
+        if ex.timer is not None:
+            ex.timer.cancel()
+        self._by_token.pop((ex.addr, ex.msg.token), None)
+        self._by_mid.pop((ex.addr, ex.msg.mid), None)
+        if not ex.future.done():
+            if exc is not None:
+                ex.future.set_exception(exc)
+            else:
+                ex.future.set_result(res)
+
+    def _received(self, data, addr):
+        try:
+            msg = coap.decode(data)
+        except coap.DecodeError:
+            return
+
+        if msg.type == coap.RST:
+            ex = self._by_mid.get((addr, msg.mid))
+            if ex is not None:
+                self._finish(ex, exc=CoapError('reset by peer'))
+            return
+
+        if msg.type == coap.ACK and msg.code == coap.EMPTY:
+            # Separate response follows; stop retransmitting.
+            ex = self._by_mid.get((addr, msg.mid))
+            if ex is not None:
+                ex.acked = True
+                if ex.timer is not None:
+                    ex.timer.cancel()
+                self._expire(ex)
+            return
+
+        if msg.type == coap.CON:
+            self.transport.sendto(coap.encode(
+                coap.Message(coap.ACK, coap.EMPTY, msg.mid)), addr)
+
+        ex = self._by_token.get((addr, msg.token))
+        if ex is not None:
+            self._finish(ex, msg)
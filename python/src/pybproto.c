@@ -1,85 +1,390 @@
-#include <python3.7/Python.h>
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include "bproto.h"
+#include "bproto_color.h"
+#include "bproto_fade.h"
 
 #define PYBPROTO_MAX_LEN 32
 
-#define PYBPROTO_KEY_RED   ("red")
-#define PYBPROTO_KEY_GREEN ("green")
-#define PYBPROTO_KEY_BLUE  ("blue")
-#define PYBPROTO_KEY_WHITE ("white")
+// Channel keys are the bproto_t member names in BPROTO_CHANNEL_TABLE
+#define PYBPROTO_KEY(m) (#m)
 #define PYBPROTO_KEY_TIME  ("time")
+#define PYBPROTO_KEY_EASE  ("ease")
 
-static PyObject *PybprotoError;
+/*
+Module state, one per module object, so the module can be loaded in several
+interpreters at once.
+*/
+typedef struct {
+  PyObject *error;
+} pybproto_state_t;
 
 static PyObject *pybproto_parse(PyObject*, PyObject*);
 static PyObject *pybproto_new(PyObject*, PyObject*);
-/*
-static const char* pybproto_field_to_key(bproto_field_t f) {
-  switch(f) {
-  case BPROTO_FIELD_RED:   return PYBPROTO_KEY_RED;
-  case BPROTO_FIELD_GREEN: return PYBPROTO_KEY_GREEN;
-  case BPROTO_FIELD_BLUE:  return PYBPROTO_KEY_BLUE;
-  case BPROTO_FIELD_WHITE: return PYBPROTO_KEY_WHITE;
-  case BPROTO_FIELD_TIME:  return PYBPROTO_KEY_TIME;
-  default:                 return NULL;
-  }
-}
-*/
+static PyObject *pybproto_diff(PyObject*, PyObject *const*, Py_ssize_t, PyObject*);
+static PyObject *pybproto_diff_batch(PyObject*, PyObject *const*, Py_ssize_t, PyObject*);
+static PyObject *pybproto_hsv(PyObject*, PyObject *const*, Py_ssize_t, PyObject*);
+static PyObject *pybproto_hsv_batch(PyObject*, PyObject *const*, Py_ssize_t, PyObject*);
+static PyObject *pybproto_kelvin(PyObject*, PyObject *const*, Py_ssize_t, PyObject*);
+static PyObject *pybproto_fade_render(PyObject*, PyObject *const*, Py_ssize_t, PyObject*);
+static PyObject *pybproto_coap_encode(PyObject*, PyObject *const*, Py_ssize_t, PyObject*);
+static PyObject *pybproto_coap_decode(PyObject*, PyObject*);
+static PyObject *pybproto_coap_put(PyObject*, PyObject *const*, Py_ssize_t, PyObject*);
+static PyObject *pybproto_coap_get(PyObject*, PyObject *const*, Py_ssize_t, PyObject*);
+static PyObject *pybproto_coap_put_batch(PyObject*, PyObject *const*, Py_ssize_t, PyObject*);
+static int pybproto_exec(PyObject*);
+static int pybproto_traverse(PyObject*, visitproc, void*);
+static int pybproto_clear(PyObject*);
+static void pybproto_free(void*);
+
+#define PYBPROTO_FASTCALL(f) ((PyCFunction)(void (*)(void))(f))
+
 static PyMethodDef PybprotoMethods[] = {
-  {"parse", pybproto_parse, METH_VARARGS,
+  {"parse", pybproto_parse, METH_O,
    "Parse a bproto packet."},
-  {"new", pybproto_new, METH_VARARGS,
+  {"new", pybproto_new, METH_O,
    "Create a new bproto packet from a dict."},
+  {"diff", PYBPROTO_FASTCALL(pybproto_diff), METH_FASTCALL | METH_KEYWORDS,
+   "diff(old, new): dict of the fields to send to take a device from state old to new. "
+   "Channels which already match are left out, and time and ease are only kept with a channel."},
+  {"diff_batch", PYBPROTO_FASTCALL(pybproto_diff_batch), METH_FASTCALL | METH_KEYWORDS,
+   "diff_batch(olds, news): list of diff(old, new) for each pair."},
+  {"hsv", PYBPROTO_FASTCALL(pybproto_hsv), METH_FASTCALL | METH_KEYWORDS,
+   "hsv(hue, sat, val, white=False): dict for a hue in degrees and 0-255 saturation/value."},
+  {"hsv_batch", PYBPROTO_FASTCALL(pybproto_hsv_batch), METH_FASTCALL | METH_KEYWORDS,
+   "hsv_batch(hues, sat, val, white=False): list of dicts, one per hue in degrees."},
+  {"kelvin", PYBPROTO_FASTCALL(pybproto_kelvin), METH_FASTCALL | METH_KEYWORDS,
+   "kelvin(temp, level, white=False): dict for a 1000-12000K colour temperature and 0-255 level."},
+  {"fade_render", PYBPROTO_FASTCALL(pybproto_fade_render), METH_FASTCALL | METH_KEYWORDS,
+   "fade_render(keyframes, times, pwm_hz=5000, max_duty=1023, segments=16, segment_min_ms=20): "
+   "(red, green, blue, white) duties a device shows at each of the increasing times in ms, "
+   "given (ms, dict) keyframes in time order, as the firmware fades them."},
+  {"coap_encode", PYBPROTO_FASTCALL(pybproto_coap_encode), METH_FASTCALL | METH_KEYWORDS,
+   "coap_encode(type, code, mid, token, options=(), payload=b''): CoAP datagram. Options are (number, bytes) pairs, numbers 0-65535."},
+  {"coap_decode", pybproto_coap_decode, METH_O,
+   "coap_decode(data): (type, code, mid, token, options, payload) of a CoAP datagram."},
+  {"coap_put", PYBPROTO_FASTCALL(pybproto_coap_put), METH_FASTCALL | METH_KEYWORDS,
+   "coap_put(mid, token, state, path='led', type=0): CoAP PUT datagram carrying a bproto dict. "
+   "The path may end in a query, as in 'stream?s=1'."},
+  {"coap_get", PYBPROTO_FASTCALL(pybproto_coap_get), METH_FASTCALL | METH_KEYWORDS,
+   "coap_get(mid, token, path='led', type=0): CoAP GET datagram."},
+  {"coap_put_batch", PYBPROTO_FASTCALL(pybproto_coap_put_batch), METH_FASTCALL | METH_KEYWORDS,
+   "coap_put_batch(buf, states, mid, token, path='led', type=0): write one PUT per state into "
+   "a writable buffer, with consecutive message IDs and 4-byte tokens. Returns a memoryview per datagram."},
   {NULL, NULL, 0, NULL} /* Sentinel */
 };
 
+static PyModuleDef_Slot PybprotoSlots[] = {
+  {Py_mod_exec, pybproto_exec},
+#ifdef Py_MOD_PER_INTERPRETER_GIL_SUPPORTED
+  {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_MOD_GIL_NOT_USED
+  // Safe without the GIL: there is no mutable module-level state, sequence
+  // arguments are snapshotted into tuples (pybproto_tuple) and dict lookups
+  // take strong references, so other threads can't free what a call reads.
+  {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+  {0, NULL} /* Sentinel */
+};
+
 static struct PyModuleDef pybprotomodule = {
   PyModuleDef_HEAD_INIT,
-  "pybproto",
-  NULL,
-  -1,
-  PybprotoMethods,
+  .m_name = "pybproto",
+  .m_size = sizeof(pybproto_state_t),
+  .m_methods = PybprotoMethods,
+  .m_slots = PybprotoSlots,
+  .m_traverse = pybproto_traverse,
+  .m_clear = pybproto_clear,
+  .m_free = pybproto_free,
 };
 
 PyMODINIT_FUNC
 PyInit_pybproto(void) {
-  PyObject *m;
+  return PyModuleDef_Init(&pybprotomodule);
+}
 
-  m = PyModule_Create(&pybprotomodule);
-  if (m == NULL) {
-    return NULL;
+static pybproto_state_t *pybproto_state(PyObject *module) {
+  return (pybproto_state_t *)PyModule_GetState(module);
+}
+
+static int pybproto_exec(PyObject *m) {
+  pybproto_state_t *st = pybproto_state(m);
+
+  st->error = PyErr_NewException("pybproto.error", PyExc_ValueError, NULL);
+  if (st->error == NULL) {
+    return -1;
+  }
+  Py_INCREF(st->error);
+  if (PyModule_AddObject(m, "error", st->error) < 0) {
+    Py_DECREF(st->error);
+    return -1;
+  }
+  return 0;
+}
+
+static int pybproto_traverse(PyObject *m, visitproc visit, void *arg) {
+  Py_VISIT(pybproto_state(m)->error);
+  return 0;
+}
+
+static int pybproto_clear(PyObject *m) {
+  Py_CLEAR(pybproto_state(m)->error);
+  return 0;
+}
+
+static void pybproto_free(void *m) {
+  pybproto_clear((PyObject *)m);
+}
+
+/*
+Argument Clinic style unpacking for METH_FASTCALL | METH_KEYWORDS: sets
+`out[i]` to the argument for `kwlist[i]`, given by position or keyword, or
+NULL if it was left out. The first `required` are mandatory. Returns -1
+with an exception set on error.
+*/
+static int pybproto_unpack(const char *fname, PyObject *const *args, Py_ssize_t nargs,
+			   PyObject *kwnames, const char *const *kwlist, Py_ssize_t required,
+			   PyObject **out) {
+  Py_ssize_t max = 0;
+  while (kwlist[max] != NULL) {
+    max++;
+  }
+  if (nargs > max) {
+    PyErr_Format(PyExc_TypeError, "%s() takes at most %zd arguments (%zd given)",
+		 fname, max, nargs);
+    return -1;
+  }
+  for (Py_ssize_t i = 0; i < max; i++) {
+    out[i] = i < nargs ? args[i] : NULL;
+  }
+
+  Py_ssize_t nkw = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+  for (Py_ssize_t k = 0; k < nkw; k++) {
+    const char *name = PyUnicode_AsUTF8(PyTuple_GET_ITEM(kwnames, k));
+    if (name == NULL) {
+      return -1;
+    }
+    Py_ssize_t i = 0;
+    while (i < max && strcmp(kwlist[i], name) != 0) {
+      i++;
+    }
+    if (i == max) {
+      PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword argument '%s'", fname, name);
+      return -1;
+    }
+    if (out[i] != NULL) {
+      PyErr_Format(PyExc_TypeError, "%s() got multiple values for argument '%s'", fname, name);
+      return -1;
+    }
+    out[i] = args[nargs + k];
+  }
+
+  for (Py_ssize_t i = 0; i < required; i++) {
+    if (out[i] == NULL) {
+      PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s'", fname, kwlist[i]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+Converters for unpacked arguments, matching the PyArg_Parse format units
+noted against each. They return -1 with an exception set on error, and
+leave `dst` alone for arguments that were left out.
+*/
+static int pybproto_arg_long(PyObject *obj, const char *name, long min, long max, long *dst) {
+  if (obj == NULL) {
+    return 0;
+  }
+  long val = PyLong_AsLong(obj);
+  if (val == -1 && PyErr_Occurred()) {
+    return -1;
+  }
+  if (val < min || val > max) {
+    PyErr_Format(PyExc_OverflowError, "%s out of range: %ld", name, val);
+    return -1;
+  }
+  *dst = val;
+  return 0;
+}
+
+// "b"
+static int pybproto_arg_u8(PyObject *obj, const char *name, unsigned char *dst) {
+  long val = *dst;
+  int res = pybproto_arg_long(obj, name, 0, UCHAR_MAX, &val);
+  *dst = val;
+  return res;
+}
+
+// "i"
+static int pybproto_arg_int(PyObject *obj, const char *name, int *dst) {
+  long val = *dst;
+  int res = pybproto_arg_long(obj, name, INT_MIN, INT_MAX, &val);
+  *dst = val;
+  return res;
+}
+
+// "H": wraps like the format unit, so message ID counters can be passed as is
+static int pybproto_arg_u16(PyObject *obj, unsigned short *dst) {
+  if (obj == NULL) {
+    return 0;
   }
+  unsigned long val = PyLong_AsUnsignedLongMask(obj);
+  if (val == (unsigned long)-1 && PyErr_Occurred()) {
+    return -1;
+  }
+  *dst = (unsigned short)val;
+  return 0;
+}
 
-  PybprotoError = PyErr_NewException("pybproto.error", NULL, NULL);
-  Py_INCREF(PybprotoError);
-  PyModule_AddObject(m, "error", PybprotoError);
+// "p"
+static int pybproto_arg_bool(PyObject *obj, int *dst) {
+  if (obj == NULL) {
+    return 0;
+  }
+  int val = PyObject_IsTrue(obj);
+  if (val < 0) {
+    return -1;
+  }
+  *dst = val;
+  return 0;
+}
 
-  return m;
+// "s"
+static int pybproto_arg_str(PyObject *obj, const char *name, const char **dst) {
+  if (obj == NULL) {
+    return 0;
+  }
+  Py_ssize_t len;
+  const char *str = PyUnicode_Check(obj) ? PyUnicode_AsUTF8AndSize(obj, &len) : NULL;
+  if (str == NULL) {
+    if (!PyErr_Occurred()) {
+      PyErr_Format(PyExc_TypeError, "%s must be str, not %.50s", name, Py_TYPE(obj)->tp_name);
+    }
+    return -1;
+  }
+  if (strlen(str) != (size_t)len) {
+    PyErr_Format(PyExc_ValueError, "embedded null character in %s", name);
+    return -1;
+  }
+  *dst = str;
+  return 0;
+}
+
+// "S" and "O!": borrowed, checked with `check`
+static int pybproto_arg_type(PyObject *obj, const char *name, int (*check)(PyObject *),
+			     const char *type, PyObject **dst) {
+  if (obj == NULL) {
+    return 0;
+  }
+  if (!check(obj)) {
+    PyErr_Format(PyExc_TypeError, "%s must be %s, not %.50s", name, type, Py_TYPE(obj)->tp_name);
+    return -1;
+  }
+  *dst = obj;
+  return 0;
+}
+
+static int pybproto_is_bytes(PyObject *obj) {
+  return PyBytes_Check(obj);
+}
+
+static int pybproto_is_dict(PyObject *obj) {
+  return PyDict_Check(obj);
+}
+
+/*
+Snapshot a sequence argument into a new tuple. PySequence_Fast hands back
+a list argument itself, whose items a __float__ or __index__ callback can
+free from under the loop; the items of a tuple live as long as the tuple.
+*/
+static PyObject *pybproto_tuple(PyObject *obj, const char *msg) {
+  PyObject *tuple = PySequence_Tuple(obj);
+  if (tuple == NULL && PyErr_ExceptionMatches(PyExc_TypeError)) {
+    PyErr_SetString(PyExc_TypeError, msg);
+  }
+  return tuple;
 }
 
 static PyObject *bproto_to_pyobject(bproto_t *b) {
-  return Py_BuildValue("{s:i,s:i,s:i,s:i,s:i}",
-		       PYBPROTO_KEY_RED,   b->red,
-		       PYBPROTO_KEY_GREEN, b->green,
-		       PYBPROTO_KEY_BLUE,  b->blue,
-		       PYBPROTO_KEY_WHITE, b->white,
-		       PYBPROTO_KEY_TIME,  b->time);
+#define PYBPROTO_CHANNEL_FORMAT(m, NAME, l) "s:i,"
+#define PYBPROTO_CHANNEL_ARGS(m, NAME, l) PYBPROTO_KEY(m), b->m,
+  return Py_BuildValue("{" BPROTO_CHANNEL_TABLE(PYBPROTO_CHANNEL_FORMAT) "s:i,s:i}",
+		       BPROTO_CHANNEL_TABLE(PYBPROTO_CHANNEL_ARGS)
+		       PYBPROTO_KEY_TIME,  b->time,
+		       PYBPROTO_KEY_EASE,  b->ease);
+#undef PYBPROTO_CHANNEL_FORMAT
+#undef PYBPROTO_CHANNEL_ARGS
+}
+
+/*
+Like bproto_to_pyobject, but only includes fields which are set.
+*/
+static PyObject *bproto_to_pyobject_set(bproto_t *b) {
+  PyObject *dict = PyDict_New();
+  if (dict == NULL) {
+    return NULL;
+  }
+
+  struct {
+    const char *key;
+    long val;
+  } fields[] = {
+#define PYBPROTO_CHANNEL_FIELD(m, NAME, l) {PYBPROTO_KEY(m), b->m},
+    BPROTO_CHANNEL_TABLE(PYBPROTO_CHANNEL_FIELD)
+#undef PYBPROTO_CHANNEL_FIELD
+    {PYBPROTO_KEY_TIME,  b->time},
+    {PYBPROTO_KEY_EASE,  b->ease},
+  };
+
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    if (fields[i].val < 0) {
+      continue;
+    }
+    PyObject *val = PyLong_FromLong(fields[i].val);
+    if (val == NULL || PyDict_SetItemString(dict, fields[i].key, val) < 0) {
+      Py_XDECREF(val);
+      Py_DECREF(dict);
+      return NULL;
+    }
+    Py_DECREF(val);
+  }
+  return dict;
 }
 
-static PyObject *pybproto_parse(PyObject *self, PyObject *args) {
+static int pybproto_degrees_to_hue(double deg, bproto_hue_t *dst) {
+  if (!isfinite(deg)) {
+    PyErr_SetString(PyExc_ValueError, "hue must be finite");
+    return -1;
+  }
+  double turn = fmod(deg, 360.0) / 360.0;
+  if (turn < 0) {
+    turn += 1.0;
+  }
+  // a tiny negative hue rounds up to a full turn
+  *dst = (bproto_hue_t)((uint32_t)(turn * BPROTO_HUE_TURN) & 0xffff);
+  return 0;
+}
+
+static PyObject *pybproto_parse(PyObject *self, PyObject *arg) {
   bproto_t b;
   bproto_init(&b);
 
-  char *raw;
-  if (!PyArg_ParseTuple(args, "s", &raw)) {
+  const char *raw = NULL;
+  if (pybproto_arg_str(arg, "packet", &raw) < 0) {
     return NULL;
   }
 
-  char *res = bproto_parse(&b, raw);
+  char *res = bproto_parse(&b, (char *)raw);
 
   if (res == raw) {
-    PyErr_SetString(PybprotoError, "Parse error");
+    PyErr_SetString(pybproto_state(self)->error, "Parse error");
     return NULL;
   }
 
@@ -93,55 +398,63 @@ enum KEY_TO_LONG_ERR {
 };
 
 
-static int pybproto_key_to_long(PyObject *dict, char *key, long *dst) {
+/*
+Takes a strong reference to the item where the API allows, so the dict can
+be changed by another thread without the GIL.
+*/
+static int pybproto_key_to_long(pybproto_state_t *st, PyObject *dict, char *key, long *dst) {
+#if PY_VERSION_HEX >= 0x030D0000
+  PyObject *item;
+  int found = PyDict_GetItemStringRef(dict, key, &item);
+  if (found < 0) {
+    return KTL_ERR;
+  } else if (found == 0) {
+    return KTL_UNSET;
+  }
+#else
   PyObject *item = PyDict_GetItemString(dict, key);
   if (item == NULL) {
     return KTL_UNSET;
   }
+  Py_INCREF(item);
+#endif
 
   *dst = PyLong_AsLong(item);
+  Py_DECREF(item);
   if (*dst == -1 && PyErr_Occurred()) {
-    char *err;
-    if (asprintf(&err, "Invalid numeric value in '%s'", key) != -1) {
-      PyErr_SetString(PyExc_ValueError, err);
-    } else {
-      PyErr_SetString(PyExc_ValueError, "Invalid numeric value");
-    }
-    free(err);
+    PyErr_Format(st->error, "Invalid numeric value in '%s'", key);
     return KTL_ERR;
   }
 
   return KTL_OK;
 }
 
-static int pybproto_long_to_value_t(long src, bproto_value_t *dst) {
+static int pybproto_long_to_value_t(pybproto_state_t *st, long src, bproto_value_t *dst) {
   if (src >= BPROTO_VALUE_T_MIN && src <= BPROTO_VALUE_T_MAX) {
     *dst = (bproto_value_t) src;
     return 1;
   } else {
-     char *err;
-     if (asprintf(&err, "Value out of range: '%ld'", src) != -1) {
-       PyErr_SetString(PyExc_ValueError, err);
-     } else {
-       PyErr_SetString(PyExc_ValueError, "Value out of range");
-     }
-     free(err);
-     return 0;
+    PyErr_Format(st->error, "Value out of range: '%ld'", src);
+    return 0;
   }
 }
 
-static int pybproto_long_to_time_t(long src, bproto_time_t *dst) {
+static int pybproto_long_to_time_t(pybproto_state_t *st, long src, bproto_time_t *dst) {
   if (src >= BPROTO_TIME_T_MIN && src <= BPROTO_TIME_T_MAX) {
     *dst = (bproto_time_t) src;
     return 1;
   } else {
-    char *err;
-    if (asprintf(&err, "Value out of range: '%ld'", src) != -1) {
-      PyErr_SetString(PyExc_ValueError, err);
-    } else {
-      PyErr_SetString(PyExc_ValueError, "Value out of range");
-    }
-    free(err);
+    PyErr_Format(st->error, "Value out of range: '%ld'", src);
+    return 0;
+  }
+}
+
+static int pybproto_long_to_ease(pybproto_state_t *st, long src, bproto_value_t *dst) {
+  if (src >= BPROTO_EASE_T_MIN && src <= BPROTO_EASE_T_MAX) {
+    *dst = (bproto_value_t) src;
+    return 1;
+  } else {
+    PyErr_Format(st->error, "Unknown easing curve: '%ld'", src);
     return 0;
   }
 }
@@ -150,40 +463,51 @@ static int pybproto_long_to_time_t(long src, bproto_time_t *dst) {
   do {						\
     switch(err) {				\
     case(KTL_OK):				\
-      x;					\
+      if (!(x)) {				\
+	return -1;				\
+      }						\
       break;					\
     case(KTL_UNSET):				\
       break;					\
     case(KTL_ERR):				\
-      return NULL;				\
+      return -1;				\
     }						\
   } while(0);
 
-static PyObject *pybproto_new(PyObject *self, PyObject *args) {
-  char buf[PYBPROTO_MAX_LEN];
+/*
+Fill `b` from a dict of fields. Returns -1 with an exception set on error.
+*/
+static int pybproto_from_dict(PyObject *self, PyObject *dict, bproto_t *b) {
+  pybproto_state_t *st = pybproto_state(self);
+  bproto_init(b);
+  long res;
 
+#define PYBPROTO_CHANNEL_FROM_DICT(m, NAME, l)				\
+  DO_IF_OK(pybproto_key_to_long(st, dict, PYBPROTO_KEY(m), &res),	\
+	   pybproto_long_to_value_t(st, res, &b->m));
+  BPROTO_CHANNEL_TABLE(PYBPROTO_CHANNEL_FROM_DICT)
+#undef PYBPROTO_CHANNEL_FROM_DICT
 
-  PyObject* dict;
-  PyArg_ParseTuple(args, "O!", &PyDict_Type, &dict);
+  DO_IF_OK(pybproto_key_to_long(st, dict, PYBPROTO_KEY_TIME, &res),
+	   pybproto_long_to_time_t(st, res, &b->time));
 
-  bproto_t b;
-  bproto_init(&b);
-  long res;
-
-  DO_IF_OK(pybproto_key_to_long(dict, PYBPROTO_KEY_RED, &res),
-	   pybproto_long_to_value_t(res, &b.red));
+  DO_IF_OK(pybproto_key_to_long(st, dict, PYBPROTO_KEY_EASE, &res),
+	   pybproto_long_to_ease(st, res, &b->ease));
 
-  DO_IF_OK(pybproto_key_to_long(dict, PYBPROTO_KEY_GREEN, &res),
-	   pybproto_long_to_value_t(res, &b.green));
+  return 0;
+}
 
-  DO_IF_OK(pybproto_key_to_long(dict, PYBPROTO_KEY_BLUE, &res),
-	   pybproto_long_to_value_t(res, &b.blue));
+static PyObject *pybproto_new(PyObject *self, PyObject *dict) {
+  char buf[PYBPROTO_MAX_LEN];
 
-  DO_IF_OK(pybproto_key_to_long(dict, PYBPROTO_KEY_WHITE, &res),
-	   pybproto_long_to_value_t(res, &b.white));
+  if (pybproto_arg_type(dict, "packet", pybproto_is_dict, "dict", &dict) < 0) {
+    return NULL;
+  }
 
-  DO_IF_OK(pybproto_key_to_long(dict, PYBPROTO_KEY_TIME, &res),
-	   pybproto_long_to_time_t(res, &b.time));
+  bproto_t b;
+  if (pybproto_from_dict(self, dict, &b) < 0) {
+    return NULL;
+  }
 
   char *ptr = buf;
   int bytes = bproto_snprint(&ptr, PYBPROTO_MAX_LEN-1, &b);
@@ -195,3 +519,794 @@ static PyObject *pybproto_new(PyObject *self, PyObject *args) {
     return NULL;
   }
 }
+
+static PyObject *pybproto_diff(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+			       PyObject *kwnames) {
+  static const char *const kwlist[] = {"old", "new", NULL};
+  PyObject *argv[2], *old = NULL, *new = NULL;
+  if (pybproto_unpack("diff", args, nargs, kwnames, kwlist, 2, argv) < 0 ||
+      pybproto_arg_type(argv[0], "old", pybproto_is_dict, "dict", &old) < 0 ||
+      pybproto_arg_type(argv[1], "new", pybproto_is_dict, "dict", &new) < 0) {
+    return NULL;
+  }
+
+  bproto_t o, n, out;
+  if (pybproto_from_dict(self, old, &o) < 0 || pybproto_from_dict(self, new, &n) < 0) {
+    return NULL;
+  }
+  bproto_diff(&o, &n, &out);
+  return bproto_to_pyobject_set(&out);
+}
+
+static PyObject *pybproto_diff_batch(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+				     PyObject *kwnames) {
+  static const char *const kwlist[] = {"olds", "news", NULL};
+  PyObject *argv[2];
+  if (pybproto_unpack("diff_batch", args, nargs, kwnames, kwlist, 2, argv) < 0) {
+    return NULL;
+  }
+
+  PyObject *olds = NULL, *news = NULL, *list = NULL;
+  bproto_t *buf = NULL;
+  if ((olds = pybproto_tuple(argv[0], "olds must be a sequence")) == NULL ||
+      (news = pybproto_tuple(argv[1], "news must be a sequence")) == NULL) {
+    goto done;
+  }
+  Py_ssize_t n = PyTuple_GET_SIZE(olds);
+  if (PyTuple_GET_SIZE(news) != n) {
+    PyErr_SetString(PyExc_ValueError, "olds and news differ in length");
+    goto done;
+  }
+
+  // One allocation for the old, new and diff arrays
+  if ((buf = PyMem_Malloc(3 * n * sizeof(bproto_t) + 1)) == NULL) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  bproto_t *o = buf, *nw = buf + n, *out = buf + 2 * n;
+  for (Py_ssize_t i = 0; i < n; i++) {
+    PyObject *x = PyTuple_GET_ITEM(olds, i), *y = PyTuple_GET_ITEM(news, i);
+    if (!PyDict_Check(x) || !PyDict_Check(y)) {
+      PyErr_SetString(PyExc_TypeError, "states must be dicts");
+      goto done;
+    }
+    if (pybproto_from_dict(self, x, &o[i]) < 0 || pybproto_from_dict(self, y, &nw[i]) < 0) {
+      goto done;
+    }
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  bproto_diff_batch(o, nw, out, n);
+  Py_END_ALLOW_THREADS
+
+  list = PyList_New(n);
+  for (Py_ssize_t i = 0; list != NULL && i < n; i++) {
+    PyObject *item = bproto_to_pyobject_set(&out[i]);
+    if (item == NULL) {
+      Py_CLEAR(list);
+      break;
+    }
+    PyList_SET_ITEM(list, i, item);
+  }
+
+ done:
+  PyMem_Free(buf);
+  Py_XDECREF(olds);
+  Py_XDECREF(news);
+  return list;
+}
+
+static PyObject *pybproto_hsv(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+			      PyObject *kwnames) {
+  static const char *const kwlist[] = {"hue", "sat", "val", "white", NULL};
+  PyObject *argv[4];
+  double deg;
+  bproto_hue_t hue = 0;
+  unsigned char sat = 0, val = 0;
+  int white = 0;
+  if (pybproto_unpack("hsv", args, nargs, kwnames, kwlist, 3, argv) < 0 ||
+      ((deg = PyFloat_AsDouble(argv[0])) == -1.0 && PyErr_Occurred()) ||
+      pybproto_degrees_to_hue(deg, &hue) < 0 ||
+      pybproto_arg_u8(argv[1], "sat", &sat) < 0 ||
+      pybproto_arg_u8(argv[2], "val", &val) < 0 ||
+      pybproto_arg_bool(argv[3], &white) < 0) {
+    return NULL;
+  }
+
+  bproto_t b;
+  bproto_init(&b);
+  bproto_hsv(&b, hue, sat, val,
+	     white ? BPROTO_WHITE_EXTRACT : BPROTO_WHITE_NONE);
+  return bproto_to_pyobject_set(&b);
+}
+
+static PyObject *pybproto_hsv_batch(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+				    PyObject *kwnames) {
+  static const char *const kwlist[] = {"hues", "sat", "val", "white", NULL};
+  PyObject *argv[4];
+  unsigned char sat = 0, val = 0;
+  int white = 0;
+  if (pybproto_unpack("hsv_batch", args, nargs, kwnames, kwlist, 3, argv) < 0 ||
+      pybproto_arg_u8(argv[1], "sat", &sat) < 0 ||
+      pybproto_arg_u8(argv[2], "val", &val) < 0 ||
+      pybproto_arg_bool(argv[3], &white) < 0) {
+    return NULL;
+  }
+
+  PyObject *seq = pybproto_tuple(argv[0], "hues must be a sequence");
+  if (seq == NULL) {
+    return NULL;
+  }
+  Py_ssize_t n = PyTuple_GET_SIZE(seq);
+
+  bproto_hue_t *h = PyMem_Malloc(n * sizeof(bproto_hue_t) + 1);
+  uint8_t *s = PyMem_Malloc(n + 1);
+  uint8_t *v = PyMem_Malloc(n + 1);
+  bproto_t *out = PyMem_Malloc(n * sizeof(bproto_t) + 1);
+  PyObject *list = NULL;
+  if (h == NULL || s == NULL || v == NULL || out == NULL) {
+    PyErr_NoMemory();
+    goto done;
+  }
+
+  for (Py_ssize_t i = 0; i < n; i++) {
+    double deg = PyFloat_AsDouble(PyTuple_GET_ITEM(seq, i));
+    if ((deg == -1.0 && PyErr_Occurred()) || pybproto_degrees_to_hue(deg, &h[i]) < 0) {
+      goto done;
+    }
+    s[i] = sat;
+    v[i] = val;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  bproto_hsv_batch(out, h, s, v, n, white ? BPROTO_WHITE_EXTRACT : BPROTO_WHITE_NONE);
+  Py_END_ALLOW_THREADS
+
+  list = PyList_New(n);
+  for (Py_ssize_t i = 0; list != NULL && i < n; i++) {
+    PyObject *item = bproto_to_pyobject_set(&out[i]);
+    if (item == NULL) {
+      Py_CLEAR(list);
+      break;
+    }
+    PyList_SET_ITEM(list, i, item);
+  }
+
+ done:
+  PyMem_Free(h);
+  PyMem_Free(s);
+  PyMem_Free(v);
+  PyMem_Free(out);
+  Py_DECREF(seq);
+  return list;
+}
+
+static PyObject *pybproto_kelvin(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+				 PyObject *kwnames) {
+  static const char *const kwlist[] = {"temp", "level", "white", NULL};
+  PyObject *argv[3];
+  long temp = BPROTO_KELVIN_MIN;
+  unsigned char level = 0;
+  int white = 0;
+  if (pybproto_unpack("kelvin", args, nargs, kwnames, kwlist, 2, argv) < 0 ||
+      pybproto_arg_long(argv[0], "temp", BPROTO_KELVIN_MIN, BPROTO_KELVIN_MAX, &temp) < 0 ||
+      pybproto_arg_u8(argv[1], "level", &level) < 0 ||
+      pybproto_arg_bool(argv[2], &white) < 0) {
+    return NULL;
+  }
+
+  bproto_t b;
+  bproto_init(&b);
+  bproto_kelvin(&b, (bproto_kelvin_t)temp, level, white ? BPROTO_WHITE_EXTRACT : BPROTO_WHITE_NONE);
+  return bproto_to_pyobject_set(&b);
+}
+
+static PyObject *pybproto_fade_render(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+				      PyObject *kwnames) {
+  static const char *const kwlist[] = {"keyframes", "times", "pwm_hz", "max_duty", "segments",
+				       "segment_min_ms", NULL};
+  PyObject *argv[6];
+  bproto_fade_cfg_t cfg = BPROTO_FADE_CFG_DEFAULT;
+  long pwm_hz = cfg.pwm_hz, max_duty = cfg.max_duty, segment_min_ms = cfg.segment_min_ms;
+  unsigned char segments = cfg.segments;
+  if (pybproto_unpack("fade_render", args, nargs, kwnames, kwlist, 2, argv) < 0 ||
+      pybproto_arg_long(argv[2], "pwm_hz", 1, 40000000, &pwm_hz) < 0 ||
+      pybproto_arg_long(argv[3], "max_duty", 1, 1 << 20, &max_duty) < 0 ||
+      pybproto_arg_u8(argv[4], "segments", &segments) < 0 ||
+      pybproto_arg_long(argv[5], "segment_min_ms", 1, USHRT_MAX, &segment_min_ms) < 0) {
+    return NULL;
+  }
+  cfg.pwm_hz = pwm_hz;
+  cfg.max_duty = max_duty;
+  cfg.segments = segments;
+  cfg.segment_min_ms = segment_min_ms;
+
+  PyObject *keys = NULL, *times = NULL, *list = NULL;
+  bproto_keyframe_t *k = NULL;
+  uint32_t *ms = NULL, (*out)[BPROTO_FADE_CHANNELS] = NULL;
+  if ((keys = pybproto_tuple(argv[0], "keyframes must be a sequence")) == NULL ||
+      (times = pybproto_tuple(argv[1], "times must be a sequence")) == NULL) {
+    goto done;
+  }
+  Py_ssize_t nk = PyTuple_GET_SIZE(keys), n = PyTuple_GET_SIZE(times);
+
+  k = PyMem_Malloc(nk * sizeof(bproto_keyframe_t) + 1);
+  ms = PyMem_Malloc(n * sizeof(uint32_t) + 1);
+  out = PyMem_Malloc(n * sizeof(*out) + 1);
+  if (k == NULL || ms == NULL || out == NULL) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  for (Py_ssize_t i = 0; i < nk; i++) {
+    PyObject *item = PyTuple_GET_ITEM(keys, i), *at, *dict;
+    long val = 0;
+    if (!PyArg_ParseTuple(item, "OO!", &at, &PyDict_Type, &dict) ||
+	pybproto_arg_long(at, "keyframe time", 0, INT_MAX, &val) < 0 ||
+	pybproto_from_dict(self, dict, &k[i].msg) < 0) {
+      goto done;
+    }
+    k[i].at = val;
+    if (i > 0 && k[i].at < k[i - 1].at) {
+      PyErr_SetString(PyExc_ValueError, "keyframes must be in time order");
+      goto done;
+    }
+  }
+  for (Py_ssize_t i = 0; i < n; i++) {
+    long val = 0;
+    if (pybproto_arg_long(PyTuple_GET_ITEM(times, i), "time", 0, INT_MAX, &val) < 0) {
+      goto done;
+    }
+    ms[i] = val;
+  }
+
+  size_t rendered;
+  Py_BEGIN_ALLOW_THREADS
+  rendered = bproto_fade_render(k, nk, ms, n, &cfg, out);
+  Py_END_ALLOW_THREADS
+  if (rendered < (size_t)n) {
+    PyErr_SetString(PyExc_ValueError, "times must not decrease");
+    goto done;
+  }
+
+  list = PyList_New(n);
+  for (Py_ssize_t i = 0; list != NULL && i < n; i++) {
+    PyObject *item = PyTuple_New(BPROTO_FADE_CHANNELS);
+    for (int ch = 0; item != NULL && ch < BPROTO_FADE_CHANNELS; ch++) {
+      PyObject *duty = PyLong_FromUnsignedLong(out[i][ch]);
+      if (duty == NULL) {
+	Py_CLEAR(item);
+	break;
+      }
+      PyTuple_SET_ITEM(item, ch, duty);
+    }
+    if (item == NULL) {
+      Py_CLEAR(list);
+      break;
+    }
+    PyList_SET_ITEM(list, i, item);
+  }
+
+ done:
+  PyMem_Free(k);
+  PyMem_Free(ms);
+  PyMem_Free(out);
+  Py_XDECREF(keys);
+  Py_XDECREF(times);
+  return list;
+}
+
+/*
+CoAP (RFC 7252) framing, so senders don't pay for building datagrams in
+python. The writers below return the number of bytes written to `out`, or 0
+if `cap` is too small.
+*/
+#define PYBPROTO_COAP_VERSION (1)
+#define PYBPROTO_COAP_CON (0)
+#define PYBPROTO_COAP_GET (1)
+#define PYBPROTO_COAP_PUT (3)
+#define PYBPROTO_COAP_OPTION_URI_PATH (11)
+#define PYBPROTO_COAP_OPTION_CONTENT_FORMAT (12)
+#define PYBPROTO_COAP_OPTION_URI_QUERY (15)
+#define PYBPROTO_COAP_OPTION_MAX (65535)
+#define PYBPROTO_COAP_PAYLOAD_MARKER (0xff)
+#define PYBPROTO_COAP_TOKEN_MAX (8)
+#define PYBPROTO_COAP_OPTIONS_MAX (32)
+#define PYBPROTO_COAP_MAX_LEN (1152) // RFC 7252 recommended datagram limit
+#define PYBPROTO_DEFAULT_PATH ("led")
+
+static size_t pybproto_coap_header(uint8_t *out, size_t cap, int type, int code,
+				   uint16_t mid, const uint8_t *token, size_t tkl) {
+  if (cap < 4 + tkl) {
+    return 0;
+  }
+  out[0] = (PYBPROTO_COAP_VERSION << 6) | ((type & 0x3) << 4) | tkl;
+  out[1] = code;
+  out[2] = mid >> 8;
+  out[3] = mid & 0xff;
+  memcpy(out + 4, token, tkl);
+  return 4 + tkl;
+}
+
+/*
+Option delta or length nibble, with its extended bytes in `ext`.
+*/
+static int pybproto_coap_ext(size_t val, uint8_t ext[2], size_t *ext_len) {
+  if (val < 13) {
+    *ext_len = 0;
+    return val;
+  } else if (val < 269) {
+    ext[0] = val - 13;
+    *ext_len = 1;
+    return 13;
+  } else {
+    ext[0] = (val - 269) >> 8;
+    ext[1] = (val - 269) & 0xff;
+    *ext_len = 2;
+    return 14;
+  }
+}
+
+/*
+Options must be written in ascending order; `last` is the previous number.
+*/
+static size_t pybproto_coap_option(uint8_t *out, size_t cap, unsigned *last,
+				   unsigned number, const uint8_t *val, size_t len) {
+  uint8_t delta_ext[2], len_ext[2];
+  size_t delta_ext_len, len_ext_len;
+  int delta = pybproto_coap_ext(number - *last, delta_ext, &delta_ext_len);
+  int length = pybproto_coap_ext(len, len_ext, &len_ext_len);
+  size_t size = 1 + delta_ext_len + len_ext_len + len;
+
+  if (len > 65535 + 269 || cap < size) {
+    return 0;
+  }
+  *out++ = (delta << 4) | length;
+  memcpy(out, delta_ext, delta_ext_len);
+  out += delta_ext_len;
+  memcpy(out, len_ext, len_ext_len);
+  out += len_ext_len;
+  memcpy(out, val, len);
+  *last = number;
+  return size;
+}
+
+/*
+One `number` option per non-empty, `sep`-separated segment of `str`, up to
+its end or `stop`. The bytes written go in `len`; returns -1 if they don't
+fit in `cap`.
+*/
+static int pybproto_coap_segments(uint8_t *out, size_t cap, unsigned *last, unsigned number,
+				  const char *str, char sep, char stop, size_t *len) {
+  *len = 0;
+  while (*str && *str != stop) {
+    size_t seg = 0;
+    while (str[seg] && str[seg] != sep && str[seg] != stop) {
+      seg++;
+    }
+    if (seg > 0) {
+      size_t n = pybproto_coap_option(out + *len, cap - *len, last, number,
+				      (const uint8_t *)str, seg);
+      if (n == 0) {
+	return -1;
+      }
+      *len += n;
+    }
+    str += str[seg] == sep ? seg + 1 : seg;
+  }
+  return 0;
+}
+
+/*
+One Uri-Path option per non-empty segment of `path`, up to any '?'.
+*/
+static int pybproto_coap_path(uint8_t *out, size_t cap, unsigned *last, const char *path,
+			      size_t *len) {
+  return pybproto_coap_segments(out, cap, last, PYBPROTO_COAP_OPTION_URI_PATH,
+				path, '/', '?', len);
+}
+
+/*
+One Uri-Query option per '&'-separated argument after any '?' in `path`.
+*/
+static int pybproto_coap_query(uint8_t *out, size_t cap, unsigned *last, const char *path,
+			       size_t *len) {
+  const char *query = strchr(path, '?');
+  *len = 0;
+  return query ? pybproto_coap_segments(out, cap, last, PYBPROTO_COAP_OPTION_URI_QUERY,
+					query + 1, '&', '\0', len) : 0;
+}
+
+/*
+A PUT of `b` to `path`: header, Uri-Path, Content-Format text/plain,
+Uri-Query and the bproto payload.
+*/
+static size_t pybproto_coap_put_write(uint8_t *out, size_t cap, int type, uint16_t mid,
+				      const uint8_t *token, size_t tkl, const char *path,
+				      bproto_t *b) {
+  unsigned last = 0;
+  size_t i = pybproto_coap_header(out, cap, type, PYBPROTO_COAP_PUT, mid, token, tkl), n;
+  if (i == 0) {
+    return 0;
+  }
+  if (pybproto_coap_path(out + i, cap - i, &last, path, &n) < 0) {
+    return 0;
+  }
+  i += n;
+  // text/plain is content format 0, encoded as an empty option
+  if ((n = pybproto_coap_option(out + i, cap - i, &last,
+				PYBPROTO_COAP_OPTION_CONTENT_FORMAT, NULL, 0)) == 0) {
+    return 0;
+  }
+  i += n;
+  if (pybproto_coap_query(out + i, cap - i, &last, path, &n) < 0) {
+    return 0;
+  }
+  i += n;
+
+  if (!bproto_is_set(b)) {
+    return i;
+  }
+  if (cap - i < 1) {
+    return 0;
+  }
+  out[i++] = PYBPROTO_COAP_PAYLOAD_MARKER;
+  char *ptr = (char *)out + i;
+  int len = bproto_snprint(&ptr, cap - i, b);
+  return len > 0 ? i + len : 0;
+}
+
+typedef struct {
+  unsigned number;
+  const char *val;
+  Py_ssize_t len;
+} pybproto_coap_opt_t;
+
+static int pybproto_coap_token(PyObject *obj, uint8_t token[PYBPROTO_COAP_TOKEN_MAX], size_t *tkl) {
+  char *data;
+  Py_ssize_t len;
+  if (PyBytes_AsStringAndSize(obj, &data, &len) < 0) {
+    return -1;
+  }
+  if (len > PYBPROTO_COAP_TOKEN_MAX) {
+    PyErr_SetString(PyExc_ValueError, "token longer than 8 bytes");
+    return -1;
+  }
+  memcpy(token, data, len);
+  *tkl = len;
+  return 0;
+}
+
+static PyObject *pybproto_coap_encode(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+				      PyObject *kwnames) {
+  static const char *const kwlist[] = {"type", "code", "mid", "token", "options", "payload", NULL};
+  PyObject *argv[6];
+  int type = 0, code = 0;
+  unsigned short mid = 0;
+  PyObject *token_obj = NULL;
+  Py_buffer payload = { .buf = NULL, .len = 0 };
+  if (pybproto_unpack("coap_encode", args, nargs, kwnames, kwlist, 4, argv) < 0 ||
+      pybproto_arg_int(argv[0], "type", &type) < 0 ||
+      pybproto_arg_int(argv[1], "code", &code) < 0 ||
+      pybproto_arg_u16(argv[2], &mid) < 0 ||
+      pybproto_arg_type(argv[3], "token", pybproto_is_bytes, "bytes", &token_obj) < 0 ||
+      (argv[5] != NULL && PyObject_GetBuffer(argv[5], &payload, PyBUF_SIMPLE) < 0)) {
+    return NULL;
+  }
+  PyObject *options = argv[4];
+
+  PyObject *seq = NULL, *res = NULL;
+  uint8_t *out = NULL;
+  uint8_t token[PYBPROTO_COAP_TOKEN_MAX];
+  size_t tkl;
+  if (pybproto_coap_token(token_obj, token, &tkl) < 0) {
+    goto done;
+  }
+
+  // opts[] points into the option tuples, which the snapshot keeps alive
+  seq = options ? pybproto_tuple(options, "options must be a sequence") : PyTuple_New(0);
+  if (seq == NULL) {
+    goto done;
+  }
+  Py_ssize_t n = PyTuple_GET_SIZE(seq);
+  if (n > PYBPROTO_COAP_OPTIONS_MAX) {
+    PyErr_SetString(PyExc_ValueError, "too many options");
+    goto done;
+  }
+
+  pybproto_coap_opt_t opts[PYBPROTO_COAP_OPTIONS_MAX];
+  size_t cap = 4 + tkl + 1 + payload.len;
+  for (Py_ssize_t i = 0; i < n; i++) {
+    PyObject *number;
+    long val = 0;
+    if (!PyArg_ParseTuple(PyTuple_GET_ITEM(seq, i), "Oy#;options are (number, bytes) pairs",
+			  &number, &opts[i].val, &opts[i].len) ||
+	pybproto_arg_long(number, "option number", 0, PYBPROTO_COAP_OPTION_MAX, &val) < 0) {
+      goto done;
+    }
+    opts[i].number = val;
+    cap += 5 + opts[i].len;
+  }
+  // Options go out in ascending order; insertion sort keeps equal numbers in order
+  for (Py_ssize_t i = 1; i < n; i++) {
+    for (Py_ssize_t j = i; j > 0 && opts[j - 1].number > opts[j].number; j--) {
+      pybproto_coap_opt_t tmp = opts[j];
+      opts[j] = opts[j - 1];
+      opts[j - 1] = tmp;
+    }
+  }
+
+  if ((out = PyMem_Malloc(cap)) == NULL) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  unsigned last = 0;
+  size_t len = pybproto_coap_header(out, cap, type, code, mid, token, tkl);
+  for (Py_ssize_t i = 0; i < n; i++) {
+    size_t w = pybproto_coap_option(out + len, cap - len, &last, opts[i].number,
+				    (const uint8_t *)opts[i].val, opts[i].len);
+    if (w == 0) {
+      PyErr_SetString(PyExc_ValueError, "option too long");
+      goto done;
+    }
+    len += w;
+  }
+  if (payload.len > 0) {
+    out[len++] = PYBPROTO_COAP_PAYLOAD_MARKER;
+    memcpy(out + len, payload.buf, payload.len);
+    len += payload.len;
+  }
+  res = PyBytes_FromStringAndSize((char *)out, len);
+
+ done:
+  PyMem_Free(out);
+  Py_XDECREF(seq);
+  if (payload.buf != NULL) {
+    PyBuffer_Release(&payload);
+  }
+  return res;
+}
+
+/*
+Option delta or length from its nibble and extended bytes. Returns -1 if it
+is reserved or runs past `end`.
+*/
+static long pybproto_coap_read_ext(int nibble, const uint8_t **pos, const uint8_t *end) {
+  const uint8_t *p = *pos;
+  switch (nibble) {
+  case 13:
+    if (end - p < 1) {
+      return -1;
+    }
+    *pos = p + 1;
+    return p[0] + 13;
+  case 14:
+    if (end - p < 2) {
+      return -1;
+    }
+    *pos = p + 2;
+    return ((p[0] << 8) | p[1]) + 269;
+  case 15:
+    return -1;
+  default:
+    return nibble;
+  }
+}
+
+static PyObject *pybproto_coap_decode(PyObject *self, PyObject *arg) {
+  Py_buffer data;
+  if (PyObject_GetBuffer(arg, &data, PyBUF_SIMPLE) < 0) {
+    return NULL;
+  }
+
+  const uint8_t *buf = data.buf, *end = buf + data.len;
+  PyObject *options = NULL, *res = NULL;
+  const char *err = NULL;
+
+  if (data.len < 4 || buf[0] >> 6 != PYBPROTO_COAP_VERSION) {
+    err = "not a CoAP message";
+    goto done;
+  }
+  size_t tkl = buf[0] & 0x0f;
+  if (tkl > PYBPROTO_COAP_TOKEN_MAX || (size_t)data.len < 4 + tkl) {
+    err = "bad token length";
+    goto done;
+  }
+
+  if ((options = PyList_New(0)) == NULL) {
+    goto done;
+  }
+  const uint8_t *pos = buf + 4 + tkl;
+  unsigned number = 0;
+  while (pos < end && *pos != PYBPROTO_COAP_PAYLOAD_MARKER) {
+    int header = *pos++;
+    long delta = pybproto_coap_read_ext(header >> 4, &pos, end);
+    long length = delta < 0 ? -1 : pybproto_coap_read_ext(header & 0x0f, &pos, end);
+    if (length < 0 || end - pos < length) {
+      err = "truncated option";
+      goto done;
+    }
+    number += delta;
+    PyObject *opt = Py_BuildValue("(Iy#)", number, pos, (Py_ssize_t)length);
+    if (opt == NULL || PyList_Append(options, opt) < 0) {
+      Py_XDECREF(opt);
+      goto done;
+    }
+    Py_DECREF(opt);
+    pos += length;
+  }
+  const uint8_t *payload = pos < end ? pos + 1 : end;
+
+  PyObject *opts = PyList_AsTuple(options);
+  if (opts == NULL) {
+    goto done;
+  }
+  res = Py_BuildValue("(iiiy#Ny#)", (buf[0] >> 4) & 0x3, buf[1], (buf[2] << 8) | buf[3],
+		      buf + 4, (Py_ssize_t)tkl, opts, payload, (Py_ssize_t)(end - payload));
+
+ done:
+  if (err != NULL) {
+    PyErr_SetString(pybproto_state(self)->error, err);
+  }
+  Py_XDECREF(options);
+  PyBuffer_Release(&data);
+  return res;
+}
+
+static PyObject *pybproto_coap_put(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+				   PyObject *kwnames) {
+  static const char *const kwlist[] = {"mid", "token", "state", "path", "type", NULL};
+  PyObject *argv[5];
+  unsigned short mid = 0;
+  PyObject *token_obj = NULL, *dict = NULL;
+  const char *path = PYBPROTO_DEFAULT_PATH;
+  int type = PYBPROTO_COAP_CON;
+  if (pybproto_unpack("coap_put", args, nargs, kwnames, kwlist, 3, argv) < 0 ||
+      pybproto_arg_u16(argv[0], &mid) < 0 ||
+      pybproto_arg_type(argv[1], "token", pybproto_is_bytes, "bytes", &token_obj) < 0 ||
+      pybproto_arg_type(argv[2], "state", pybproto_is_dict, "dict", &dict) < 0 ||
+      pybproto_arg_str(argv[3], "path", &path) < 0 ||
+      pybproto_arg_int(argv[4], "type", &type) < 0) {
+    return NULL;
+  }
+
+  uint8_t token[PYBPROTO_COAP_TOKEN_MAX];
+  size_t tkl;
+  bproto_t b;
+  if (pybproto_coap_token(token_obj, token, &tkl) < 0 || pybproto_from_dict(self, dict, &b) < 0) {
+    return NULL;
+  }
+
+  uint8_t out[PYBPROTO_COAP_MAX_LEN];
+  size_t len = pybproto_coap_put_write(out, sizeof(out), type, mid, token, tkl, path, &b);
+  if (len == 0) {
+    PyErr_SetString(PyExc_ValueError, "datagram too long");
+    return NULL;
+  }
+  return PyBytes_FromStringAndSize((char *)out, len);
+}
+
+static PyObject *pybproto_coap_get(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+				   PyObject *kwnames) {
+  static const char *const kwlist[] = {"mid", "token", "path", "type", NULL};
+  PyObject *argv[4];
+  unsigned short mid = 0;
+  PyObject *token_obj = NULL;
+  const char *path = PYBPROTO_DEFAULT_PATH;
+  int type = PYBPROTO_COAP_CON;
+  if (pybproto_unpack("coap_get", args, nargs, kwnames, kwlist, 2, argv) < 0 ||
+      pybproto_arg_u16(argv[0], &mid) < 0 ||
+      pybproto_arg_type(argv[1], "token", pybproto_is_bytes, "bytes", &token_obj) < 0 ||
+      pybproto_arg_str(argv[2], "path", &path) < 0 ||
+      pybproto_arg_int(argv[3], "type", &type) < 0) {
+    return NULL;
+  }
+
+  uint8_t token[PYBPROTO_COAP_TOKEN_MAX];
+  size_t tkl;
+  if (pybproto_coap_token(token_obj, token, &tkl) < 0) {
+    return NULL;
+  }
+
+  uint8_t out[PYBPROTO_COAP_MAX_LEN];
+  unsigned last = 0;
+  size_t len = pybproto_coap_header(out, sizeof(out), type, PYBPROTO_COAP_GET, mid, token, tkl);
+  size_t n;
+  if (pybproto_coap_path(out + len, sizeof(out) - len, &last, path, &n) < 0) {
+    PyErr_SetString(PyExc_ValueError, "datagram too long");
+    return NULL;
+  }
+  len += n;
+  if (pybproto_coap_query(out + len, sizeof(out) - len, &last, path, &n) < 0) {
+    PyErr_SetString(PyExc_ValueError, "datagram too long");
+    return NULL;
+  }
+  return PyBytes_FromStringAndSize((char *)out, len + n);
+}
+
+static PyObject *pybproto_coap_put_batch(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+					 PyObject *kwnames) {
+  static const char *const kwlist[] = {"buf", "states", "mid", "token", "path", "type", NULL};
+  PyObject *argv[6];
+  Py_buffer buf;
+  unsigned short mid = 0;
+  unsigned long token;
+  const char *path = PYBPROTO_DEFAULT_PATH;
+  int type = PYBPROTO_COAP_CON;
+  if (pybproto_unpack("coap_put_batch", args, nargs, kwnames, kwlist, 4, argv) < 0 ||
+      pybproto_arg_u16(argv[2], &mid) < 0 ||
+      ((token = PyLong_AsUnsignedLongMask(argv[3])) == (unsigned long)-1 && PyErr_Occurred()) ||
+      pybproto_arg_str(argv[4], "path", &path) < 0 ||
+      pybproto_arg_int(argv[5], "type", &type) < 0 ||
+      PyObject_GetBuffer(argv[0], &buf, PyBUF_WRITABLE) < 0) {
+    return NULL;
+  }
+
+  PyObject *seq = NULL, *view = NULL, *list = NULL;
+  if ((seq = pybproto_tuple(argv[1], "states must be a sequence")) == NULL) {
+    goto done;
+  }
+  Py_ssize_t n = PyTuple_GET_SIZE(seq);
+
+  // Every datagram goes into `buf`, handed back as slices of one view of it
+  size_t *offsets = PyMem_Malloc((n + 1) * sizeof(size_t));
+  bproto_t *states = PyMem_Malloc(n * sizeof(bproto_t) + 1);
+  if (offsets == NULL || states == NULL) {
+    PyErr_NoMemory();
+    goto free_batch;
+  }
+  for (Py_ssize_t i = 0; i < n; i++) {
+    PyObject *dict = PyTuple_GET_ITEM(seq, i);
+    if (!PyDict_Check(dict)) {
+      PyErr_SetString(PyExc_TypeError, "states must be dicts");
+      goto free_batch;
+    }
+    if (pybproto_from_dict(self, dict, &states[i]) < 0) {
+      goto free_batch;
+    }
+  }
+
+  // The states are plain C from here on, so other threads can run meanwhile
+  uint8_t *out = buf.buf;
+  size_t cap = buf.len, len = 0;
+  Py_ssize_t written = 0;
+  offsets[0] = 0;
+  Py_BEGIN_ALLOW_THREADS
+  for (; written < n; written++) {
+    uint32_t tok = token + written;
+    uint8_t tok_bytes[4] = { tok >> 24, tok >> 16, tok >> 8, tok };
+    size_t w = pybproto_coap_put_write(out + len, cap - len, type, (uint16_t)(mid + written),
+				       tok_bytes, sizeof(tok_bytes), path, &states[written]);
+    if (w == 0) {
+      break;
+    }
+    len += w;
+    offsets[written + 1] = len;
+  }
+  Py_END_ALLOW_THREADS
+  if (written < n) {
+    PyErr_SetString(PyExc_ValueError, "buffer too small");
+    goto free_batch;
+  }
+
+  if ((view = PyMemoryView_FromObject(buf.obj)) == NULL ||
+      (list = PyList_New(n)) == NULL) {
+    goto free_batch;
+  }
+  for (Py_ssize_t i = 0; i < n; i++) {
+    PyObject *slice = PySequence_GetSlice(view, offsets[i], offsets[i + 1]);
+    if (slice == NULL) {
+      Py_CLEAR(list);
+      break;
+    }
+    PyList_SET_ITEM(list, i, slice);
+  }
+
+ free_batch:
+  PyMem_Free(offsets);
+  PyMem_Free(states);
+ done:
+  Py_XDECREF(view);
+  Py_XDECREF(seq);
+  PyBuffer_Release(&buf);
+  return list;
+}
@@ -0,0 +1,246 @@
+import asyncio
+import time
+import unittest
+
+import pybproto
+from blinken import coap, discovery
+from blinken.fleet import CoapError, Fleet
+
+
+class StubDevice(asyncio.DatagramProtocol):
+    """A blinken /led resource answering with piggybacked responses."""
+
+    transports = []
+
+    def __init__(self, delay=0.0, drop=0):
+        self.delay = delay
+        self.drop = drop
+        self.state = {}
+        self.scenes = {}
+        self.received = 0
+        self.version = 0
+        self.valid = 0
+        self.seq = None
+        self.responses = 0
+        self.payloads = []
+
+    def connection_made(self, transport):
+        self.transport = transport
+        StubDevice.transports.append(transport)
+
+    def datagram_received(self, data, addr):
+        self.received += 1
+        if self.drop > 0:
+            self.drop -= 1
+            return
+        req = coap.decode(data)
+        path = '/'.join(v.decode() for k, v in req.options
+                        if k == coap.OPTION_URI_PATH)
+        if path.startswith('scene/'):
+            res = self.scene(req, path)
+        elif path == 'stream':
+            res = self.stream(req)
+            if res is None:
+                return
+        elif req.code == coap.PUT:
+            try:
+                msg = pybproto.parse(req.payload.decode())
+                self.state.update((k, v) for k, v in msg.items() if v >= 0)
+                self.payloads.append(req.payload)
+                self.version += 1
+                res = coap.Message(coap.ACK, coap.CHANGED, req.mid, req.token)
+            except pybproto.error:
+                res = coap.Message(coap.ACK, coap.code(4, 0), req.mid, req.token)
+        else:
+            etag = self.version.to_bytes(4, 'big')
+            if coap.option(req, coap.OPTION_ETAG) == etag:
+                self.valid += 1
+                res = coap.Message(coap.ACK, coap.VALID, req.mid, req.token,
+                                   ((coap.OPTION_ETAG, etag),))
+            else:
+                res = coap.Message(coap.ACK, coap.CONTENT, req.mid, req.token,
+                                   ((coap.OPTION_ETAG, etag),),
+                                   pybproto.new(self.state).encode())
+        self.responses += 1
+        loop = asyncio.get_running_loop()
+        loop.call_later(self.delay, self.transport.sendto, coap.encode(res), addr)
+
+    def stream(self, req):
+        query = [v.decode() for k, v in req.options if k == coap.OPTION_URI_QUERY]
+        seq = int(query[0][2:])
+        if self.seq is None or (seq - self.seq) & 0xffffffff < 0x80000000 and seq != self.seq:
+            self.seq = seq
+            msg = pybproto.parse(req.payload.decode())
+            self.state.update((k, v) for k, v in msg.items() if v >= 0)
+        if req.type == coap.NON:
+            return None
+        return coap.Message(coap.ACK, coap.CHANGED, req.mid, req.token)
+
+    def scene(self, req, path):
+        if req.code == coap.PUT:
+            self.scenes[path] = req.payload.decode()
+            return coap.Message(coap.ACK, coap.CHANGED, req.mid, req.token)
+        if path not in self.scenes:
+            return coap.Message(coap.ACK, coap.code(4, 4), req.mid, req.token)
+        msg = pybproto.parse(self.scenes[path])
+        self.state.update((k, v) for k, v in msg.items() if v >= 0)
+        return coap.Message(coap.ACK, coap.CHANGED, req.mid, req.token)
+
+
+async def start_devices(n, **kwargs):
+    loop = asyncio.get_running_loop()
+    devices = []
+    for _ in range(n):
+        transport, proto = await loop.create_datagram_endpoint(
+            lambda: StubDevice(**kwargs), local_addr=('127.0.0.1', 0))
+        devices.append((transport.get_extra_info('sockname'), proto))
+    return devices
+
+
+def run(coro):
+    loop = asyncio.new_event_loop()
+    try:
+        return loop.run_until_complete(coro)
+    finally:
+        for transport in StubDevice.transports:
+            transport.close()
+        StubDevice.transports = []
+        loop.run_until_complete(asyncio.sleep(0))
+        loop.close()
+
+
+class CoapCodecTest(unittest.TestCase):
+    def test_roundtrip(self):
+        msg = coap.Message(coap.CON, coap.PUT, 0xbeef, b'\x01\x02',
+                           coap.path_options('/led') +
+                           ((coap.OPTION_CONTENT_FORMAT, b''), (300, b'x' * 20)),
+                           b'R1')
+        self.assertEqual(coap.decode(coap.encode(msg)), msg)
+
+    def test_decode_truncated(self):
+        with self.assertRaises(coap.DecodeError):
+            coap.decode(b'\x40\x01')
+
+
+class DiscoveryTest(unittest.TestCase):
+    def test_resolve(self):
+        inst = 'blinken._blinken._udp.local'
+        records = [(discovery.SERVICE, discovery.TYPE_PTR, inst),
+                   (inst, discovery.TYPE_SRV, (5683, 'blinken.local')),
+                   ('blinken.local', discovery.TYPE_A, '10.0.0.2')]
+        self.assertEqual(discovery.resolve(records),
+                         [discovery.Device(inst, '10.0.0.2', 5683, {})])
+
+
+class FleetTest(unittest.TestCase):
+    def test_put_get(self):
+        async def go():
+            [(addr, dev)] = await start_devices(1)
+            async with Fleet() as fleet:
+                await fleet.put(addr, {'red': 10, 'time': 100})
+                return await fleet.get(addr), dev
+        state, dev = run(go())
+        self.assertEqual(state['red'], 10)
+        self.assertEqual(state['time'], 100)
+
+    def test_get_etag(self):
+        async def go():
+            [(addr, dev)] = await start_devices(1)
+            async with Fleet() as fleet:
+                await fleet.put(addr, {'red': 10})
+                states = [await fleet.get(addr), await fleet.get(addr)]
+                await fleet.put(addr, {'red': 20})
+                states.append(await fleet.get(addr))
+                return states, dev
+        states, dev = run(go())
+        self.assertEqual([s['red'] for s in states], [10, 10, 20])
+        self.assertEqual(dev.valid, 1)
+
+    def test_diff(self):
+        async def go():
+            devs = await start_devices(3)
+            state = {'red': 10, 'green': 20, 'blue': 30, 'white': 0, 'time': 50}
+            async with Fleet() as fleet:
+                await fleet.apply({addr: state for addr, _ in devs}, diff=True)
+                res = await fleet.apply({addr: dict(state, blue=i)
+                                         for i, (addr, _) in enumerate(devs, 29)},
+                                        diff=True)
+                await fleet.update(devs[0][0], dict(state, red=11, blue=29))
+            return res, devs
+        res, devs = run(go())
+        self.assertIsNone(res[devs[1][0]])
+        self.assertEqual(devs[0][1].payloads[1:], [b'B29T50', b'R11T50'])
+        self.assertEqual(len(devs[1][1].payloads), 1)
+        self.assertEqual(devs[0][1].state['red'], 11)
+
+    def test_stream(self):
+        async def go():
+            devs = await start_devices(2)
+            async with Fleet() as fleet:
+                for i in range(10):
+                    fleet.stream({addr: {'red': i} for addr, _ in devs})
+                # A frame from before the last one arrives late
+                late = pybproto.coap_put(0, b'', {'red': 99},
+                                         'stream?s=%d' % (fleet._stream_seq - 1), coap.NON)
+                fleet.transport.sendto(late, devs[0][0])
+                await asyncio.sleep(0.05)
+            return devs
+        devs = run(go())
+        self.assertTrue(all(d.state == {'red': 9} for _, d in devs))
+        self.assertTrue(all(d.responses == 0 for _, d in devs))
+
+    def test_pipelined_fleet(self):
+        # 100 devices, 50ms each: sequential would take 5s.
+        async def go():
+            devs = await start_devices(100, delay=0.05)
+            async with Fleet() as fleet:
+                start = time.monotonic()
+                res = await fleet.apply({addr: {'green': 1} for addr, _ in devs})
+                return time.monotonic() - start, res, devs
+        elapsed, res, devs = run(go())
+        self.assertLess(elapsed, 1.0)
+        self.assertTrue(all(r.code == coap.CHANGED for r in res.values()))
+        self.assertTrue(all(d.state == {'green': 1} for _, d in devs))
+
+    def test_inflight_limit(self):
+        async def go():
+            [(addr, dev)] = await start_devices(1, delay=0.05)
+            async with Fleet(max_inflight=2) as fleet:
+                start = time.monotonic()
+                await asyncio.gather(*(fleet.put(addr, {'blue': i})
+                                       for i in range(4)))
+                return time.monotonic() - start
+        self.assertGreaterEqual(run(go()), 0.1)
+
+    def test_retransmit(self):
+        async def go():
+            [(addr, dev)] = await start_devices(1, drop=2)
+            async with Fleet(ack_timeout=0.02) as fleet:
+                await fleet.put(addr, {'white': 3})
+            return dev
+        dev = run(go())
+        self.assertEqual(dev.received, 3)
+        self.assertEqual(dev.state, {'white': 3})
+
+    def test_scenes(self):
+        async def go():
+            devs = await start_devices(3)
+            addrs = [addr for addr, _ in devs]
+            async with Fleet() as fleet:
+                for addr in addrs:
+                    await fleet.store_scene(addr, 2, {'red': 7, 'time': 300})
+                res = await fleet.recall(2, addrs)
+                missing = await fleet.recall(3, addrs[:1])
+                return res, missing, devs
+        res, missing, devs = run(go())
+        self.assertTrue(all(r.code == coap.CHANGED for r in res.values()))
+        self.assertTrue(all(d.state == {'red': 7, 'time': 300} for _, d in devs))
+        self.assertIsInstance(list(missing.values())[0], CoapError)
+
+    def test_timeout(self):
+        async def go():
+            [(addr, dev)] = await start_devices(1, drop=100)
+            async with Fleet(ack_timeout=0.01, max_retransmit=2) as fleet:
+                await fleet.put(addr, {'white': 3})
+        with self.assertRaises(CoapError):
+            run(go())
@@ -13,3 +13,248 @@ class PybprotoParseTest( unittest.TestCase ):
     def test_print_red( self ):
         self.assertEqual(pybproto.new({'red': 100}), 'R100')
 
+    def test_ease( self ):
+        self.assertEqual(pybproto.new({'red': 1, 'time': 100, 'ease': 3}), 'R1T100E3')
+        self.assertEqual(pybproto.parse('R1T100E3')['ease'], 3)
+        self.assertEqual(pybproto.parse('R1')['ease'], -1)
+
+    def test_new_invalid( self ):
+        with self.assertRaisesRegex(pybproto.error, "Value out of range: '256'"):
+            pybproto.new({'red': 256})
+        with self.assertRaisesRegex(pybproto.error, "Unknown easing curve: '99'"):
+            pybproto.new({'red': 1, 'time': 100, 'ease': 99})
+        with self.assertRaisesRegex(pybproto.error, "Invalid numeric value in 'green'"):
+            pybproto.new({'green': 'x'})
+        # Still a ValueError for callers that catch that
+        with self.assertRaises(ValueError):
+            pybproto.new({'time': -5})
+
+
+class PybprotoDiffTest( unittest.TestCase ):
+    def test_diff( self ):
+        old = {'red': 10, 'green': 20, 'blue': 30, 'white': 0, 'time': 100}
+        self.assertEqual(pybproto.diff(old, dict(old, green=21)),
+                         {'green': 21, 'time': 100})
+        self.assertEqual(pybproto.diff(old, dict(old, time=500)), {})
+        self.assertEqual(pybproto.diff({}, {'red': 1, 'ease': 3}), {'red': 1, 'ease': 3})
+
+    def test_diff_batch( self ):
+        olds = [{'red': i} for i in range(10)]
+        news = [{'red': i // 2 * 2} for i in range(10)]
+        self.assertEqual(pybproto.diff_batch(olds, news),
+                         [pybproto.diff(o, n) for o, n in zip(olds, news)])
+        with self.assertRaises(ValueError):
+            pybproto.diff_batch(olds, news[1:])
+
+    def test_diff_batch_mutated( self ):
+        # __index__ in an old state empties the news list mid-batch
+        news = []
+        class Red:
+            def __index__( self ):
+                news.clear()
+                return 1
+        olds = [{'red': Red()} for i in range(4)]
+        news.extend({'red': 2} for i in range(4))
+        self.assertEqual(pybproto.diff_batch(olds, news), [{'red': 2}] * 4)
+
+
+class PybprotoFadeTest( unittest.TestCase ):
+    def test_fade_render( self ):
+        keys = [(100, {'red': 255, 'time': 1000}), (600, {'blue': 10})]
+        out = pybproto.fade_render(keys, range(0, 2000, 50))
+        self.assertEqual(len(out), 40)
+        self.assertEqual(out[0], (0, 0, 0, 0))
+        self.assertEqual(out[-1], (1023, 0, 40, 0))
+        reds = [r for r, g, b, w in out]
+        self.assertEqual(reds, sorted(reds))
+        self.assertTrue(0 < reds[6] < 1023)
+        self.assertEqual([b for r, g, b, w in out[:12]], [0] * 12)
+
+    def test_fade_render_ease( self ):
+        keys = [(0, {'red': 255, 'time': 1000})]
+        eased = [(0, {'red': 255, 'time': 1000, 'ease': 1})]
+        self.assertLess(pybproto.fade_render(eased, [250])[0][0],
+                        pybproto.fade_render(keys, [250])[0][0])
+        # 1000 cycles over 255 steps: the hardware steps every 3 cycles, ahead of time
+        self.assertEqual(pybproto.fade_render(keys, [250], max_duty=255, pwm_hz=1000)[0][0], 83)
+
+    def test_fade_render_invalid( self ):
+        with self.assertRaises(ValueError):
+            pybproto.fade_render([], [10, 5])
+        with self.assertRaises(ValueError):
+            pybproto.fade_render([(10, {}), (5, {})], [0])
+        with self.assertRaises(TypeError):
+            pybproto.fade_render([(10, 'R1')], [0])
+
+    def test_fade_render_mutated( self ):
+        # __index__ empties the lists while fade_render walks them
+        keys, times = [], []
+        class At:
+            def __index__( self ):
+                keys.clear()
+                return 0
+        class Time:
+            def __index__( self ):
+                times.clear()
+                return 2000
+        keys.extend([(At(), {'red': 255}), (At(), {'red': 255, 'blue': 10})])
+        times.extend(Time() for i in range(4))
+        self.assertEqual(pybproto.fade_render(keys, times),
+                         pybproto.fade_render([(0, {'red': 255, 'blue': 10})], [2000] * 4))
+
+
+class PybprotoColorTest( unittest.TestCase ):
+    def test_hsv_primaries( self ):
+        self.assertEqual(pybproto.hsv(0, 255, 255),
+                         {'red': 255, 'green': 0, 'blue': 0, 'white': 0})
+        self.assertEqual(pybproto.hsv(120, 255, 255)['green'], 255)
+        self.assertEqual(pybproto.hsv(240, 255, 100)['blue'], 100)
+
+    def test_hsv_white( self ):
+        self.assertEqual(pybproto.hsv(0, 0, 200, white=True),
+                         {'red': 0, 'green': 0, 'blue': 0, 'white': 200})
+
+    def test_hsv_batch( self ):
+        hues = [i * 360.0 / 500 for i in range(500)]
+        res = pybproto.hsv_batch(hues, 255, 255)
+        self.assertEqual(len(res), 500)
+        self.assertEqual(res[0], pybproto.hsv(0, 255, 255))
+        self.assertEqual(res[250], pybproto.hsv(180, 255, 255))
+
+    def test_hsv_batch_mutated( self ):
+        # __float__ empties the list while hsv_batch is still walking it
+        hues = []
+        class Hue:
+            def __float__( self ):
+                hues.clear()
+                return 120.0
+        hues.extend(Hue() for i in range(8))
+        res = pybproto.hsv_batch(hues, 255, 255, False)
+        self.assertEqual(res, [pybproto.hsv(120, 255, 255)] * 8)
+
+    def test_hsv_hue_edges( self ):
+        # -1e-20 is a full turn once wrapped and must land back on red
+        self.assertEqual(pybproto.hsv(-1e-20, 255, 255), pybproto.hsv(0, 255, 255))
+        self.assertEqual(pybproto.hsv_batch([-1e-20], 255, 255), [pybproto.hsv(0, 255, 255)])
+        for hue in (float('nan'), float('inf'), float('-inf')):
+            with self.assertRaises(ValueError):
+                pybproto.hsv(hue, 255, 255)
+            with self.assertRaises(ValueError):
+                pybproto.hsv_batch([0, hue], 255, 255)
+
+    def test_kelvin_range( self ):
+        for temp in (70000, 65536 + 4464, -5, 999, 12001):
+            with self.assertRaises(OverflowError):
+                pybproto.kelvin(temp, 255)
+        self.assertEqual(pybproto.kelvin(1000, 255), pybproto.kelvin(temp=1000, level=255))
+
+    def test_kelvin( self ):
+        self.assertEqual(pybproto.kelvin(6600, 255),
+                         {'red': 255, 'green': 255, 'blue': 255, 'white': 0})
+        warm = pybproto.kelvin(2000, 255, white=True)
+        self.assertGreater(warm['red'], warm['blue'])
+        self.assertEqual(pybproto.new(warm), 'R%dG%dB%dW%d' % (
+            warm['red'], warm['green'], warm['blue'], warm['white']))
+
+
+class PybprotoCoapTest( unittest.TestCase ):
+    # CON PUT, MID 0x1234, token 01 02, Uri-Path "led", Content-Format 0, "R10"
+    PUT = b'\x42\x03\x12\x34\x01\x02\xb3led\x10\xffR10'
+
+    def test_put( self ):
+        self.assertEqual(pybproto.coap_put(0x1234, b'\x01\x02', {'red': 10}), self.PUT)
+
+    def test_get( self ):
+        self.assertEqual(pybproto.coap_get(1, b'', path='scene/3', type=1),
+                         b'\x50\x01\x00\x01\xb5scene\x013')
+
+    def test_query( self ):
+        data = pybproto.coap_put(1, b'', {'red': 1}, 'stream?s=42&x', 1)
+        self.assertEqual(pybproto.coap_decode(data)[4],
+                         ((11, b'stream'), (12, b''), (15, b's=42'), (15, b'x')))
+        self.assertEqual(pybproto.coap_get(1, b'', path='?a')[4:], b'\xd1\x02a')
+
+    def test_encode_decode( self ):
+        opts = ((12, b''), (11, b'led'), (300, b'x' * 20))
+        data = pybproto.coap_encode(0, 3, 0x1234, b'\x01\x02', opts, b'R10')
+        self.assertEqual(data[:len(self.PUT) - 4], self.PUT[:-4])
+        self.assertEqual(pybproto.coap_decode(data),
+                         (0, 3, 0x1234, b'\x01\x02', tuple(sorted(opts)), b'R10'))
+        self.assertEqual(pybproto.coap_decode(self.PUT)[5], b'R10')
+
+    def test_encode_option_range( self ):
+        self.assertEqual(pybproto.coap_decode(pybproto.coap_encode(0, 1, 1, b'', [(65535, b'')]))[4],
+                         ((65535, b''),))
+        for number in (65536, 2**32 + 11, -1):
+            with self.assertRaises(OverflowError):
+                pybproto.coap_encode(0, 1, 1, b'', [(number, b'')])
+
+    def test_encode_mutated( self ):
+        # __index__ empties the options list while coap_encode walks it
+        opts = []
+        class Number:
+            def __index__( self ):
+                opts.clear()
+                return 11
+        opts.extend([(Number(), bytes(b'led')), (Number(), bytes(b'x' * 20))])
+        self.assertEqual(pybproto.coap_encode(0, 3, 1, b'', opts),
+                         pybproto.coap_encode(0, 3, 1, b'', [(11, b'led'), (11, b'x' * 20)]))
+
+    def test_decode_invalid( self ):
+        for data in (b'', b'\x40\x01', b'\x49\x01\x00\x00', b'\x40\x01\x00\x00\xd5'):
+            with self.assertRaises(pybproto.error):
+                pybproto.coap_decode(data)
+
+    def test_put_batch( self ):
+        buf = bytearray(4096)
+        states = [{'red': i} for i in range(100)]
+        views = pybproto.coap_put_batch(buf, states, 0xfffe, 7)
+        self.assertEqual(len(views), 100)
+        for i, view in enumerate(views):
+            self.assertEqual(bytes(view), pybproto.coap_put(
+                (0xfffe + i) & 0xffff, (7 + i).to_bytes(4, 'big'), states[i]))
+        with self.assertRaises(ValueError):
+            pybproto.coap_put_batch(bytearray(64), states, 0, 0)
+        with self.assertRaises(ValueError):
+            pybproto.coap_put_batch(buf, [{'red': 256}], 0, 0)
+
+    def test_put_batch_mutated( self ):
+        # __index__ empties the states list while coap_put_batch walks it
+        states = []
+        class Red:
+            def __index__( self ):
+                states.clear()
+                return 10
+        states.extend({'red': Red()} for i in range(4))
+        views = pybproto.coap_put_batch(bytearray(256), states, 0, 0)
+        self.assertEqual(bytes(views[3]), pybproto.coap_put(3, (3).to_bytes(4, 'big'),
+                                                            {'red': 10}))
+
+
+class PybprotoCallTest( unittest.TestCase ):
+    def test_keywords( self ):
+        self.assertEqual(pybproto.hsv(hue=0, val=255, sat=255), pybproto.hsv(0, 255, 255))
+        self.assertEqual(pybproto.coap_put(0x1234, b'\x01\x02', state={'red': 10}),
+                         PybprotoCoapTest.PUT)
+
+    def test_bad_arguments( self ):
+        for call in (lambda: pybproto.hsv(0, 255),
+                     lambda: pybproto.hsv(0, 255, 255, False, 1),
+                     lambda: pybproto.hsv(0, 255, 255, hue=1),
+                     lambda: pybproto.kelvin(2700, 255, bright=True),
+                     lambda: pybproto.coap_get(1, 'token'),
+                     lambda: pybproto.coap_put(1, b'', [])):
+            with self.assertRaises(TypeError):
+                call()
+        with self.assertRaises(OverflowError):
+            pybproto.hsv(0, 256, 255)
+
+    def test_threads( self ):
+        from concurrent.futures import ThreadPoolExecutor
+        states = [{'red': i % 256, 'time': i} for i in range(1000)]
+        def encode(mid):
+            return [bytes(v) for v in
+                    pybproto.coap_put_batch(bytearray(65536), states, mid, 0)]
+        with ThreadPoolExecutor(4) as pool:
+            results = list(pool.map(encode, [0] * 8))
+        self.assertTrue(all(r == results[0] for r in results))
@@ -2,7 +2,9 @@ from setuptools import setup, find_packages, Extension
 
 pybproto = Extension('pybproto',
                      include_dirs = ['./lib/include'],
-                     sources = ['python/src/pybproto.c', './lib/bproto.c'],
+                     sources = ['python/src/pybproto.c', './lib/bproto.c',
+                                './lib/bproto_color.c', './lib/bproto_ease.c',
+                                './lib/bproto_fade.c'],
                      )
 
 setup (name = 'pybproto',
@@ -12,4 +14,6 @@ setup (name = 'pybproto',
        version = '1.0',
        description = 'Python bindings for bproto used in blinken',
        test_suite = "python.test.pybproto_test",
+       packages = ['blinken'],
+       package_dir = {'blinken': 'python/blinken'},
        ext_modules = [pybproto])
@@ -1,9 +1,26 @@
 #define _GNU_SOURCE
+#include <fcntl.h>
+#include <pty.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
 
 #include "bproto.h"
+#include "bproto_color.h"
+#include "bproto_dmx.h"
+#include "bproto_ease.h"
+#include "bproto_fade.h"
+#include "bproto_ledc.h"
+#include "bproto_loop.h"
+#include "bproto_packed.h"
+#include "bproto_par.h"
+#include "bproto_pool.h"
+#include "bproto_rate.h"
+#include "bproto_rec.h"
+#include "bproto_stream.h"
 #include "bproto_internal.h"
 
 #include <check.h>
@@ -24,14 +41,16 @@
   ck_assert_int_eq(b.green, BPROTO_VALUE_UNSET);		   \
   ck_assert_int_eq(b.blue,  BPROTO_VALUE_UNSET);		   \
   ck_assert_int_eq(b.white, BPROTO_VALUE_UNSET);		   \
-  ck_assert_int_eq(b.time,  BPROTO_TIME_UNSET);
+  ck_assert_int_eq(b.time,  BPROTO_TIME_UNSET);		   \
+  ck_assert_int_eq(b.ease,  BPROTO_EASE_UNSET);
 
 #define TEST_BPROTO_ASSERT_EQ(x, y)					\
   ck_assert(x.red   == y.red   || x.red   == BPROTO_VALUE_UNSET);	\
   ck_assert(x.green == y.green || x.green == BPROTO_VALUE_UNSET);	\
   ck_assert(x.blue  == y.blue  || x.blue  == BPROTO_VALUE_UNSET);	\
   ck_assert(x.white == y.white || x.white == BPROTO_VALUE_UNSET);	\
-  ck_assert(x.time  == y.time  || x.time  == BPROTO_TIME_UNSET);
+  ck_assert(x.time  == y.time  || x.time  == BPROTO_TIME_UNSET);	\
+  ck_assert(x.ease  == y.ease  || x.ease  == BPROTO_EASE_UNSET);
 
 #define TEST_ASSERT(x) ck_assert(x)
 #define TEST_ASSERT_FALSE(x) TEST_ASSERT(!(x))
@@ -53,6 +72,33 @@ START_TEST(test_bproto_copy)
 }
 END_TEST
 
+START_TEST(test_bproto_channels)
+{
+  bproto_t b;
+  bproto_value_t vals[BPROTO_CHANNEL_COUNT], got[BPROTO_CHANNEL_COUNT];
+  ck_assert_int_eq(BPROTO_CHANNEL_COUNT, 4);
+
+  bproto_init(&b);
+  bproto_channels(&b, got);
+  for (int i = 0; i < BPROTO_CHANNEL_COUNT; i++) {
+    ck_assert_int_eq(got[i], BPROTO_VALUE_UNSET);
+    vals[i] = 10 * (i + 1);
+  }
+
+  // Table order is field order
+  bproto_set_channels(&b, vals);
+  ck_assert_int_eq(b.red, 10);
+  ck_assert_int_eq(b.green, 20);
+  ck_assert_int_eq(b.blue, 30);
+  ck_assert_int_eq(b.white, 40);
+  ck_assert_int_eq(b.time, BPROTO_TIME_UNSET);
+  bproto_channels(&b, got);
+  for (int i = 0; i < BPROTO_CHANNEL_COUNT; i++) {
+    ck_assert_int_eq(got[i], vals[i]);
+  }
+}
+END_TEST
+
 START_TEST(test_bproto_field_parse_null)
 {
   char raw = '\0';
@@ -64,18 +110,19 @@ END_TEST
 
 START_TEST(test_bproto_field_parse)
 {
-  bproto_field_t chs[5] = {
+  bproto_field_t chs[6] = {
     BPROTO_FIELD_RED,
     BPROTO_FIELD_GREEN,
     BPROTO_FIELD_BLUE,
     BPROTO_FIELD_WHITE,
     BPROTO_FIELD_TIME,
+    BPROTO_FIELD_EASE,
   };
 
   char raw[2];
   raw[1] = '\0';
 
-  for (int i = 0; i < 5; i++) {
+  for (int i = 0; i < 6; i++) {
     raw[0] = (char) chs[i];
     
     bproto_field_t res_ch;
@@ -110,6 +157,1331 @@ START_TEST(test_bproto_digit_parse) {
 }
 END_TEST
 
+START_TEST(test_bproto_parse)
+{
+  bproto_t b;
+  const char *raw = "R255G0B010W1T2147483647";
+  char *res = bproto_parse(&b, raw);
+  ck_assert(res == raw + strlen(raw));
+  ck_assert_int_eq(b.red, 255);
+  ck_assert_int_eq(b.green, 0);
+  ck_assert_int_eq(b.blue, 10);
+  ck_assert_int_eq(b.white, 1);
+  ck_assert_int_eq(b.time, BPROTO_TIME_T_MAX);
+  ck_assert_int_eq(b.ease, BPROTO_EASE_UNSET);
+
+  ck_assert(bproto_parse(&b, "R1T500E3") != NULL);
+  ck_assert_int_eq(b.ease, BPROTO_EASE_SINE);
+
+  const char *invalid[] = { "", "R", "R256", "T2147483648", "1", "RG1", "R1X", "R1\n", "r1", "E4", "E" };
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    ck_assert(bproto_parse(&b, invalid[i]) == invalid[i]);
+  }
+}
+END_TEST
+
+START_TEST(test_bproto_snprint_ease)
+{
+  bproto_t b, c;
+  char buf[32], *ptr = buf;
+  bproto_init(&b);
+  b.red = 10;
+  b.time = 250;
+  b.ease = BPROTO_EASE_OUT;
+  int len = bproto_snprint(&ptr, sizeof(buf) - 1, &b);
+  buf[len] = '\0';
+  ck_assert_str_eq(buf, "R10T250E2");
+  ck_assert(bproto_parse(&c, buf) == buf + len);
+  ck_assert(bproto_eq(&b, &c));
+
+  b.ease = BPROTO_EASES;
+  ptr = buf;
+  ck_assert_int_eq(bproto_snprint(&ptr, sizeof(buf), &b), 0);
+}
+END_TEST
+
+START_TEST(test_bproto_ease)
+{
+  for (int e = 0; e < BPROTO_EASES; e++) {
+    ck_assert_int_eq(bproto_ease(e, 0), 0);
+    ck_assert_int_eq(bproto_ease(e, BPROTO_EASE_ONE), BPROTO_EASE_ONE);
+
+    // Monotonic, so chained segments never reverse
+    bproto_progress_t prev = 0;
+    for (uint32_t t = 0; t <= BPROTO_EASE_ONE; t += 97) {
+      bproto_progress_t cur = bproto_ease(e, t);
+      ck_assert_int_ge(cur, prev);
+      prev = cur;
+    }
+  }
+
+  bproto_progress_t half = BPROTO_EASE_ONE / 2;
+  ck_assert_int_eq(bproto_ease(BPROTO_EASE_LINEAR, half), half);
+  ck_assert_int_lt(bproto_ease(BPROTO_EASE_IN, half), half);
+  ck_assert_int_gt(bproto_ease(BPROTO_EASE_OUT, half), half);
+  ck_assert_int_lt(bproto_ease(BPROTO_EASE_SINE, half / 2), half / 2);
+  ck_assert_int_gt(bproto_ease(BPROTO_EASE_SINE, half + half / 2), half + half / 2);
+  ck_assert_int_lt(abs((int)bproto_ease(BPROTO_EASE_SINE, half) - half), 64);
+}
+END_TEST
+
+START_TEST(test_bproto_fade)
+{
+  bproto_fade_cfg_t cfg = BPROTO_FADE_CFG_DEFAULT;
+  const uint32_t curs[] = { 0, 1, 500, 1023 };
+  const bproto_value_t vals[] = { 0, 1, 128, 255 };
+  const bproto_time_t times[] = { BPROTO_TIME_UNSET, 0, 1, 19, 40, 333, 1000, 60000 };
+
+  for (int c = 0; c < 4; c++) {
+    for (int v = 0; v < 4; v++) {
+      for (int t = 0; t < 8; t++) {
+	for (int e = 0; e < BPROTO_EASES; e++) {
+	  bproto_fade_t f;
+	  bproto_fade_plan(&f, &cfg, curs[c], vals[v], times[t], e);
+	  uint32_t to = bproto_fade_duty(&cfg, vals[v]);
+	  ck_assert_int_eq(f.to, to);
+	  ck_assert_int_le(f.segs, cfg.segments);
+
+	  // Ends on target, without overshooting on the way
+	  uint32_t lo = curs[c] < to ? curs[c] : to, hi = curs[c] < to ? to : curs[c];
+	  uint32_t end = times[t] > 0 ? times[t] : 0, prev = curs[c];
+	  for (uint32_t ms = 0; ms <= end; ms += end / 50 + 1) {
+	    uint32_t duty = bproto_fade_sample(&f, &cfg, ms);
+	    ck_assert_int_ge(duty, lo);
+	    ck_assert_int_le(duty, hi);
+	    ck_assert(to >= curs[c] ? duty >= prev : duty <= prev);
+	    prev = duty;
+	  }
+	  // Like the IDF, fast ramps round their scale down, taking up to twice as long
+	  uint32_t len = bproto_fade_length(&f, &cfg);
+	  ck_assert_int_le(len, 2 * end + 1);
+	  ck_assert_int_eq(bproto_fade_sample(&f, &cfg, len), to);
+	  if (len > 1 && to != curs[c]) {
+	    ck_assert_int_ne(bproto_fade_sample(&f, &cfg, len - 2), to);
+	  }
+	}
+      }
+    }
+  }
+
+  // An eased fade lags a linear one at first
+  bproto_fade_t lin, in;
+  bproto_fade_plan(&lin, &cfg, 0, 255, 1000, BPROTO_EASE_LINEAR);
+  bproto_fade_plan(&in, &cfg, 0, 255, 1000, BPROTO_EASE_IN);
+  ck_assert_int_eq(lin.segs, 1);
+  ck_assert_int_eq(in.segs, cfg.segments);
+  ck_assert_int_lt(bproto_fade_sample(&in, &cfg, 250), bproto_fade_sample(&lin, &cfg, 250));
+  // Slow ramps round their step time down instead, finishing early
+  ck_assert_int_gt(bproto_fade_sample(&lin, &cfg, 500), 511);
+  ck_assert_int_eq(bproto_fade_sample(&lin, &cfg, 1000), 1023);
+}
+END_TEST
+
+START_TEST(test_bproto_fade_render)
+{
+  bproto_fade_cfg_t cfg = BPROTO_FADE_CFG_DEFAULT;
+  bproto_keyframe_t keys[3];
+  for (int i = 0; i < 3; i++) {
+    bproto_init(&keys[i].msg);
+  }
+  keys[0].at = 100;
+  keys[0].msg.red = 255;
+  keys[0].msg.time = 1000;
+  keys[0].msg.ease = BPROTO_EASE_SINE;
+  keys[1].at = 600;                  // retarget red halfway, and set blue at once
+  keys[1].msg.red = 0;
+  keys[1].msg.blue = 10;
+  keys[1].msg.time = 200;
+  keys[2].at = 700;                  // same value again: the fade carries on
+  keys[2].msg.red = 0;
+
+  uint32_t ms[2000], out[2000][BPROTO_FADE_CHANNELS];
+  for (int i = 0; i < 2000; i++) {
+    ms[i] = i;
+  }
+  ck_assert_int_eq(bproto_fade_render(keys, 3, ms, 2000, &cfg, out), 2000);
+
+  bproto_fade_t up, down;
+  bproto_fade_plan(&up, &cfg, 0, 255, 1000, BPROTO_EASE_SINE);
+  uint32_t mid = bproto_fade_sample(&up, &cfg, 500);
+  bproto_fade_plan(&down, &cfg, mid, 0, 200, BPROTO_EASE_UNSET);
+  bproto_fade_t blue;
+  bproto_fade_plan(&blue, &cfg, 0, 10, 200, BPROTO_EASE_UNSET);
+
+  uint32_t batch[2][2000];
+  bproto_fade_t fades[2] = { up, down };
+  bproto_fade_sample_batch(fades, 2, ms, 2000, &cfg, batch[0]);
+
+  for (int i = 0; i < 2000; i++) {
+    uint32_t red = i < 100 ? 0 : i < 600 ? batch[0][i - 100] : batch[1][i - 600];
+    ck_assert_int_eq(out[i][0], red);
+    ck_assert_int_eq(out[i][1], 0);
+    ck_assert_int_eq(out[i][2], i < 600 ? 0 : bproto_fade_sample(&blue, &cfg, i - 600));
+    ck_assert_int_eq(out[i][3], 0);
+  }
+  ck_assert_int_eq(out[1999][2], bproto_fade_duty(&cfg, 10));
+  ck_assert_int_eq(out[650][0], bproto_fade_sample(&down, &cfg, 50));
+  ck_assert_int_eq(out[799][0], 0);
+
+  ms[10] = 5;
+  ck_assert_int_eq(bproto_fade_render(keys, 3, ms, 2000, &cfg, out), 10);
+}
+END_TEST
+
+START_TEST(test_bproto_parse_n)
+{
+  bproto_t b;
+  const char raw[] = { 'G', '1', '2', 'T', '5', 'X' };
+  ck_assert(bproto_parse_n(&b, raw, 5) == raw + 5);
+  ck_assert_int_eq(b.green, 12);
+  ck_assert_int_eq(b.time, 5);
+  ck_assert(bproto_parse_n(&b, raw, 6) == raw);
+  ck_assert(bproto_parse_n(&b, raw, 1) == raw);
+  ck_assert(bproto_parse_n(&b, "R1\0", 3) == (char *)"R1\0");
+}
+END_TEST
+
+START_TEST(test_bproto_validate)
+{
+  // Every short string over the grammar's alphabet agrees with the parser
+  const char alphabet[] = "RT09X";
+  char raw[6];
+  for (int len = 0; len < 6; len++) {
+    int combos = 1;
+    for (int i = 0; i < len; i++) {
+      combos *= 5;
+    }
+    for (int n = 0; n < combos; n++) {
+      for (int i = 0, x = n; i < len; i++, x /= 5) {
+	raw[i] = alphabet[x % 5];
+      }
+      raw[len] = '\0';
+
+      bproto_t b;
+      int parsed = bproto_parse(&b, raw) != raw;
+      ck_assert_int_eq(bproto_validate(raw), parsed);
+      ck_assert_int_eq(bproto_validate_n(raw, len), parsed);
+    }
+  }
+
+  ck_assert(bproto_validate("R999") == 0);
+  ck_assert(bproto_validate("R0009") == 1);
+}
+END_TEST
+
+typedef struct {
+  bproto_t msgs[8];
+  int n;
+} test_parser_out_t;
+
+static void test_parser_cb(bproto_t *b, void *ctx) {
+  test_parser_out_t *out = ctx;
+  if (out->n < 8) {
+    out->msgs[out->n] = *b;
+  }
+  out->n++;
+}
+
+START_TEST(test_bproto_parser_feed)
+{
+  test_parser_out_t out = { .n = 0 };
+  bproto_parser_t p;
+  bproto_parser_init(&p, test_parser_cb, &out);
+
+  const char *raw = "R255G0T1000\nW7\n";
+  size_t n = bproto_parser_feed(&p, raw, strlen(raw));
+
+  ck_assert_int_eq(n, 2);
+  ck_assert_int_eq(out.n, 2);
+  ck_assert_int_eq(p.errors, 0);
+  ck_assert_int_eq(out.msgs[0].red, 255);
+  ck_assert_int_eq(out.msgs[0].green, 0);
+  ck_assert_int_eq(out.msgs[0].blue, BPROTO_VALUE_UNSET);
+  ck_assert_int_eq(out.msgs[0].time, 1000);
+  ck_assert_int_eq(out.msgs[1].white, 7);
+  ck_assert_int_eq(out.msgs[1].red, BPROTO_VALUE_UNSET);
+}
+END_TEST
+
+START_TEST(test_bproto_parser_feed_bytewise)
+{
+  test_parser_out_t out = { .n = 0 };
+  bproto_parser_t p;
+  bproto_parser_init(&p, test_parser_cb, &out);
+
+  const char *raw = "\r\nB010T2147483647\r\n";
+  for (size_t i = 0; i < strlen(raw); i++) {
+    bproto_parser_feed(&p, raw + i, 1);
+  }
+
+  ck_assert_int_eq(out.n, 1);
+  ck_assert_int_eq(out.msgs[0].blue, 10);
+  ck_assert_int_eq(out.msgs[0].time, BPROTO_TIME_T_MAX);
+}
+END_TEST
+
+START_TEST(test_bproto_parser_feed_invalid)
+{
+  test_parser_out_t out = { .n = 0 };
+  bproto_parser_t p;
+  bproto_parser_init(&p, test_parser_cb, &out);
+
+  const char *raw = "R256\nX1\nR\nT2147483648\nG1\n";
+  bproto_parser_feed(&p, raw, strlen(raw));
+
+  ck_assert_int_eq(p.errors, 4);
+  ck_assert_int_eq(out.n, 1);
+  ck_assert_int_eq(out.msgs[0].green, 1);
+  ck_assert_int_eq(out.msgs[0].red, BPROTO_VALUE_UNSET);
+}
+END_TEST
+
+START_TEST(test_bproto_parser_finish)
+{
+  test_parser_out_t out = { .n = 0 };
+  bproto_parser_t p;
+  bproto_parser_init(&p, test_parser_cb, &out);
+
+  bproto_parser_feed(&p, "R1", 2);
+  ck_assert_int_eq(out.n, 0);
+  ck_assert_int_eq(bproto_parser_finish(&p), 1);
+  ck_assert_int_eq(out.n, 1);
+  ck_assert_int_eq(out.msgs[0].red, 1);
+  ck_assert_int_eq(bproto_parser_finish(&p), 0);
+}
+END_TEST
+
+START_TEST(test_bproto_hsv)
+{
+  bproto_t b;
+  bproto_init(&b);
+
+  bproto_hsv(&b, 0, 255, 255, BPROTO_WHITE_NONE);
+  ck_assert_int_eq(b.red, 255);
+  ck_assert_int_eq(b.green, 0);
+  ck_assert_int_eq(b.blue, 0);
+  ck_assert_int_eq(b.white, 0);
+  ck_assert_int_eq(b.time, BPROTO_TIME_UNSET);
+
+  bproto_hsv(&b, BPROTO_HUE_TURN / 3, 255, 128, BPROTO_WHITE_NONE);
+  ck_assert_int_eq(b.green, 128);
+  ck_assert_int_eq(b.red, 0);
+
+  bproto_hsv(&b, 0, 0, 200, BPROTO_WHITE_EXTRACT);
+  ck_assert_int_eq(b.red, 0);
+  ck_assert_int_eq(b.white, 200);
+}
+END_TEST
+
+START_TEST(test_bproto_hsv_batch)
+{
+  bproto_hue_t hue[64];
+  uint8_t sat[64], val[64];
+  bproto_t out[64], one;
+
+  for (int i = 0; i < 64; i++) {
+    hue[i] = i * 1024;
+    sat[i] = 255 - i;
+    val[i] = 4 * i;
+  }
+  bproto_hsv_batch(out, hue, sat, val, 64, BPROTO_WHITE_EXTRACT);
+
+  for (int i = 0; i < 64; i++) {
+    bproto_hsv(&one, hue[i], sat[i], val[i], BPROTO_WHITE_EXTRACT);
+    ck_assert(bproto_eq(&one, &out[i]));
+  }
+}
+END_TEST
+
+START_TEST(test_bproto_kelvin)
+{
+  bproto_t b;
+  bproto_kelvin(&b, 6600, 255, BPROTO_WHITE_NONE);
+  ck_assert_int_eq(b.red, 255);
+  ck_assert_int_eq(b.green, 255);
+  ck_assert_int_eq(b.blue, 255);
+
+  bproto_kelvin(&b, 100, 255, BPROTO_WHITE_NONE);
+  ck_assert_int_eq(b.red, 255);
+  ck_assert_int_eq(b.blue, 0);
+
+  bproto_kelvin(&b, 6600, 100, BPROTO_WHITE_EXTRACT);
+  ck_assert_int_eq(b.red, 0);
+  ck_assert_int_eq(b.white, 100);
+}
+END_TEST
+
+START_TEST(test_bproto_rec_roundtrip)
+{
+  char path[] = "/tmp/test_bproto_rec_XXXXXX";
+  int fd = mkstemp(path);
+  ck_assert_int_ge(fd, 0);
+  close(fd);
+
+  bproto_rec_writer_t w;
+  ck_assert_int_eq(bproto_rec_writer_open(&w, path), 0);
+  for (uint32_t i = 0; i < 100; i++) {
+    bproto_t b;
+    bproto_init(&b);
+    b.red = i;
+    if (i % 2) {
+      b.time = i * 10;
+      b.ease = i % BPROTO_EASES;
+    }
+    // 40 frames per second, with a gap between 2s and 3s
+    ck_assert_int_eq(bproto_rec_writer_add(&w, i * 25 + (i >= 80 ? 1000 : 0), &b), 0);
+  }
+  bproto_t late;
+  bproto_init(&late);
+  ck_assert_int_eq(bproto_rec_writer_add(&w, 0, &late), -1);
+  ck_assert_int_eq(bproto_rec_writer_close(&w), 0);
+
+  bproto_rec_t rec;
+  ck_assert_int_eq(bproto_rec_open(&rec, path), 0);
+  ck_assert_int_eq(rec.frame_count, 100);
+
+  bproto_t b;
+  bproto_rec_frame_unpack(&rec.frames[7], &b);
+  ck_assert_int_eq(b.red, 7);
+  ck_assert_int_eq(b.green, BPROTO_VALUE_UNSET);
+  ck_assert_int_eq(b.time, 70);
+  ck_assert_int_eq(b.ease, 7 % BPROTO_EASES);
+  bproto_rec_frame_unpack(&rec.frames[8], &b);
+  ck_assert_int_eq(b.time, BPROTO_TIME_UNSET);
+  ck_assert_int_eq(b.ease, BPROTO_EASE_UNSET);
+
+  ck_assert_int_eq(bproto_rec_seek(&rec, 0), 1);
+  ck_assert_int_eq(bproto_rec_seek(&rec, 1010), 41);
+  ck_assert_int_eq(bproto_rec_seek(&rec, 2500), 80);
+  ck_assert_int_eq(bproto_rec_seek(&rec, 3000), 81);
+  ck_assert_int_eq(bproto_rec_seek(&rec, 100000), 100);
+
+  bproto_rec_close(&rec);
+  unlink(path);
+}
+END_TEST
+
+START_TEST(test_bproto_rec_open_invalid)
+{
+  char path[] = "/tmp/test_bproto_rec_XXXXXX";
+  int fd = mkstemp(path);
+  ck_assert_int_ge(fd, 0);
+  char junk[64] = "not a recording";
+  ck_assert_int_eq(write(fd, junk, sizeof(junk)), sizeof(junk));
+  close(fd);
+
+  bproto_rec_t rec;
+  ck_assert_int_eq(bproto_rec_open(&rec, path), -1);
+
+  // Counts whose byte sizes wrap to offsets that fit the file
+  bproto_rec_header_t h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, BPROTO_REC_MAGIC, sizeof(h.magic));
+  h.version = BPROTO_REC_VERSION;
+  h.frame_size = sizeof(bproto_rec_frame_t);
+  h.interval = BPROTO_REC_INTERVAL;
+  h.byte_order = BPROTO_REC_BYTE_ORDER;
+  h.frame_count = UINT64_MAX / sizeof(bproto_rec_frame_t) + 1;
+  h.index_offset = sizeof(h) + h.frame_count * sizeof(bproto_rec_frame_t);
+  fd = open(path, O_WRONLY | O_TRUNC);
+  ck_assert_int_eq(write(fd, &h, sizeof(h)), sizeof(h));
+  close(fd);
+  ck_assert_int_eq(bproto_rec_open(&rec, path), -1);
+
+  h.frame_count = 0;
+  h.index_offset = sizeof(h);
+  h.index_len = 1;
+  fd = open(path, O_WRONLY | O_TRUNC);
+  ck_assert_int_eq(write(fd, &h, sizeof(h)), sizeof(h));
+  close(fd);
+  ck_assert_int_eq(bproto_rec_open(&rec, path), -1);
+
+  h.index_len = 0;
+  fd = open(path, O_WRONLY | O_TRUNC);
+  ck_assert_int_eq(write(fd, &h, sizeof(h)), sizeof(h));
+  close(fd);
+  ck_assert_int_eq(bproto_rec_open(&rec, path), 0);
+  ck_assert_int_eq(rec.frame_count, 0);
+  bproto_rec_close(&rec);
+
+  // Written on a host of the other byte order
+  h.byte_order = 0x04030201;
+  fd = open(path, O_WRONLY | O_TRUNC);
+  ck_assert_int_eq(write(fd, &h, sizeof(h)), sizeof(h));
+  close(fd);
+  ck_assert_int_eq(bproto_rec_open(&rec, path), -1);
+  unlink(path);
+}
+END_TEST
+
+/*
+A clock the loop tests move by hand, starting just short of a wrap.
+*/
+static uint32_t test_loop_ms;
+
+static uint32_t test_loop_clock(void) {
+  return test_loop_ms;
+}
+
+static void test_loop_count(bproto_timer_t *t, void *ctx) {
+  ++*(int *)ctx;
+}
+
+static void test_loop_periodic(bproto_timer_t *t, void *ctx) {
+  ++*(int *)ctx;
+  ck_assert_int_eq(bproto_timer_armed(t), 0);
+}
+
+static bproto_loop_t test_loop;
+
+static void test_loop_read(int fd, void *ctx) {
+  char c;
+  while (read(fd, &c, 1) == 1) {
+    ++*(int *)ctx;
+  }
+  bproto_loop_unwatch(&test_loop, fd);
+}
+
+START_TEST(test_bproto_loop_timers)
+{
+  test_loop_ms = UINT32_MAX - 100;
+  bproto_loop_init(&test_loop, test_loop_clock);
+
+  int soon = 0, later = 0, far = 0, stopped = 0, ticks = 0;
+  bproto_timer_t t_soon, t_later, t_far, t_stopped, t_tick;
+  bproto_timer_init(&t_soon, test_loop_count, &soon);
+  bproto_timer_init(&t_later, test_loop_count, &later);
+  bproto_timer_init(&t_far, test_loop_count, &far);
+  bproto_timer_init(&t_stopped, test_loop_count, &stopped);
+  bproto_timer_init(&t_tick, test_loop_periodic, &ticks);
+
+  bproto_timer_start(&test_loop, &t_soon, 5);
+  bproto_timer_start(&test_loop, &t_later, 300);
+  bproto_timer_start(&test_loop, &t_far, 10000); // many turns of the wheel
+  bproto_timer_start(&test_loop, &t_stopped, 5);
+  bproto_timer_stop(&t_stopped);
+  ck_assert(bproto_timer_armed(&t_far));
+  ck_assert(!bproto_timer_armed(&t_stopped));
+
+  ck_assert_int_eq(bproto_loop_run_once(&test_loop, 0), 0);
+  test_loop_ms += 4;
+  ck_assert_int_eq(bproto_loop_run_once(&test_loop, 0), 0);
+  test_loop_ms += 1;
+  ck_assert_int_eq(bproto_loop_run_once(&test_loop, 0), 1);
+  ck_assert_int_eq(soon, 1);
+
+  // Step through the wrap a ms at a time, rearming a periodic timer
+  for (int i = 0; i < 10000; i++) {
+    if (!bproto_timer_armed(&t_tick)) {
+      bproto_timer_start(&test_loop, &t_tick, 20);
+    }
+    test_loop_ms++;
+    bproto_loop_run_once(&test_loop, 0);
+    ck_assert_int_eq(later, i + 6 >= 300);
+    ck_assert_int_eq(far, i + 6 >= 10000);
+  }
+  ck_assert_int_eq(ticks, 10000 / 20);
+  ck_assert_int_eq(far, 1);
+  ck_assert_int_eq(stopped, 0);
+
+  // Long stalls fire everything due at once
+  bproto_timer_start(&test_loop, &t_soon, 1);
+  bproto_timer_start(&test_loop, &t_later, 100000);
+  bproto_timer_start(&test_loop, &t_far, 100001);
+  test_loop_ms += 100000;
+  ck_assert_int_eq(bproto_loop_run_once(&test_loop, 0), 2);
+  ck_assert_int_eq(soon, 2);
+  ck_assert_int_eq(later, 2);
+  ck_assert_int_eq(far, 1);
+  bproto_timer_stop(&t_far);
+}
+END_TEST
+
+START_TEST(test_bproto_loop_io)
+{
+  int fds[2], got = 0, timed = 0;
+  ck_assert_int_eq(pipe(fds), 0);
+  test_loop_ms = 0;
+  bproto_loop_init(&test_loop, test_loop_clock);
+
+  ck_assert_int_eq(bproto_loop_watch(&test_loop, -1, test_loop_read, &got), -1);
+  ck_assert_int_eq(bproto_loop_watch(&test_loop, fds[0], test_loop_read, &got), 0);
+  ck_assert_int_eq(bproto_loop_run_once(&test_loop, 0), 0);
+
+  ck_assert_int_eq(write(fds[1], "R1\n", 3), 3);
+  close(fds[1]);
+  ck_assert_int_eq(bproto_loop_run_once(&test_loop, 1000), 1);
+  ck_assert_int_eq(got, 3);
+  ck_assert_int_eq(test_loop.nio, 0);
+  ck_assert_int_eq(bproto_loop_unwatch(&test_loop, fds[0]), -1);
+  close(fds[0]);
+
+  // An armed timer bounds the wait, even with nothing to watch
+  bproto_timer_t t;
+  bproto_timer_init(&t, test_loop_count, &timed);
+  bproto_timer_start(&test_loop, &t, 1);
+  ck_assert_int_eq(bproto_loop_run_once(&test_loop, -1), 0);
+
+  for (int i = 0; i < BPROTO_LOOP_FDS; i++) {
+    ck_assert_int_eq(bproto_loop_watch(&test_loop, i, test_loop_read, &got), 0);
+  }
+  ck_assert_int_eq(bproto_loop_watch(&test_loop, 0, test_loop_read, NULL), 0);
+  ck_assert_int_eq(bproto_loop_watch(&test_loop, BPROTO_LOOP_FDS, test_loop_read, &got), -1);
+}
+END_TEST
+
+/*
+Messages from a pty fed through the loop, as the firmware reads its UART.
+*/
+static bproto_t test_uart_msgs[4];
+static int test_uart_count;
+
+static void test_uart_msg(bproto_t *msg, void *ctx) {
+  ck_assert_int_lt(test_uart_count, 4);
+  test_uart_msgs[test_uart_count++] = *msg;
+}
+
+static void test_uart_readable(int fd, void *ctx) {
+  ck_assert_int_ge(bproto_loop_feed(fd, ctx), 0);
+}
+
+START_TEST(test_bproto_loop_feed)
+{
+  int master, slave;
+  struct termios raw;
+  bproto_parser_t parser;
+  ck_assert_int_eq(openpty(&master, &slave, NULL, NULL, NULL), 0);
+  // A UART has no line discipline: bytes arrive as they are written
+  ck_assert_int_eq(tcgetattr(slave, &raw), 0);
+  cfmakeraw(&raw);
+  ck_assert_int_eq(tcsetattr(slave, TCSANOW, &raw), 0);
+  ck_assert_int_eq(fcntl(slave, F_SETFL, O_NONBLOCK), 0);
+
+  test_uart_count = 0;
+  bproto_parser_init(&parser, test_uart_msg, NULL);
+  bproto_loop_init(&test_loop, NULL);
+  ck_assert_int_eq(bproto_loop_watch(&test_loop, slave, test_uart_readable, &parser), 0);
+
+  // Half a message waits for the rest of its line
+  ck_assert_int_eq(write(master, "R10G", 4), 4);
+  ck_assert_int_eq(bproto_loop_run_once(&test_loop, 1000), 1);
+  ck_assert_int_eq(test_uart_count, 0);
+
+  // One write finishing it and carrying another whole line and a half
+  ck_assert_int_eq(write(master, "20\nB30\nW4", 9), 9);
+  ck_assert_int_eq(bproto_loop_run_once(&test_loop, 1000), 1);
+  ck_assert_int_eq(test_uart_count, 2);
+  ck_assert_int_eq(test_uart_msgs[0].red, 10);
+  ck_assert_int_eq(test_uart_msgs[0].green, 20);
+  ck_assert_int_eq(test_uart_msgs[0].blue, BPROTO_VALUE_UNSET);
+  ck_assert_int_eq(test_uart_msgs[1].blue, 30);
+  ck_assert_int_eq(test_uart_msgs[1].red, BPROTO_VALUE_UNSET);
+
+  // A bad line is counted and the next one still gets through
+  ck_assert_int_eq(write(master, "0\nX1\n\nR1T5\n", 11), 11);
+  ck_assert_int_eq(bproto_loop_run_once(&test_loop, 1000), 1);
+  ck_assert_int_eq(test_uart_count, 4);
+  ck_assert_int_eq(test_uart_msgs[2].white, 40);
+  ck_assert_int_eq(test_uart_msgs[3].red, 1);
+  ck_assert_int_eq(test_uart_msgs[3].time, 5);
+  ck_assert_int_eq(parser.errors, 1);
+
+  // Nothing waiting is not an error
+  ck_assert_int_eq(bproto_loop_feed(slave, &parser), 0);
+
+  close(master);
+  close(slave);
+}
+END_TEST
+
+/*
+An ArtDmx packet for `universe` carrying `n` slots of 1, 2, 3...
+*/
+static int test_dmx_artnet(uint8_t *pkt, uint16_t universe, uint8_t seq, int n) {
+  memset(pkt, 0, BPROTO_DMX_BUF_LEN);
+  memcpy(pkt, "Art-Net", 8);
+  pkt[9] = 0x50;
+  pkt[11] = 14;
+  pkt[12] = seq;
+  pkt[14] = universe & 0xff;
+  pkt[15] = universe >> 8;
+  pkt[16] = n >> 8;
+  pkt[17] = n & 0xff;
+  for (int i = 0; i < n; i++) {
+    pkt[18 + i] = i + 1;
+  }
+  return 18 + n;
+}
+
+/*
+An E1.31 data packet for `universe` carrying `n` slots of 1, 2, 3...
+*/
+static int test_dmx_e131(uint8_t *pkt, uint16_t universe, uint8_t seq, int n) {
+  memset(pkt, 0, BPROTO_DMX_BUF_LEN);
+  pkt[1] = 0x10;
+  memcpy(pkt + 4, "ASC-E1.17", 9);
+  pkt[21] = 4;
+  pkt[43] = 2;
+  pkt[111] = seq;
+  pkt[113] = universe >> 8;
+  pkt[114] = universe & 0xff;
+  pkt[123] = (n + 1) >> 8;
+  pkt[124] = (n + 1) & 0xff;
+  for (int i = 0; i < n; i++) {
+    pkt[126 + i] = i + 1;
+  }
+  return 126 + n;
+}
+
+START_TEST(test_bproto_dmx_artnet)
+{
+  uint8_t pkt[BPROTO_DMX_BUF_LEN], seq = 0;
+  const uint8_t *slots = NULL;
+
+  int len = test_dmx_artnet(pkt, 0x123, 9, 4);
+  ck_assert_int_eq(bproto_dmx_artnet_parse(pkt, len, 0x123, &slots, &seq), 4);
+  ck_assert(slots == pkt + 18);
+  ck_assert_int_eq(slots[3], 4);
+  ck_assert_int_eq(seq, 9);
+
+  // The top bit of the net byte is not part of the port address
+  pkt[15] |= 0x80;
+  ck_assert_int_eq(bproto_dmx_artnet_parse(pkt, len, 0x123, &slots, &seq), 4);
+
+  ck_assert_int_eq(bproto_dmx_artnet_parse(pkt, len, 0x124, &slots, &seq), -1);
+  ck_assert_int_eq(bproto_dmx_artnet_parse(pkt, 17, 0x123, &slots, &seq), -1);
+  ck_assert_int_eq(bproto_dmx_artnet_parse(pkt, 0, 0x123, &slots, &seq), -1);
+
+  // Art-Net counts from 0, the usual default
+  len = test_dmx_artnet(pkt, 0, 1, 4);
+  ck_assert_int_eq(bproto_dmx_artnet_parse(pkt, len, 0, &slots, &seq), 4);
+  ck_assert_int_eq(bproto_dmx_artnet_parse(pkt, len, 1, &slots, &seq), -1);
+
+  // Truncated packets give what they carry, not what they claim
+  len = test_dmx_artnet(pkt, 1, 0, 512);
+  ck_assert_int_eq(bproto_dmx_artnet_parse(pkt, 21, 1, &slots, &seq), 3);
+  ck_assert_int_eq(bproto_dmx_artnet_parse(pkt, 18, 1, &slots, &seq), 0);
+  ck_assert_int_eq(bproto_dmx_artnet_parse(pkt, len, 1, &slots, &seq), 512);
+
+  pkt[9] = 0x21; // ArtPoll
+  ck_assert_int_eq(bproto_dmx_artnet_parse(pkt, len, 1, &slots, &seq), -1);
+  test_dmx_artnet(pkt, 1, 0, 4);
+  pkt[7] = 'x';
+  ck_assert_int_eq(bproto_dmx_artnet_parse(pkt, len, 1, &slots, &seq), -1);
+}
+END_TEST
+
+START_TEST(test_bproto_dmx_e131)
+{
+  uint8_t pkt[BPROTO_DMX_BUF_LEN], seq = 0;
+  const uint8_t *slots = NULL;
+
+  int len = test_dmx_e131(pkt, 7, 200, 4);
+  ck_assert_int_eq(bproto_dmx_e131_parse(pkt, len, 7, &slots, &seq), 4);
+  ck_assert(slots == pkt + 126);
+  ck_assert_int_eq(slots[0], 1);
+  ck_assert_int_eq(seq, 200);
+
+  ck_assert_int_eq(bproto_dmx_e131_parse(pkt, len, 8, &slots, &seq), -1);
+  ck_assert_int_eq(bproto_dmx_e131_parse(pkt, 125, 7, &slots, &seq), -1);
+  ck_assert_int_eq(bproto_dmx_e131_parse(pkt, 0, 7, &slots, &seq), -1);
+
+  len = test_dmx_e131(pkt, 7, 0, 512);
+  ck_assert_int_eq(len, 638);
+  ck_assert_int_eq(bproto_dmx_e131_parse(pkt, len, 7, &slots, &seq), 512);
+  ck_assert_int_eq(bproto_dmx_e131_parse(pkt, 130, 7, &slots, &seq), 4);
+  ck_assert_int_eq(bproto_dmx_e131_parse(pkt, 126, 7, &slots, &seq), 0);
+
+  // Preview and terminated streams, other start codes and no start code
+  pkt[112] = 0x80;
+  ck_assert_int_eq(bproto_dmx_e131_parse(pkt, len, 7, &slots, &seq), -1);
+  pkt[112] = 0x40;
+  ck_assert_int_eq(bproto_dmx_e131_parse(pkt, len, 7, &slots, &seq), -1);
+  len = test_dmx_e131(pkt, 7, 0, 4);
+  pkt[125] = 0xdd;
+  ck_assert_int_eq(bproto_dmx_e131_parse(pkt, len, 7, &slots, &seq), -1);
+  len = test_dmx_e131(pkt, 7, 0, -1);
+  ck_assert_int_eq(bproto_dmx_e131_parse(pkt, len + 4, 7, &slots, &seq), -1);
+
+  len = test_dmx_e131(pkt, 7, 0, 4);
+  pkt[21] = 8; // extended packet
+  ck_assert_int_eq(bproto_dmx_e131_parse(pkt, len, 7, &slots, &seq), -1);
+  len = test_dmx_e131(pkt, 7, 0, 4);
+  pkt[12] = 'x';
+  ck_assert_int_eq(bproto_dmx_e131_parse(pkt, len, 7, &slots, &seq), -1);
+}
+END_TEST
+
+START_TEST(test_bproto_dmx_seq)
+{
+  bproto_dmx_seq_t s = { 0 };
+  uint32_t now = UINT32_MAX - 1000;
+
+  ck_assert(bproto_dmx_seq_accept(&s, 250, now));
+  ck_assert(!bproto_dmx_seq_accept(&s, 250, now));     // duplicate
+  ck_assert(!bproto_dmx_seq_accept(&s, 249, now));     // stale
+  ck_assert(bproto_dmx_seq_accept(&s, 251, now));
+
+  // Sequence numbers wrap, and so does the clock
+  for (int i = 0; i < 300; i++) {
+    now += 10;
+    ck_assert(bproto_dmx_seq_accept(&s, 252 + i, now));
+    ck_assert(!bproto_dmx_seq_accept(&s, 252 + i - 1, now));
+  }
+  ck_assert_int_eq(s.seq, (252 + 299) & 0xff);
+
+  // 20 or more behind is a new sequence, not a stale frame
+  ck_assert(!bproto_dmx_seq_accept(&s, s.seq - 19, now));
+  ck_assert(bproto_dmx_seq_accept(&s, s.seq - 20, now));
+
+  // A source silent for the data loss timeout may restart anywhere
+  uint8_t last = s.seq;
+  ck_assert(!bproto_dmx_seq_accept(&s, last - 1, now + BPROTO_DMX_TIMEOUT - 1));
+  ck_assert(bproto_dmx_seq_accept(&s, last - 1, now + BPROTO_DMX_TIMEOUT));
+}
+END_TEST
+
+/*
+Two pools of a few blocks, as the firmware sets them up for libcoap.
+*/
+#define TEST_POOL_SMALL BPROTO_POOL_ALIGN(20)
+#define TEST_POOL_LARGE BPROTO_POOL_ALIGN(100)
+
+static void *test_pool_small[3][TEST_POOL_SMALL / sizeof(void*)];
+static void *test_pool_large[2][TEST_POOL_LARGE / sizeof(void*)];
+
+static void test_pool_setup(bproto_pool_t pools[2]) {
+  memset(pools, 0, 2 * sizeof(bproto_pool_t));
+  pools[0].size = TEST_POOL_SMALL;
+  pools[0].count = 3;
+  pools[0].arena = (uint8_t*)test_pool_small;
+  pools[1].size = TEST_POOL_LARGE;
+  pools[1].count = 2;
+  pools[1].arena = (uint8_t*)test_pool_large;
+  bproto_pool_init(&pools[0]);
+  bproto_pool_init(&pools[1]);
+}
+
+START_TEST(test_bproto_pool_alloc)
+{
+  bproto_pool_t pools[2];
+  test_pool_setup(pools);
+
+  // Tightest fit first; too large for any pool goes to the heap
+  ck_assert(bproto_pool_fit(pools, 2, 1) == &pools[0]);
+  ck_assert(bproto_pool_fit(pools, 2, TEST_POOL_SMALL) == &pools[0]);
+  ck_assert(bproto_pool_fit(pools, 2, TEST_POOL_SMALL + 1) == &pools[1]);
+  ck_assert(bproto_pool_fit(pools, 2, TEST_POOL_LARGE + 1) == NULL);
+
+  // Distinct blocks inside the arena, each found in its own pool
+  void *a = bproto_pool_alloc(&pools[0]);
+  void *b = bproto_pool_alloc(&pools[0]);
+  void *c = bproto_pool_alloc(&pools[0]);
+  ck_assert(a != NULL && b != NULL && c != NULL);
+  ck_assert(a != b && b != c && a != c);
+  ck_assert(bproto_pool_find(pools, 2, a) == &pools[0]);
+  ck_assert(bproto_pool_find(pools, 2, (uint8_t*)c + TEST_POOL_SMALL - 1) == &pools[0]);
+  memset(a, 0xaa, TEST_POOL_SMALL);
+  memset(b, 0xbb, TEST_POOL_SMALL);
+  memset(c, 0xcc, TEST_POOL_SMALL);
+
+  // Empty: the caller falls back to the heap, and frees that block there
+  ck_assert(bproto_pool_alloc(&pools[0]) == NULL);
+  ck_assert_int_eq(pools[0].exhausted, 1);
+  void *heap = malloc(TEST_POOL_SMALL);
+  ck_assert(bproto_pool_find(pools, 2, heap) == NULL);
+  free(heap);
+
+  // A freed block is handed out again
+  bproto_pool_free(&pools[0], b);
+  ck_assert(bproto_pool_alloc(&pools[0]) == b);
+  ck_assert_int_eq(pools[0].used, 3);
+
+  void *d = bproto_pool_alloc(&pools[1]);
+  ck_assert(bproto_pool_find(pools, 2, d) == &pools[1]);
+  ck_assert_int_eq(pools[1].used, 1);
+  bproto_pool_free(&pools[1], d);
+
+  bproto_pool_free(&pools[0], a);
+  bproto_pool_free(&pools[0], b);
+  bproto_pool_free(&pools[0], c);
+  ck_assert_int_eq(pools[0].used, 0);
+  ck_assert_int_eq(pools[1].used, 0);
+}
+END_TEST
+
+START_TEST(test_bproto_pool_stats)
+{
+  bproto_pool_t pools[2];
+  test_pool_setup(pools);
+  bproto_pool_t *pool = &pools[0];
+  void *held[4] = { NULL };
+  size_t n = 0, misses = 0;
+
+  // Churn: grow to two blocks, then cycle between one and four requested
+  for (int i = 0; i < 100; i++) {
+    size_t want = i < 10 ? 2 : 1 + i % 4;
+    while (n < want) {
+      void *block = bproto_pool_alloc(pool);
+      if (block == NULL) {
+	misses++;
+	break;
+      }
+      held[n++] = block;
+    }
+    while (n > want) {
+      bproto_pool_free(pool, held[--n]);
+    }
+    ck_assert_int_eq(pool->used, n);
+  }
+  ck_assert_int_eq(pool->high_water, 3);
+  ck_assert_int_eq(pool->exhausted, misses);
+  ck_assert_int_gt(misses, 0);
+
+  while (n > 0) {
+    bproto_pool_free(pool, held[--n]);
+  }
+  ck_assert_int_eq(pool->used, 0);
+  ck_assert_int_eq(pool->high_water, 3);
+
+  // Every block is back on the free list
+  for (size_t i = 0; i < pool->count; i++) {
+    ck_assert(bproto_pool_alloc(pool) != NULL);
+  }
+  ck_assert(bproto_pool_alloc(pool) == NULL);
+  ck_assert_int_eq(pool->exhausted, misses + 1);
+
+  bproto_pool_init(pool);
+  ck_assert_int_eq(pool->used, 0);
+  ck_assert_int_eq(pool->high_water, 0);
+  ck_assert_int_eq(pool->exhausted, 0);
+}
+END_TEST
+
+static void test_rate_key(uint8_t key[BPROTO_RATE_KEY_LEN], int peer) {
+  memset(key, 0, BPROTO_RATE_KEY_LEN);
+  key[0] = 10;
+  key[2] = peer >> 8;
+  key[3] = peer;
+}
+
+START_TEST(test_bproto_rate_admit)
+{
+  bproto_rate_bucket_t buckets[8];
+  bproto_rate_t rate;
+  bproto_rate_init(&rate, buckets, 8, 10, 5);
+  uint8_t a[BPROTO_RATE_KEY_LEN], b[BPROTO_RATE_KEY_LEN];
+  test_rate_key(a, 1);
+  test_rate_key(b, 2);
+  uint32_t now = UINT32_MAX - 150;
+
+  // A new peer may send a full burst back to back, and no more
+  for (int i = 0; i < 5; i++) {
+    ck_assert(bproto_rate_admit(&rate, a, now));
+  }
+  ck_assert(!bproto_rate_admit(&rate, a, now));
+  // Other peers have their own bucket
+  ck_assert(bproto_rate_admit(&rate, b, now));
+
+  // 10 per second refills a token every 100 ms, in fractions in between,
+  // through the clock wrap
+  ck_assert(!bproto_rate_admit(&rate, a, now + 50));
+  ck_assert(!bproto_rate_admit(&rate, a, now + 99));
+  ck_assert(bproto_rate_admit(&rate, a, now + 100));
+  ck_assert(!bproto_rate_admit(&rate, a, now + 100));
+  ck_assert(bproto_rate_admit(&rate, a, now + 200));
+  ck_assert(!bproto_rate_admit(&rate, a, now + 250));
+
+  // A long silence refills up to the burst, not beyond
+  now += 60000;
+  for (int i = 0; i < 5; i++) {
+    ck_assert(bproto_rate_admit(&rate, a, now));
+  }
+  ck_assert(!bproto_rate_admit(&rate, a, now));
+
+  // Sustained traffic at the rate is always admitted
+  for (int i = 1; i <= 50; i++) {
+    ck_assert(bproto_rate_admit(&rate, a, now + i * 100));
+  }
+}
+END_TEST
+
+START_TEST(test_bproto_rate_evict)
+{
+  bproto_rate_bucket_t buckets[4];
+  bproto_rate_t rate;
+  bproto_rate_init(&rate, buckets, 4, 1, 1);
+  uint8_t key[BPROTO_RATE_KEY_LEN];
+
+  // Fill the table, one peer a second; the probe covers all four slots
+  for (int i = 0; i < 4; i++) {
+    test_rate_key(key, i);
+    ck_assert(bproto_rate_admit(&rate, key, i * 1000));
+    ck_assert(!bproto_rate_admit(&rate, key, i * 1000));
+  }
+  for (int i = 0; i < 4; i++) {
+    ck_assert(buckets[i].used);
+  }
+
+  // Peer 0 is seen again, so peer 1 is now the least recently seen
+  test_rate_key(key, 0);
+  ck_assert(bproto_rate_admit(&rate, key, 4000));
+
+  // A new peer takes peer 1's slot, with a full bucket of its own
+  test_rate_key(key, 4);
+  ck_assert(bproto_rate_admit(&rate, key, 4100));
+  test_rate_key(key, 0);
+  ck_assert(bproto_rate_lookup(&rate, key, 4150)->last == 4000);
+  test_rate_key(key, 1);
+  bproto_rate_bucket_t *bucket = bproto_rate_lookup(&rate, key, 4200);
+  ck_assert(bucket->last == 4200);
+  ck_assert_int_eq(bucket->tokens, BPROTO_RATE_SCALE);
+
+  // Looking peer 1 up again evicted peer 2; peer 3 kept its bucket
+  test_rate_key(key, 3);
+  bucket = bproto_rate_lookup(&rate, key, 4300);
+  ck_assert(bucket->last == 3000);
+  ck_assert_int_eq(bucket->tokens, 0);
+}
+END_TEST
+
+START_TEST(test_bproto_stream_accept)
+{
+  bproto_stream_t s = { 0 };
+  uint32_t now = 1000;
+
+  // Any first frame starts the stream
+  ck_assert(bproto_stream_accept(&s, 7000, now));
+  ck_assert(!bproto_stream_accept(&s, 7000, now));      // duplicate
+  ck_assert(!bproto_stream_accept(&s, 6999, now + 10)); // stale
+  ck_assert(bproto_stream_accept(&s, 7002, now + 20));  // gaps are fine
+  ck_assert(!bproto_stream_accept(&s, 7001, now + 30)); // late
+  ck_assert_int_eq(s.dropped, 3);
+
+  // Serial number arithmetic: up to 2^31 - 1 ahead is newer
+  ck_assert(bproto_stream_accept(&s, 7002u + INT32_MAX, now + 40));
+  ck_assert(!bproto_stream_accept(&s, 7002, now + 50));
+  ck_assert_int_eq(s.dropped, 4);
+}
+END_TEST
+
+START_TEST(test_bproto_stream_wrap)
+{
+  bproto_stream_t s = { 0 };
+  uint32_t now = UINT32_MAX - 1000;
+
+  // The sequence and the clock both wrap during the stream
+  uint32_t seq = UINT32_MAX - 50;
+  for (int i = 0; i < 100; i++) {
+    ck_assert(bproto_stream_accept(&s, seq + i, now + i * 20));
+    ck_assert(!bproto_stream_accept(&s, seq + i - 1, now + i * 20));
+  }
+  ck_assert_int_eq(s.seq, 48);
+  ck_assert_int_eq(s.dropped, 100);
+  now += 99 * 20;
+
+  // A restarted sender is locked out until the stream has been idle for
+  // the timeout, and may start anywhere after that
+  ck_assert(!bproto_stream_accept(&s, 1, now + BPROTO_STREAM_TIMEOUT - 1));
+  ck_assert(bproto_stream_accept(&s, 1, now + BPROTO_STREAM_TIMEOUT));
+  ck_assert(bproto_stream_accept(&s, 2, now + BPROTO_STREAM_TIMEOUT + 20));
+  // A late frame from before the restart is stale again
+  ck_assert(!bproto_stream_accept(&s, seq + 40, now + BPROTO_STREAM_TIMEOUT + 40));
+
+  // Dropped frames don't keep a stream alive
+  now += BPROTO_STREAM_TIMEOUT + 20;
+  for (uint32_t t = 100; t < BPROTO_STREAM_TIMEOUT; t += 100) {
+    ck_assert(!bproto_stream_accept(&s, 0, now + t));
+  }
+  ck_assert(bproto_stream_accept(&s, 0, now + BPROTO_STREAM_TIMEOUT));
+}
+END_TEST
+
+/*
+A fake LEDC: the hooks append to `log` ("P1" programs channel 1, "S1" starts
+it, "[" and "]" take and release the lock) and each start takes 10 cycles.
+*/
+typedef struct {
+  char log[64];
+  uint32_t now;
+  int fail; // channel whose program hook fails, or -1
+} test_ledc_t;
+
+static int test_ledc_program(int i, void *ctx) {
+  test_ledc_t *t = ctx;
+  sprintf(t->log + strlen(t->log), "P%d", i);
+  return i == t->fail ? 3 : 0;
+}
+
+static int test_ledc_start(int i, void *ctx) {
+  test_ledc_t *t = ctx;
+  sprintf(t->log + strlen(t->log), "S%d", i);
+  t->now += 10;
+  return 0;
+}
+
+static void test_ledc_lock(void *ctx) {
+  strcat(((test_ledc_t*)ctx)->log, "[");
+}
+
+static void test_ledc_unlock(void *ctx) {
+  strcat(((test_ledc_t*)ctx)->log, "]");
+}
+
+static uint32_t test_ledc_clock(void *ctx) {
+  return ((test_ledc_t*)ctx)->now;
+}
+
+static const bproto_ledc_ops_t test_ledc_ops = {
+  .program = test_ledc_program,
+  .start = test_ledc_start,
+  .lock = test_ledc_lock,
+  .unlock = test_ledc_unlock,
+  .clock = test_ledc_clock,
+};
+
+START_TEST(test_bproto_ledc_dirty)
+{
+  bproto_t cur, new;
+  bproto_init(&cur);
+  cur.red = 10;
+  cur.green = 20;
+  cur.blue = 30;
+  cur.white = 40;
+
+  // Unset and unchanged channels are left alone
+  bproto_init(&new);
+  ck_assert_int_eq(bproto_ledc_dirty(&new, &cur), 0);
+  new.green = 20;
+  new.time = 500;
+  ck_assert_int_eq(bproto_ledc_dirty(&new, &cur), 0);
+  new.red = 11;
+  new.white = 0;
+  ck_assert_int_eq(bproto_ledc_dirty(&new, &cur), 0x9);
+  new.blue = 0;
+  ck_assert_int_eq(bproto_ledc_dirty(&new, &cur), 0xd);
+
+  // Everything differs from an unset state
+  bproto_init(&new);
+  ck_assert_int_eq(bproto_ledc_dirty(&cur, &new), 0xf);
+}
+END_TEST
+
+START_TEST(test_bproto_ledc_update)
+{
+  bproto_ledc_t ledc;
+  test_ledc_t t = { .now = 1000, .fail = -1 };
+  bproto_ledc_init(&ledc, &test_ledc_ops);
+
+  // Every changed channel is programmed before any starts, and the starts
+  // run back to back under the lock
+  ck_assert_int_eq(bproto_ledc_update(&ledc, 0xd, &t), 0);
+  ck_assert_str_eq(t.log, "P0P2P3[S0S2S3]");
+  ck_assert_int_eq(ledc.skew, 30);
+  ck_assert_int_eq(ledc.skew_max, 30);
+
+  t.log[0] = '\0';
+  ck_assert_int_eq(bproto_ledc_update(&ledc, 0x2, &t), 0);
+  ck_assert_str_eq(t.log, "P1[S1]");
+  ck_assert_int_eq(ledc.skew, 10);
+  ck_assert_int_eq(ledc.skew_max, 30);
+
+  // Nothing to do
+  t.log[0] = '\0';
+  ck_assert_int_eq(bproto_ledc_update(&ledc, 0, &t), 0);
+  ck_assert_str_eq(t.log, "");
+
+  // A channel that can't be programmed starts nothing
+  t.fail = 2;
+  ck_assert_int_eq(bproto_ledc_update(&ledc, 0xf, &t), 3);
+  ck_assert_str_eq(t.log, "P0P1P2P3");
+  ck_assert_int_eq(ledc.skew, 10);
+}
+END_TEST
+
+/*
+Every combination of set/unset fields, with two different values each.
+*/
+static void test_packed_gen(bproto_t *b, int i) {
+  bproto_init(b);
+  int v = i >> 6;
+  if (i & 1)  b->red   = v ? 255 : 0;
+  if (i & 2)  b->green = v ? 1 : 128;
+  if (i & 4)  b->blue  = v ? 7 : 8;
+  if (i & 8)  b->white = v ? 200 : 100;
+  if (i & 16) b->time  = v ? BPROTO_TIME_T_MAX : 0;
+  if (i & 32) b->ease  = v ? BPROTO_EASE_SINE : BPROTO_EASE_LINEAR;
+}
+
+START_TEST(test_bproto_packed)
+{
+  for (int i = 0; i < 128; i++) {
+    bproto_t b, u;
+    bproto_packed_t p;
+    test_packed_gen(&b, i);
+    bproto_pack(&p, &b);
+    bproto_unpack(&u, &p);
+    ck_assert(bproto_eq(&b, &u));
+    ck_assert_int_eq(bproto_packed_is_set(&p), bproto_is_set(&b));
+
+    for (int j = 0; j < 128; j++) {
+      bproto_t c;
+      bproto_packed_t q;
+      test_packed_gen(&c, j);
+      bproto_pack(&q, &c);
+      ck_assert_int_eq(bproto_packed_eq(&p, &q), bproto_eq(&b, &c));
+
+      bproto_copy(&b, &c);
+      bproto_packed_copy(&p, &q);
+      bproto_unpack(&u, &q);
+      ck_assert(bproto_eq(&c, &u));
+    }
+  }
+}
+END_TEST
+
+START_TEST(test_bproto_batch)
+{
+  bproto_t x[4096], y[4096], out[4096];
+  uint8_t eq[4096];
+  bproto_batch_t bx, by;
+  ck_assert_int_eq(bproto_batch_init(&bx, 4096), 0);
+  ck_assert_int_eq(bproto_batch_init(&by, 4096), 0);
+
+  for (int i = 0; i < 4096; i++) {
+    test_packed_gen(&x[i], i % 128);
+    test_packed_gen(&y[i], i / 32);
+  }
+  ck_assert_int_eq(bproto_batch_load(&bx, x, 4096), 4096);
+  ck_assert_int_eq(bproto_batch_load(&by, y, 4096), 4096);
+
+  size_t equal = bproto_batch_eq(&bx, &by, eq), expected = 0;
+  for (int i = 0; i < 4096; i++) {
+    ck_assert_int_eq(eq[i], bproto_eq(&x[i], &y[i]));
+    expected += eq[i];
+  }
+  ck_assert_int_eq(equal, expected);
+
+  bproto_batch_copy(&bx, &by);
+  bproto_batch_store(&by, out);
+  for (int i = 0; i < 4096; i++) {
+    bproto_copy(&x[i], &y[i]);
+    ck_assert(bproto_eq(&y[i], &out[i]));
+  }
+
+  bproto_batch_free(&bx);
+  bproto_batch_free(&by);
+}
+END_TEST
+
+START_TEST(test_bproto_diff)
+{
+  static bproto_t old[128 * 128], new[128 * 128], out[128 * 128], batch[128 * 128];
+  size_t expected = 0;
+  for (int i = 0; i < 128 * 128; i++) {
+    test_packed_gen(&old[i], i / 128);
+    test_packed_gen(&new[i], i % 128);
+  }
+
+  for (int i = 0; i < 128 * 128; i++) {
+    int changed = bproto_diff(&old[i], &new[i], &out[i]);
+    expected += changed;
+
+    // Sending the diff leaves the channels as sending everything would
+    bproto_t full = old[i], delta = old[i];
+    bproto_copy(&new[i], &full);
+    bproto_copy(&out[i], &delta);
+    ck_assert_int_eq(delta.red, full.red);
+    ck_assert_int_eq(delta.green, full.green);
+    ck_assert_int_eq(delta.blue, full.blue);
+    ck_assert_int_eq(delta.white, full.white);
+
+    // ...without any channel that was already right
+    ck_assert(out[i].red == BPROTO_VALUE_UNSET || out[i].red != old[i].red);
+    ck_assert(out[i].white == BPROTO_VALUE_UNSET || out[i].white != old[i].white);
+    ck_assert_int_eq(changed, bproto_is_set(&out[i]));
+    ck_assert_int_eq(out[i].time, changed ? new[i].time : BPROTO_TIME_UNSET);
+    ck_assert_int_eq(out[i].ease, changed ? new[i].ease : BPROTO_EASE_UNSET);
+  }
+
+  ck_assert_int_eq(bproto_diff_batch(old, new, batch, 128 * 128), expected);
+  for (int i = 0; i < 128 * 128; i++) {
+    ck_assert(bproto_eq(&batch[i], &out[i]));
+  }
+}
+END_TEST
+
+#define TEST_PAR_LINES (300000)
+
+static char *test_par_gen(size_t *len) {
+  char *buf = malloc(TEST_PAR_LINES * 24);
+  char *ptr = buf;
+  for (int i = 0; i < TEST_PAR_LINES; i++) {
+    // Mix of lengths, CRLF and blank lines
+    ptr += sprintf(ptr, i % 7 == 0 ? "R%dT%d\r\n" : i % 5 == 0 ? "\nG%d\n" : "B%dT%d\n",
+		   i % 256, i);
+  }
+  *len = ptr - buf;
+  return buf;
+}
+
+START_TEST(test_bproto_parse_lines_parallel)
+{
+  size_t len;
+  char *buf = test_par_gen(&len);
+  bproto_t *serial = malloc(TEST_PAR_LINES * sizeof(bproto_t));
+  bproto_t *parallel = malloc(TEST_PAR_LINES * sizeof(bproto_t));
+  bproto_par_result_t res1, res4;
+
+  ck_assert_int_eq(bproto_parse_lines(serial, TEST_PAR_LINES, buf, len, &res1), BPROTO_PAR_OK);
+  ck_assert_int_eq(bproto_parse_lines_parallel(parallel, TEST_PAR_LINES, buf, len, 4, &res4), BPROTO_PAR_OK);
+  ck_assert_int_eq(res1.count, TEST_PAR_LINES);
+  ck_assert_int_eq(res4.count, TEST_PAR_LINES);
+  for (int i = 0; i < TEST_PAR_LINES; i++) {
+    ck_assert(bproto_eq(&serial[i], &parallel[i]));
+  }
+  ck_assert_int_eq(parallel[7].red, 7);
+  ck_assert_int_eq(parallel[7].time, 7);
+
+  ck_assert_int_eq(bproto_parse_lines_parallel(parallel, TEST_PAR_LINES - 1, buf, len, 4, &res4),
+		   BPROTO_PAR_ENOSPC);
+
+  free(serial);
+  free(parallel);
+  free(buf);
+}
+END_TEST
+
+START_TEST(test_bproto_parse_lines_error)
+{
+  size_t len;
+  char *buf = test_par_gen(&len);
+  bproto_t *out = malloc(TEST_PAR_LINES * sizeof(bproto_t));
+  bproto_par_result_t res;
+
+  // Corrupt two lines; the first one is always reported
+  char *first = strstr(buf + len / 3, "\nB") + 1;
+  char *second = strstr(buf + len / 2, "\nB") + 1;
+  *first = 'X';
+  *second = 'X';
+  size_t line = 0, messages = 0;
+  for (char *ptr = buf; ptr < first; ptr = strchr(ptr, '\n') + 1) {
+    line++;
+    messages += *ptr != '\n';
+  }
+
+  for (int threads = 1; threads <= 8; threads *= 2) {
+    ck_assert_int_eq(bproto_parse_lines_parallel(out, TEST_PAR_LINES, buf, len, threads, &res),
+		     BPROTO_PAR_EPARSE);
+    ck_assert_int_eq(res.error, line);
+    ck_assert_int_eq(res.count, messages);
+  }
+
+  free(out);
+  free(buf);
+}
+END_TEST
+
 /*
 void test_bproto_value_parse_null() {
   char raw = '\0';
@@ -266,6 +1638,7 @@ Suite *bproto_suite(void) {
   
   tcase_add_test(tc_proto_t, test_bproto_init);
   tcase_add_test(tc_proto_t, test_bproto_copy);
+  tcase_add_test(tc_proto_t, test_bproto_channels);
   suite_add_tcase(s, tc_proto_t);
 
   TCase *tc_field_parse = tcase_create("field_parse");
@@ -280,6 +1653,93 @@ Suite *bproto_suite(void) {
   tcase_add_test(tc_digit_parse, test_bproto_digit_parse);
   suite_add_tcase(s, tc_digit_parse);
 
+  TCase *tc_parse = tcase_create("parse");
+
+  tcase_add_test(tc_parse, test_bproto_parse);
+  tcase_add_test(tc_parse, test_bproto_parse_n);
+  tcase_add_test(tc_parse, test_bproto_snprint_ease);
+  tcase_add_test(tc_parse, test_bproto_validate);
+  suite_add_tcase(s, tc_parse);
+
+  TCase *tc_packed = tcase_create("packed");
+
+  tcase_add_test(tc_packed, test_bproto_packed);
+  tcase_add_test(tc_packed, test_bproto_batch);
+  suite_add_tcase(s, tc_packed);
+
+  TCase *tc_diff = tcase_create("diff");
+  tcase_add_test(tc_diff, test_bproto_diff);
+  suite_add_tcase(s, tc_diff);
+
+  TCase *tc_parse_lines = tcase_create("parse_lines");
+
+  tcase_add_test(tc_parse_lines, test_bproto_parse_lines_parallel);
+  tcase_add_test(tc_parse_lines, test_bproto_parse_lines_error);
+  suite_add_tcase(s, tc_parse_lines);
+
+  TCase *tc_parser = tcase_create("parser");
+
+  tcase_add_test(tc_parser, test_bproto_parser_feed);
+  tcase_add_test(tc_parser, test_bproto_parser_feed_bytewise);
+  tcase_add_test(tc_parser, test_bproto_parser_feed_invalid);
+  tcase_add_test(tc_parser, test_bproto_parser_finish);
+  suite_add_tcase(s, tc_parser);
+
+  TCase *tc_color = tcase_create("color");
+
+  tcase_add_test(tc_color, test_bproto_hsv);
+  tcase_add_test(tc_color, test_bproto_hsv_batch);
+  tcase_add_test(tc_color, test_bproto_kelvin);
+  suite_add_tcase(s, tc_color);
+
+  TCase *tc_ease = tcase_create("ease");
+
+  tcase_add_test(tc_ease, test_bproto_ease);
+  suite_add_tcase(s, tc_ease);
+
+  TCase *tc_fade = tcase_create("fade");
+  tcase_add_test(tc_fade, test_bproto_fade);
+  tcase_add_test(tc_fade, test_bproto_fade_render);
+  suite_add_tcase(s, tc_fade);
+
+  TCase *tc_ledc = tcase_create("ledc");
+  tcase_add_test(tc_ledc, test_bproto_ledc_dirty);
+  tcase_add_test(tc_ledc, test_bproto_ledc_update);
+  suite_add_tcase(s, tc_ledc);
+
+  TCase *tc_rec = tcase_create("rec");
+
+  tcase_add_test(tc_rec, test_bproto_rec_roundtrip);
+  tcase_add_test(tc_rec, test_bproto_rec_open_invalid);
+  suite_add_tcase(s, tc_rec);
+
+  TCase *tc_dmx = tcase_create("dmx");
+  tcase_add_test(tc_dmx, test_bproto_dmx_artnet);
+  tcase_add_test(tc_dmx, test_bproto_dmx_e131);
+  tcase_add_test(tc_dmx, test_bproto_dmx_seq);
+  suite_add_tcase(s, tc_dmx);
+
+  TCase *tc_pool = tcase_create("pool");
+  tcase_add_test(tc_pool, test_bproto_pool_alloc);
+  tcase_add_test(tc_pool, test_bproto_pool_stats);
+  suite_add_tcase(s, tc_pool);
+
+  TCase *tc_rate = tcase_create("rate");
+  tcase_add_test(tc_rate, test_bproto_rate_admit);
+  tcase_add_test(tc_rate, test_bproto_rate_evict);
+  suite_add_tcase(s, tc_rate);
+
+  TCase *tc_stream = tcase_create("stream");
+  tcase_add_test(tc_stream, test_bproto_stream_accept);
+  tcase_add_test(tc_stream, test_bproto_stream_wrap);
+  suite_add_tcase(s, tc_stream);
+
+  TCase *tc_loop = tcase_create("loop");
+  tcase_add_test(tc_loop, test_bproto_loop_timers);
+  tcase_add_test(tc_loop, test_bproto_loop_io);
+  tcase_add_test(tc_loop, test_bproto_loop_feed);
+  suite_add_tcase(s, tc_loop);
+
   return s;
 }
 
@@ -0,0 +1,506 @@
+/*
+bload: drive a blinken COAP endpoint with PUT /led requests and report
+latency percentiles, loss and retransmits.
+
+Every request is tracked by its token until its response arrives or it is
+given up on. Confirmable requests are retransmitted as in RFC 7252 (ACK
+timeout with random factor 1.5, doubling, up to MAX_RETRANSMIT times);
+non-confirmable requests are lost if no response arrives within the ACK
+timeout. Latency is measured from the first transmission.
+
+Usage:
+  bload [-f SCENARIO] [-c CLIENTS] [-r RATE] [-b BURST] [-d SECONDS]
+        [-n] [-t ACK_TIMEOUT_MS] [-m MAX_RETRANSMIT] [-s SEED] HOST [PORT]
+
+Scenario files hold the same settings as "key = value" lines (see
+tools/scenarios); options given on the command line override them.
+*/
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bproto.h"
+
+#define BLOAD_LINE_LEN 256
+#define BLOAD_DGRAM_LEN 64
+#define BLOAD_PORT "5683"
+#define BLOAD_PATH "led"
+#define BLOAD_CLIENTS_MAX 1024
+
+#define COAP_CON 0
+#define COAP_NON 1
+#define COAP_ACK 2
+#define COAP_RST 3
+#define COAP_PUT 3
+#define COAP_OPTION_URI_PATH 11
+#define COAP_OPTION_CONTENT_FORMAT 12
+#define COAP_TOKEN_LEN 4
+
+typedef struct {
+  unsigned clients;        // sockets (source ports) sending concurrently
+  double rate;             // requests per second per client
+  unsigned burst;          // requests sent back to back at each tick
+  double duration;         // seconds of sending
+  int confirmable;
+  unsigned ack_timeout;    // ms
+  unsigned max_retransmit;
+  unsigned seed;
+} bload_config_t;
+
+typedef enum {
+  BLOAD_PENDING,
+  BLOAD_DONE,
+  BLOAD_LOST,
+} bload_state_t;
+
+typedef struct {
+  uint8_t state;
+  uint8_t retransmits;
+  uint8_t code;            // response code
+  uint16_t client;
+  uint16_t mid;
+  uint64_t first;          // first transmission (ns)
+  uint64_t deadline;       // next retransmit or give-up time (ns)
+  uint64_t timeout;        // current retransmit timeout (ns)
+  uint64_t latency;        // ns, once done
+  uint8_t len;
+  uint8_t dgram[BLOAD_DGRAM_LEN];
+} bload_req_t;
+
+typedef struct {
+  int fd;
+  uint16_t mid;
+  uint64_t next;           // next tick (ns)
+  uint64_t ticks;
+} bload_client_t;
+
+static uint64_t bload_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bload_usage(void) {
+  fprintf(stderr,
+	  "usage: bload [-f SCENARIO] [-c CLIENTS] [-r RATE] [-b BURST] [-d SECONDS]\n"
+	  "             [-n] [-t ACK_TIMEOUT_MS] [-m MAX_RETRANSMIT] [-s SEED] HOST [PORT]\n");
+  return 2;
+}
+
+static int bload_set(bload_config_t *cfg, const char *key, const char *val) {
+  char *end;
+  double x = strtod(val, &end);
+  if (end == val || x < 0) {
+    return -1;
+  }
+  if (strcmp(key, "clients") == 0) {
+    cfg->clients = x;
+  } else if (strcmp(key, "rate") == 0) {
+    cfg->rate = x;
+  } else if (strcmp(key, "burst") == 0) {
+    cfg->burst = x;
+  } else if (strcmp(key, "duration") == 0) {
+    cfg->duration = x;
+  } else if (strcmp(key, "confirmable") == 0) {
+    cfg->confirmable = x != 0;
+  } else if (strcmp(key, "ack_timeout") == 0) {
+    cfg->ack_timeout = x;
+  } else if (strcmp(key, "max_retransmit") == 0) {
+    cfg->max_retransmit = x;
+  } else if (strcmp(key, "seed") == 0) {
+    cfg->seed = x;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+static int bload_scenario(bload_config_t *cfg, const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  char line[BLOAD_LINE_LEN];
+  unsigned long lineno = 0;
+  int res = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineno++;
+    line[strcspn(line, "#\r\n")] = '\0';
+    char key[BLOAD_LINE_LEN], val[BLOAD_LINE_LEN];
+    int n = sscanf(line, " %[a-z_] = %s", key, val);
+    if (n == EOF) {
+      continue;
+    }
+    if (n != 2 || bload_set(cfg, key, val) < 0) {
+      fprintf(stderr, "%s:%lu: invalid setting\n", path, lineno);
+      res = -1;
+    }
+  }
+  fclose(f);
+  return res;
+}
+
+/*
+A random message setting one or more channels and sometimes a fade time.
+*/
+static void bload_message(bproto_t *b, unsigned *seed) {
+  bproto_value_t vals[BPROTO_CHANNEL_COUNT];
+  bproto_init(b);
+  bproto_channels(b, vals);
+  int fields = rand_r(seed) % ((1 << BPROTO_CHANNEL_COUNT) - 1) + 1;
+  for (int i = 0; i < BPROTO_CHANNEL_COUNT; i++) {
+    if (fields & (1 << i)) {
+      vals[i] = rand_r(seed) % (BPROTO_VALUE_T_MAX + 1);
+    }
+  }
+  bproto_set_channels(b, vals);
+  if (rand_r(seed) % 2) {
+    b->time = rand_r(seed) % 2000;
+  }
+}
+
+/*
+CON or NON PUT /led with token `seq` and `b` as its payload.
+*/
+static size_t bload_encode(uint8_t *out, int type, uint16_t mid, uint32_t seq, bproto_t *b) {
+  size_t i = 0;
+  out[i++] = (1 << 6) | (type << 4) | COAP_TOKEN_LEN;
+  out[i++] = COAP_PUT;
+  out[i++] = mid >> 8;
+  out[i++] = mid & 0xff;
+  out[i++] = seq >> 24;
+  out[i++] = seq >> 16;
+  out[i++] = seq >> 8;
+  out[i++] = seq;
+  out[i++] = (COAP_OPTION_URI_PATH << 4) | (sizeof(BLOAD_PATH) - 1);
+  memcpy(out + i, BLOAD_PATH, sizeof(BLOAD_PATH) - 1);
+  i += sizeof(BLOAD_PATH) - 1;
+  out[i++] = (COAP_OPTION_CONTENT_FORMAT - COAP_OPTION_URI_PATH) << 4; // text/plain
+  out[i++] = 0xff;
+  char *ptr = (char *)out + i;
+  return i + bproto_snprint(&ptr, BLOAD_DGRAM_LEN - i, b);
+}
+
+static int bload_socket(struct addrinfo *target) {
+  int fd = socket(target->ai_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, target->ai_addr, target->ai_addrlen) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int bload_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+Nearest-rank percentile of sorted `lat`, in ms.
+*/
+static double bload_percentile(const uint64_t *lat, size_t n, double p) {
+  if (n == 0) {
+    return 0;
+  }
+  size_t rank = (size_t)(p / 100 * n + 0.999999);
+  return lat[rank > 0 ? rank - 1 : 0] / 1e6;
+}
+
+typedef struct {
+  bload_config_t cfg;
+  bload_client_t *clients;
+  bload_req_t *reqs;
+  size_t len, cap;
+  size_t oldest;           // no request before this is pending
+  uint64_t retransmits, unmatched, errors;
+} bload_t;
+
+static void bload_send(bload_t *l, bload_req_t *r) {
+  if (send(l->clients[r->client].fd, r->dgram, r->len, 0) < 0 && errno != EAGAIN) {
+    l->errors++;
+  }
+}
+
+static uint64_t bload_timeout(bload_t *l) {
+  // ACK_TIMEOUT * uniform(1, ACK_RANDOM_FACTOR 1.5)
+  uint64_t base = (uint64_t)l->cfg.ack_timeout * 1000000;
+  return base + base * (rand_r(&l->cfg.seed) % 1000) / 2000;
+}
+
+static void bload_tick(bload_t *l, unsigned c, uint64_t now) {
+  bload_client_t *client = &l->clients[c];
+  for (unsigned i = 0; i < l->cfg.burst && l->len < l->cap; i++) {
+    bload_req_t *r = &l->reqs[l->len];
+    bproto_t b;
+    bload_message(&b, &l->cfg.seed);
+    r->state = BLOAD_PENDING;
+    r->retransmits = 0;
+    r->client = c;
+    r->mid = client->mid++;
+    r->len = bload_encode(r->dgram, l->cfg.confirmable ? COAP_CON : COAP_NON, r->mid, l->len, &b);
+    r->first = now;
+    r->timeout = bload_timeout(l);
+    r->deadline = now + r->timeout;
+    l->len++;
+    bload_send(l, r);
+  }
+  client->ticks++;
+  client->next += 1e9 * l->cfg.burst / l->cfg.rate;
+}
+
+/*
+Retransmit or give up on requests past their deadline. Returns the earliest
+remaining deadline, or UINT64_MAX.
+*/
+static uint64_t bload_expire(bload_t *l, uint64_t now) {
+  uint64_t next = UINT64_MAX;
+  while (l->oldest < l->len && l->reqs[l->oldest].state != BLOAD_PENDING) {
+    l->oldest++;
+  }
+  for (size_t i = l->oldest; i < l->len; i++) {
+    bload_req_t *r = &l->reqs[i];
+    if (r->state != BLOAD_PENDING) {
+      continue;
+    }
+    if (r->deadline <= now) {
+      if (l->cfg.confirmable && r->retransmits < l->cfg.max_retransmit) {
+	r->retransmits++;
+	l->retransmits++;
+	r->timeout *= 2;
+	r->deadline = now + r->timeout;
+	bload_send(l, r);
+      } else {
+	r->state = BLOAD_LOST;
+	continue;
+      }
+    }
+    if (r->deadline < next) {
+      next = r->deadline;
+    }
+  }
+  return next;
+}
+
+static void bload_receive(bload_t *l, unsigned c, uint64_t now) {
+  uint8_t buf[1500];
+  ssize_t n;
+  while ((n = recv(l->clients[c].fd, buf, sizeof(buf), 0)) >= 0) {
+    if (n < 4 || buf[0] >> 6 != 1) {
+      l->unmatched++;
+      continue;
+    }
+    int type = (buf[0] >> 4) & 0x3, tkl = buf[0] & 0x0f, code = buf[1];
+    uint16_t mid = (buf[2] << 8) | buf[3];
+
+    if (type == COAP_CON) {
+      // Separate response: acknowledge it
+      uint8_t ack[4] = { (1 << 6) | (COAP_ACK << 4), 0, buf[2], buf[3] };
+      send(l->clients[c].fd, ack, sizeof(ack), 0);
+    }
+
+    if (code == 0) {
+      // Empty ACK (response follows) or RST, matched by MID
+      for (size_t i = l->oldest; i < l->len; i++) {
+	bload_req_t *r = &l->reqs[i];
+	if (r->state == BLOAD_PENDING && r->client == c && r->mid == mid) {
+	  if (type == COAP_RST) {
+	    r->state = BLOAD_LOST;
+	  } else {
+	    // Stop retransmitting but keep waiting for the response
+	    r->retransmits = l->cfg.max_retransmit;
+	    r->deadline = r->first + (uint64_t)l->cfg.ack_timeout * 1000000 * 16;
+	  }
+	  break;
+	}
+      }
+      continue;
+    }
+
+    if (tkl != COAP_TOKEN_LEN || n < 4 + COAP_TOKEN_LEN) {
+      l->unmatched++;
+      continue;
+    }
+    uint32_t seq = ((uint32_t)buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
+    if (seq >= l->len || l->reqs[seq].client != c || l->reqs[seq].state != BLOAD_PENDING) {
+      l->unmatched++;
+      continue;
+    }
+    bload_req_t *r = &l->reqs[seq];
+    r->state = BLOAD_DONE;
+    r->code = code;
+    r->latency = now - r->first;
+  }
+}
+
+static void bload_report(bload_t *l, double elapsed) {
+  uint64_t *lat = malloc((l->len ? l->len : 1) * sizeof(uint64_t));
+  size_t done = 0, lost = 0, ok = 0, limited = 0, failed = 0;
+  for (size_t i = 0; i < l->len; i++) {
+    bload_req_t *r = &l->reqs[i];
+    if (r->state == BLOAD_DONE) {
+      lat[done++] = r->latency;
+      if (r->code >> 5 == 2) {
+	ok++;
+      } else if (r->code == ((4 << 5) | 29)) {
+	limited++;
+      } else {
+	failed++;
+      }
+    } else {
+      lost++;
+    }
+  }
+  qsort(lat, done, sizeof(uint64_t), bload_cmp);
+
+  printf("sent:        %zu (%.1f/s)\n", l->len, l->len / elapsed);
+  printf("answered:    %zu (%zu 2.xx, %zu 4.29, %zu other)\n", done, ok, limited, failed);
+  printf("lost:        %zu (%.3f%%)\n", lost, l->len ? 100.0 * lost / l->len : 0);
+  printf("retransmits: %llu\n", (unsigned long long)l->retransmits);
+  printf("unmatched:   %llu\n", (unsigned long long)l->unmatched);
+  if (l->errors) {
+    printf("send errors: %llu\n", (unsigned long long)l->errors);
+  }
+  printf("latency ms:  p50 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+	 bload_percentile(lat, done, 50), bload_percentile(lat, done, 99),
+	 bload_percentile(lat, done, 99.9), done ? lat[done - 1] / 1e6 : 0);
+  free(lat);
+}
+
+int main(int argc, char **argv) {
+  bload_t l = {
+    .cfg = {
+      .clients = 1,
+      .rate = 10,
+      .burst = 1,
+      .duration = 10,
+      .confirmable = 1,
+      .ack_timeout = 2000,
+      .max_retransmit = 4,
+      .seed = 1,
+    },
+  };
+
+  // Scenario first, so the other options override it
+  int opt;
+  while ((opt = getopt(argc, argv, "f:c:r:b:d:nt:m:s:")) != -1) {
+    if (opt == 'f' && bload_scenario(&l.cfg, optarg) < 0) {
+      return 1;
+    } else if (opt == '?') {
+      return bload_usage();
+    }
+  }
+  optind = 1;
+  while ((opt = getopt(argc, argv, "f:c:r:b:d:nt:m:s:")) != -1) {
+    static const char *keys[] = {
+      ['c'] = "clients", ['r'] = "rate", ['b'] = "burst", ['d'] = "duration",
+      ['t'] = "ack_timeout", ['m'] = "max_retransmit", ['s'] = "seed",
+    };
+    if (opt == 'n') {
+      l.cfg.confirmable = 0;
+    } else if (opt != 'f' && bload_set(&l.cfg, keys[opt], optarg) < 0) {
+      fprintf(stderr, "invalid value for -%c: %s\n", opt, optarg);
+      return 2;
+    }
+  }
+  if (optind >= argc || argc - optind > 2) {
+    return bload_usage();
+  }
+  if (l.cfg.clients < 1 || l.cfg.clients > BLOAD_CLIENTS_MAX ||
+      l.cfg.rate <= 0 || l.cfg.burst < 1 || l.cfg.max_retransmit > 255) {
+    fprintf(stderr, "invalid scenario\n");
+    return 2;
+  }
+
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM }, *target;
+  const char *host = argv[optind], *port = optind + 1 < argc ? argv[optind + 1] : BLOAD_PORT;
+  int err = getaddrinfo(host, port, &hints, &target);
+  if (err != 0) {
+    fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+    return 1;
+  }
+
+  l.cap = (size_t)(l.cfg.clients * (l.cfg.rate * l.cfg.duration + l.cfg.burst));
+  l.reqs = malloc((l.cap ? l.cap : 1) * sizeof(bload_req_t));
+  l.clients = calloc(l.cfg.clients, sizeof(bload_client_t));
+  struct pollfd *fds = calloc(l.cfg.clients, sizeof(struct pollfd));
+  if (l.reqs == NULL || l.clients == NULL || fds == NULL) {
+    perror("bload");
+    return 1;
+  }
+
+  uint64_t start = bload_now(), end = start + l.cfg.duration * 1e9;
+  for (unsigned c = 0; c < l.cfg.clients; c++) {
+    if ((l.clients[c].fd = bload_socket(target)) < 0) {
+      perror("socket");
+      return 1;
+    }
+    l.clients[c].mid = rand_r(&l.cfg.seed);
+    // Spread client ticks over one interval so they don't all fire at once
+    l.clients[c].next = start + 1e9 * l.cfg.burst / l.cfg.rate * c / l.cfg.clients;
+    fds[c] = (struct pollfd) { .fd = l.clients[c].fd, .events = POLLIN };
+  }
+  freeaddrinfo(target);
+
+  fprintf(stderr, "%u clients, %.1f req/s each in bursts of %u, %.1fs, %s\n",
+	  l.cfg.clients, l.cfg.rate, l.cfg.burst, l.cfg.duration,
+	  l.cfg.confirmable ? "confirmable" : "non-confirmable");
+
+  for (;;) {
+    uint64_t now = bload_now(), next = UINT64_MAX;
+    for (unsigned c = 0; c < l.cfg.clients; c++) {
+      while (l.clients[c].next <= now && l.clients[c].next < end && l.len < l.cap) {
+	bload_tick(&l, c, now);
+      }
+      if (l.clients[c].next < end && l.len < l.cap && l.clients[c].next < next) {
+	next = l.clients[c].next;
+      }
+    }
+    uint64_t deadline = bload_expire(&l, now);
+    if (next == UINT64_MAX && deadline == UINT64_MAX) {
+      break;
+    }
+    if (deadline < next) {
+      next = deadline;
+    }
+
+    struct timespec timeout = { 0, 0 };
+    if (next > now) {
+      timeout.tv_sec = (next - now) / 1000000000;
+      timeout.tv_nsec = (next - now) % 1000000000;
+    }
+    int ready = ppoll(fds, l.cfg.clients, &timeout, NULL);
+    if (ready < 0 && errno != EINTR) {
+      perror("poll");
+      return 1;
+    }
+    now = bload_now();
+    for (unsigned c = 0; ready > 0 && c < l.cfg.clients; c++) {
+      if (fds[c].revents & POLLIN) {
+	bload_receive(&l, c, now);
+      }
+    }
+  }
+
+  bload_report(&l, (bload_now() - start) / 1e9);
+  for (unsigned c = 0; c < l.cfg.clients; c++) {
+    close(l.clients[c].fd);
+  }
+  free(fds);
+  free(l.clients);
+  free(l.reqs);
+  return 0;
+}
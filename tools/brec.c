@@ -0,0 +1,144 @@
+/*
+brec: convert text logs of bproto messages to recordings and back.
+
+Text logs have one message per line, prefixed with its time in ms:
+
+  0 R255G0B0
+  1500 G255T1000
+
+Usage:
+  brec convert LOG REC     convert a text log to a recording
+  brec dump REC [FROM [TO]] print frames between two times (ms) as a text log
+  brec info REC            print a summary of a recording
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bproto.h"
+#include "bproto_rec.h"
+
+#define BREC_LINE_LEN 256
+
+static int brec_usage(void) {
+  fprintf(stderr,
+	  "usage: brec convert LOG REC\n"
+	  "       brec dump REC [FROM [TO]]\n"
+	  "       brec info REC\n");
+  return 2;
+}
+
+static int brec_convert(const char *in, const char *out) {
+  FILE *log = strcmp(in, "-") == 0 ? stdin : fopen(in, "r");
+  if (log == NULL) {
+    perror(in);
+    return 1;
+  }
+
+  bproto_rec_writer_t w;
+  if (bproto_rec_writer_open(&w, out) < 0) {
+    perror(out);
+    return 1;
+  }
+
+  char line[BREC_LINE_LEN];
+  unsigned long lineno = 0, skipped = 0;
+  while (fgets(line, sizeof(line), log) != NULL) {
+    lineno++;
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0') {
+      continue;
+    }
+
+    char *msg;
+    unsigned long at = strtoul(line, &msg, 10);
+    while (*msg == ' ' || *msg == '\t') {
+      msg++;
+    }
+
+    bproto_t b;
+    if (msg == line || bproto_parse(&b, msg) == msg || at > UINT32_MAX) {
+      fprintf(stderr, "%s:%lu: invalid line, skipped\n", in, lineno);
+      skipped++;
+      continue;
+    }
+    if (bproto_rec_writer_add(&w, at, &b) < 0) {
+      fprintf(stderr, "%s:%lu: %s\n", in, lineno,
+	      errno == EINVAL ? "out of time order" : strerror(errno));
+      bproto_rec_writer_close(&w);
+      return 1;
+    }
+  }
+
+  if (log != stdin) {
+    fclose(log);
+  }
+  if (bproto_rec_writer_close(&w) < 0) {
+    perror(out);
+    return 1;
+  }
+  fprintf(stderr, "%llu frames, %lu skipped\n", (unsigned long long)w.frame_count, skipped);
+  return 0;
+}
+
+static int brec_dump(const char *path, uint32_t from, uint32_t to) {
+  bproto_rec_t rec;
+  if (bproto_rec_open(&rec, path) < 0) {
+    perror(path);
+    return 1;
+  }
+
+  // Start with the frame in effect at `from`
+  size_t i = bproto_rec_seek(&rec, from);
+  if (i > 0) {
+    i--;
+  }
+
+  for (; i < rec.frame_count && rec.frames[i].at <= to; i++) {
+    bproto_t b;
+    char buf[BREC_LINE_LEN];
+    char *ptr = buf;
+    bproto_rec_frame_unpack(&rec.frames[i], &b);
+    int len = bproto_snprint(&ptr, sizeof(buf) - 1, &b);
+    buf[len] = '\0';
+    printf("%u %s\n", rec.frames[i].at, buf);
+  }
+
+  bproto_rec_close(&rec);
+  return 0;
+}
+
+static int brec_info(const char *path) {
+  bproto_rec_t rec;
+  if (bproto_rec_open(&rec, path) < 0) {
+    perror(path);
+    return 1;
+  }
+
+  printf("frames: %zu\n", rec.frame_count);
+  if (rec.frame_count > 0) {
+    printf("start: %u ms\n", rec.frames[0].at);
+    printf("end: %u ms\n", rec.frames[rec.frame_count - 1].at);
+  }
+  printf("index: %u entries every %u ms\n", rec.header->index_len, rec.header->interval);
+
+  bproto_rec_close(&rec);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 4 && strcmp(argv[1], "convert") == 0) {
+    return brec_convert(argv[2], argv[3]);
+  }
+  if (argc >= 3 && argc <= 5 && strcmp(argv[1], "dump") == 0) {
+    uint32_t from = argc > 3 ? strtoul(argv[3], NULL, 10) : 0;
+    uint32_t to = argc > 4 ? strtoul(argv[4], NULL, 10) : UINT32_MAX;
+    return brec_dump(argv[2], from, to);
+  }
+  if (argc == 3 && strcmp(argv[1], "info") == 0) {
+    return brec_info(argv[2]);
+  }
+  return brec_usage();
+}
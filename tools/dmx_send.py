@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""Send Art-Net or E1.31 DMX frames to a blinken device.
+
+Sweeps the four slots starting at --address through a colour ramp at
+--fps. With --stale, every tenth frame is re-sent with an old sequence
+number; the device should drop those.
+
+    tools/dmx_send.py --protocol e131 --universe 1 --address 1 blinken.local
+"""
+import argparse
+import socket
+import struct
+import time
+import uuid
+
+ARTNET_PORT = 6454
+E131_PORT = 5568
+
+
+def artnet_packet(universe, seq, slots):
+    return (b'Art-Net\0' + struct.pack('<H', 0x5000) + struct.pack('>H', 14) +
+            struct.pack('BB', seq, 0) + struct.pack('<H', universe) +
+            struct.pack('>H', len(slots)) + bytes(slots))
+
+
+def e131_packet(universe, seq, slots, cid, name=b'dmx_send'):
+    data = b'\0' + bytes(slots)
+    dmp = struct.pack('>HBBHHH', 0x7000 | (10 + len(data)), 0x02, 0xa1,
+                      0, 1, len(data)) + data
+    framing = (struct.pack('>HI', 0x7000 | (77 + len(dmp)), 0x00000002) +
+               name.ljust(64, b'\0') + struct.pack('>BHBBH', 100, 0, seq, 0,
+                                                   universe) + dmp)
+    root = (struct.pack('>HH', 0x0010, 0) + b'ASC-E1.17\0\0\0' +
+            struct.pack('>HI', 0x7000 | (22 + len(framing)), 0x00000004) +
+            cid + framing)
+    return root
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument('host')
+    ap.add_argument('--protocol', choices=['artnet', 'e131'], default='artnet')
+    ap.add_argument('--universe', type=int,
+                    help='default 0 for Art-Net, 1 for E1.31')
+    ap.add_argument('--address', type=int, default=1)
+    ap.add_argument('--fps', type=float, default=44.0)
+    ap.add_argument('--frames', type=int, default=0, help='0 = forever')
+    ap.add_argument('--stale', action='store_true')
+    args = ap.parse_args()
+    if args.universe is None:
+        args.universe = 0 if args.protocol == 'artnet' else 1
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    port = ARTNET_PORT if args.protocol == 'artnet' else E131_PORT
+    cid = uuid.uuid4().bytes
+    period = 1.0 / args.fps
+    seq = 1
+    frame = 0
+    deadline = time.monotonic()
+
+    while args.frames == 0 or frame < args.frames:
+        slots = [0] * 512
+        level = frame % 256
+        for i, v in enumerate((level, 255 - level, (level * 2) % 256, 0)):
+            slots[args.address - 1 + i] = v
+
+        send_seq = (seq - 5) % 256 if args.stale and frame % 10 == 9 else seq
+        if args.protocol == 'artnet':
+            pkt = artnet_packet(args.universe, send_seq or 1, slots)
+        else:
+            pkt = e131_packet(args.universe, send_seq, slots, cid)
+        sock.sendto(pkt, (args.host, port))
+
+        seq = (seq + 1) % 256
+        frame += 1
+        deadline += period
+        time.sleep(max(0.0, deadline - time.monotonic()))
+
+
+if __name__ == '__main__':
+    main()